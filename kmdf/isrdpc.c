@@ -0,0 +1,696 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+    ISRDPC.C
+
+Abstract:
+    This module contains the interrupt service routine, the interrupt DPC,
+    send interrupt moderation, the interrupt enable/disable callbacks and
+    the passive level completion thread
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#if defined(EVENT_TRACING)
+#include "isrdpc.tmh"
+#endif
+
+
+BOOLEAN
+NICEvtInterruptIsr(
+    IN WDFINTERRUPT     Interrupt,
+    IN ULONG            MessageID
+    )
+/*++
+Routine Description:
+
+    Interrupt service routine. Mask and acknowledge the causes this
+    interrupt services and leave the work to the DPCs: a receive
+    interrupt starts the receive poll, a send interrupt queues the
+    interrupt DPC.
+
+    With MSI-X each cause has a message of its own and the status register
+    isn't read. Otherwise the line may be shared, and the status register
+    tells whether the interrupt is ours.
+
+Arguments:
+
+    Interrupt   Handle to the interrupt object
+    MessageID   Message number, for message signaled interrupts
+
+Return Value:
+
+    TRUE if the interrupt was ours
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    PINTERRUPT_DATA     interruptData;
+    ULONG               status = 0;
+    ULONG               causes;
+    LONG64              now;
+
+    UNREFERENCED_PARAMETER(MessageID);
+
+    fdoData = FdoGetData(WdfInterruptGetDevice(Interrupt));
+    interruptData = InterruptGetData(Interrupt);
+
+    if (fdoData->CSRAddress == NULL) {
+        return FALSE;
+    }
+
+    if (NICIsrReadsStatus(&interruptData->State)) {
+        status = READ_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_STATUS);
+    }
+
+    causes = NICIsrClaim(&interruptData->State, status);
+    if (causes == 0) {
+        return FALSE;
+    }
+
+    //
+    // Mask before acknowledging, so that a level interrupt drops right
+    // away. The DPCs unmask once they are done.
+    //
+    WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_MASK_SET, causes);
+    WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_STATUS, causes);
+
+    //
+    // Keep the time of the first interrupt the DPC hasn't seen yet.
+    //
+    now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    if (causes & NIC_INTR_RX) {
+        fdoData->RecvInterrupts++;
+        InterlockedCompareExchange64(&fdoData->RecvIsrTimeStamp, now, 0);
+        NICScheduleRecvPoll(fdoData);
+    }
+
+    if (causes & NIC_INTR_TX) {
+        fdoData->SendInterrupts++;
+        InterlockedCompareExchange64(&interruptData->IsrTimeStamp, now, 0);
+        WdfInterruptQueueDpcForIsr(Interrupt);
+    }
+
+    return TRUE;
+}
+
+VOID
+NICEvtInterruptDpc(
+    IN WDFINTERRUPT     Interrupt,
+    IN WDFOBJECT        AssociatedObject
+    )
+/*++
+Routine Description:
+
+    Send completion DPC. Re-claim the completed TCBs, adapt the interrupt
+    moderation to how many there were, send what was waiting for them and
+    unmask the send interrupt again. Also queued by the watchdog to
+    recover from a send hang.
+
+    The framework doesn't run the DPC of an interrupt object concurrently
+    with itself, and only one interrupt object services NIC_INTR_TX, so
+    NICHandleSendInterrupt is never called concurrently either.
+
+Arguments:
+
+    Interrupt           Handle to the interrupt object
+    AssociatedObject    Our device
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    ULONG64             completions;
+    ULONG64             microseconds;
+    LONG64              isrTimeStamp;
+    LARGE_INTEGER       start, end;
+
+    fdoData = FdoGetData(AssociatedObject);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC, "--> NICEvtInterruptDpc\n");
+
+    start = KeQueryPerformanceCounter(NULL);
+
+    isrTimeStamp = InterlockedExchange64(&InterruptGetData(Interrupt)->IsrTimeStamp, 0);
+    if (isrTimeStamp) {
+        NICRecordDpcLatency(fdoData, isrTimeStamp, start.QuadPart);
+    }
+
+    completions = fdoData->SendCompletions;
+
+    NICHandleSendInterrupt(fdoData);
+
+    NICModerateSendInterrupt(fdoData,
+                             (ULONG) (fdoData->SendCompletions - completions));
+
+    //
+    // The watchdog saw the send side stall. If the TCBs are still stuck
+    // after picking up whatever did complete, restart the device.
+    //
+    if (InterlockedExchange(&fdoData->SendResetPending, FALSE) &&
+        MP_BUSY_SEND_COUNT(fdoData) > 0) {
+        NICReset(fdoData);
+    }
+
+    NICCheckForQueuedSends(fdoData);
+
+    NICUnmaskInterrupt(Interrupt, NIC_INTR_TX);
+
+    end = KeQueryPerformanceCounter(NULL);
+
+    microseconds = (ULONG64) (end.QuadPart - start.QuadPart) * 1000000 /
+                   fdoData->PerformanceFrequency;
+
+    fdoData->SendDpcHistogram[MP_HISTOGRAM_BUCKET(microseconds)]++;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC, "<-- NICEvtInterruptDpc\n");
+}
+
+VOID
+NICModerateSendInterrupt(
+    IN  PFDO_DATA       FdoData,
+    IN  ULONG           Completed
+    )
+/*++
+Routine Description:
+
+    Adapt the send interrupt moderation to the TCBs the last send
+    interrupt completed. If it brought in at least SendIntrCount, the
+    sends come faster than we let the device batch them: double the count
+    and scale the delay with it. If it brought in a single one, the sends
+    trickle in and holding interrupts back only adds latency: go back to
+    an interrupt per TCB. In between, halve the count.
+
+    The delay is never 0 while the count is above 1, or the last TCBs of
+    a burst would wait for completions that don't come.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Completed   TCBs the send interrupt completed
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG   maxCount;
+    ULONG   count;
+
+    if (!FdoData->SendIntrModeration || FdoData->SendIntrMaxDelay == 0) {
+        return;
+    }
+
+    maxCount = min(FdoData->SendIntrMaxCount, FdoData->NumTcb);
+    count = FdoData->SendIntrCount;
+
+    if (Completed > 1 && Completed >= count) {
+        count = min(count * 2, maxCount);
+    } else if (Completed <= 1) {
+        count = 1;
+    } else {
+        count = max(count / 2, 1);
+    }
+
+    if (count == FdoData->SendIntrCount) {
+        return;
+    }
+
+    FdoData->SendIntrCount = count;
+
+    if (count > 1) {
+        FdoData->SendIntrDelay = max(FdoData->SendIntrMaxDelay * count / maxCount, 1);
+    } else {
+        FdoData->SendIntrDelay = 0;
+    }
+
+    FdoData->SendIntrAdjustments++;
+
+    NICWriteSendModeration(FdoData);
+}
+
+VOID
+NICWriteSendModeration(
+    IN  PFDO_DATA       FdoData
+    )
+/*++
+Routine Description:
+
+    Hand SendIntrCount and SendIntrDelay to the device.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (!FdoData->CSRAddress) {
+        return;
+    }
+
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_INTR_COUNT,
+                         FdoData->SendIntrCount);
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_INTR_DELAY,
+                         FdoData->SendIntrDelay);
+}
+
+VOID
+NICRecordDpcLatency(
+    IN  PFDO_DATA       FdoData,
+    IN  LONG64          IsrTimeStamp,
+    IN  LONG64          Now
+    )
+/*++
+Routine Description:
+
+    Count the time from an ISR to the DPC that picked up its work, in
+    microseconds, in the DpcLatencyHistogram row of the current CPU. The
+    last row is shared by the CPUs above PCIDRV_HISTOGRAM_CPUS - 1.
+    Called from a DPC.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    IsrTimeStamp    Performance counter in the ISR
+    Now             Performance counter at the start of the DPC
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG64 microseconds;
+    ULONG   cpu;
+
+    cpu = KeGetCurrentProcessorNumber();
+
+    microseconds = (ULONG64) (Now - IsrTimeStamp) * 1000000 /
+                   FdoData->PerformanceFrequency;
+
+    if (cpu < PCIDRV_HISTOGRAM_CPUS - 1) {
+        FdoData->DpcLatencyHistogram[cpu][MP_HISTOGRAM_BUCKET(microseconds)]++;
+    } else {
+        //
+        // Shared by every CPU from here up.
+        //
+        InterlockedIncrement64(
+            &FdoData->DpcLatencyHistogram[PCIDRV_HISTOGRAM_CPUS - 1]
+                                         [MP_HISTOGRAM_BUCKET(microseconds)]);
+    }
+}
+
+VOID
+NICUnmaskInterrupt(
+    IN  WDFINTERRUPT    Interrupt,
+    IN  ULONG           Causes
+    )
+/*++
+Routine Description:
+
+    Unmask the given causes of an interrupt at the end of a DPC, unless
+    the interrupt has been disabled in the meantime. Taking the interrupt
+    lock orders this against NICEvtInterruptDisable.
+
+Arguments:
+
+    Interrupt   Handle to the interrupt object that services Causes
+    Causes      NIC_INTR_xxx
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    PINTERRUPT_DATA     interruptData;
+
+    fdoData = FdoGetData(WdfInterruptGetDevice(Interrupt));
+    interruptData = InterruptGetData(Interrupt);
+
+    WdfInterruptAcquireLock(Interrupt);
+
+    Causes = NICUnmaskCauses(&interruptData->State, Causes);
+    if (Causes) {
+        WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_MASK_CLEAR,
+                             Causes);
+    }
+
+    WdfInterruptReleaseLock(Interrupt);
+}
+
+NTSTATUS
+NICEvtInterruptEnable(
+    IN WDFINTERRUPT     Interrupt,
+    IN WDFDEVICE        AssociatedDevice
+    )
+/*++
+Routine Description:
+
+    Called by the framework at DIRQL, holding the interrupt lock, when the
+    device enters D0. Drop anything stale and unmask our causes.
+
+Arguments:
+
+    Interrupt           Handle to the interrupt object
+    AssociatedDevice    Our device
+
+Return Value:
+
+    STATUS_SUCCESS
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    ULONG               causes;
+
+    fdoData = FdoGetData(AssociatedDevice);
+
+    if (fdoData->CSRAddress == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    causes = NICEnableCauses(&InterruptGetData(Interrupt)->State);
+    if (causes) {
+        WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_STATUS,
+                             causes);
+        WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_MASK_CLEAR,
+                             causes);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+NICEvtInterruptDisable(
+    IN WDFINTERRUPT     Interrupt,
+    IN WDFDEVICE        AssociatedDevice
+    )
+/*++
+Routine Description:
+
+    Called by the framework at DIRQL, holding the interrupt lock, when the
+    device leaves D0. Mask our causes; a DPC still running won't unmask
+    them again.
+
+Arguments:
+
+    Interrupt           Handle to the interrupt object
+    AssociatedDevice    Our device
+
+Return Value:
+
+    STATUS_SUCCESS
+
+--*/
+{
+    PFDO_DATA           fdoData;
+    ULONG               causes;
+
+    fdoData = FdoGetData(AssociatedDevice);
+
+    causes = NICDisableCauses(&InterruptGetData(Interrupt)->State);
+    if (causes) {
+        WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_MASK_SET,
+                             causes);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+NICCompleteRequest(
+    IN  PFDO_DATA       FdoData,
+    IN  WDFREQUEST      Request,
+    IN  NTSTATUS        Status,
+    IN  ULONG_PTR       Information
+    )
+/*++
+Routine Description:
+
+    Complete a request the send or receive path is done with. At
+    DISPATCH_LEVEL with PassiveCompletion set, only queue it for the
+    completion thread, so the DPC doesn't pay for the completion.
+    Otherwise complete it right here.
+
+    Any number of DPCs and readers can queue requests at once.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    Request         The request to complete
+    Status          Its final status
+    Information     Bytes transferred
+
+Return Value:
+
+    None
+
+--*/
+{
+    PREQUEST_CONTEXT    requestContext;
+
+    if (!FdoData->PassiveCompletion || KeGetCurrentIrql() < DISPATCH_LEVEL) {
+        WdfRequestCompleteWithInformation(Request, Status, Information);
+        return;
+    }
+
+    requestContext = RequestGetData(Request);
+    requestContext->Status = Status;
+    requestContext->Information = Information;
+
+    //
+    // Only the request that finds the queue empty wakes the thread; the
+    // thread always takes the whole queue once it is up.
+    //
+    if (InterlockedPushEntrySList(&FdoData->CompletionQueue,
+                                  &requestContext->CompletionEntry) == NULL) {
+        KeSetEvent(&FdoData->CompletionEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+__inline
+VOID
+NICCompleteQueuedRequests(
+    IN  PFDO_DATA       FdoData
+    )
+/*++
+Routine Description:
+
+    Take everything in CompletionQueue and complete it, oldest first.
+
+--*/
+{
+    PSLIST_ENTRY        entry;
+    PSLIST_ENTRY        next;
+    PSLIST_ENTRY        oldest = NULL;
+    PREQUEST_CONTEXT    requestContext;
+    ULONG64             count = 0;
+
+    entry = InterlockedFlushSList(&FdoData->CompletionQueue);
+
+    //
+    // The queue is last in, first out; turn it around so the requests
+    // complete in the order the DPCs finished them.
+    //
+    while (entry) {
+        next = entry->Next;
+        entry->Next = oldest;
+        oldest = entry;
+        entry = next;
+    }
+
+    while (oldest) {
+        requestContext = CONTAINING_RECORD(oldest, REQUEST_CONTEXT, CompletionEntry);
+        oldest = oldest->Next;
+
+        WdfRequestCompleteWithInformation(WdfObjectContextGetObject(requestContext),
+                                          requestContext->Status,
+                                          requestContext->Information);
+        count++;
+    }
+
+    if (count) {
+        FdoData->PassiveCompletions += count;
+        FdoData->CompletionBatches++;
+        if (count > FdoData->CompletionBatchMax) {
+            FdoData->CompletionBatchMax = count;
+        }
+    }
+}
+
+VOID
+NICCompletionThread(
+    IN  PVOID           Context
+    )
+/*++
+Routine Description:
+
+    The completion thread. Runs at LOW_REALTIME_PRIORITY so the requests
+    don't wait behind ordinary threads, and completes whatever the DPCs
+    queued each time it is woken up. Exits once CompletionThreadStop is
+    set and the queue is empty.
+
+Arguments:
+
+    Context     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA   fdoData = Context;
+    BOOLEAN     stop;
+
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "--> NICCompletionThread\n");
+
+    do {
+        KeWaitForSingleObject(&fdoData->CompletionEvent,
+                              Executive,
+                              KernelMode,
+                              FALSE,
+                              NULL);
+
+        //
+        // Nothing is queued after the stop, so one more pass is enough.
+        //
+        stop = fdoData->CompletionThreadStop;
+
+        NICCompleteQueuedRequests(fdoData);
+
+    } while (!stop);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "<-- NICCompletionThread\n");
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+NICStartCompletionThread(
+    IN  PFDO_DATA       FdoData
+    )
+/*++
+Routine Description:
+
+    Create the completion thread and keep a reference to it, so that
+    NICStopCompletionThread can wait for it to exit.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NTSTATUS code
+
+--*/
+{
+    NTSTATUS            status;
+    OBJECT_ATTRIBUTES   objectAttributes;
+    HANDLE              threadHandle;
+
+    InitializeObjectAttributes(&objectAttributes,
+                               NULL,
+                               OBJ_KERNEL_HANDLE,
+                               NULL,
+                               NULL);
+
+    status = PsCreateSystemThread(&threadHandle,
+                                  THREAD_ALL_ACCESS,
+                                  &objectAttributes,
+                                  NULL,
+                                  NULL,
+                                  NICCompletionThread,
+                                  FdoData);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+                    "PsCreateSystemThread failed %!STATUS!\n", status);
+        return status;
+    }
+
+    status = ObReferenceObjectByHandle(threadHandle,
+                                       THREAD_ALL_ACCESS,
+                                       *PsThreadType,
+                                       KernelMode,
+                                       (PVOID *) &FdoData->CompletionThread,
+                                       NULL);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+                    "ObReferenceObjectByHandle failed %!STATUS!\n", status);
+
+        //
+        // Let the thread go away on its own.
+        //
+        FdoData->CompletionThread = NULL;
+        FdoData->CompletionThreadStop = TRUE;
+        KeSetEvent(&FdoData->CompletionEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    ZwClose(threadHandle);
+
+    return status;
+}
+
+VOID
+NICStopCompletionThread(
+    IN  PFDO_DATA       FdoData
+    )
+/*++
+Routine Description:
+
+    Stop the completion thread, if there is one, and wait for it to
+    complete what is still queued and exit. Called once no request can be
+    queued anymore.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    if (FdoData->CompletionThread == NULL) {
+        return;
+    }
+
+    FdoData->CompletionThreadStop = TRUE;
+    KeSetEvent(&FdoData->CompletionEvent, IO_NO_INCREMENT, FALSE);
+
+    KeWaitForSingleObject(FdoData->CompletionThread,
+                          Executive,
+                          KernelMode,
+                          FALSE,
+                          NULL);
+
+    ObDereferenceObject(FdoData->CompletionThread);
+    FdoData->CompletionThread = NULL;
+}
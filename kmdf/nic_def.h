@@ -9,6 +9,9 @@
 #ifndef _NIC_DEF_H
 #define _NIC_DEF_H
 
+#include "nic_hw.h"
+#include "nic_intr.h"
+
 // MP_RFD flags
 #define fMP_RFD_RECV_PEND                      0x00000001
 #define fMP_RFD_ALLOC_PEND                     0x00000002
@@ -29,36 +32,128 @@
 #define NIC_PCI_VENDOR_ID               0x10ee
 
 // IO space length
-#define NIC_MAP_IOSPACE_LENGTH          16
+#define NIC_MAP_IOSPACE_LENGTH          64
+
+// CSR registers, as ULONG offsets from CSRAddress
+#define NIC_CSR_TX_RING_BASE            0   // PA of the first HW_TCB, low
+                                            // 32 bits, latches the high ones
+#define NIC_CSR_TX_RING_SIZE            1   // number of TCBs in the ring
+#define NIC_CSR_TX_PRODUCER             2   // send doorbell: next TCB index
+#define NIC_CSR_RX_POST_BASE            3   // PA of the first HW_RBD, low
+                                            // 32 bits, latches the high ones
+#define NIC_CSR_RX_POST_SIZE            4   // number of HW_RBDs in the ring
+#define NIC_CSR_RX_POST_PRODUCER        5   // receive doorbell: next RBD index
+#define NIC_CSR_INTR_MASK_SET           6   // write 1s to mask NIC_INTR_xxx
+#define NIC_CSR_INTR_MASK_CLEAR         7   // write 1s to unmask NIC_INTR_xxx
+#define NIC_CSR_INTR_STATUS             8   // unmasked pending NIC_INTR_xxx,
+                                            // write 1s to acknowledge
+#define NIC_CSR_TX_INTR_COUNT           9   // raise NIC_INTR_TX after this many
+                                            // completed TCBs...
+#define NIC_CSR_TX_INTR_DELAY           10  // ...or this many us after the
+                                            // first one, 0 for right away
+#define NIC_CSR_TX_RESTART              11  // abandon the TCB in progress and
+                                            // fetch again from this index
+#define NIC_CSR_TX_RING_BASE_HI         12  // high 32 bits of TX_RING_BASE
+#define NIC_CSR_RX_POST_BASE_HI         13  // high 32 bits of RX_POST_BASE
+#define NIC_CSR_RX_POST_FLUSH           14  // write 1 to complete every posted
+                                            // HW_RBD as it is, reads 0 once done
+#define NIC_CSR_TX_STOP                 15  // write 1 to stop fetching TCBs after
+                                            // the one in progress, reads 0 once
+                                            // stopped; TX_RESTART starts again
+
+// interrupt causes and MSI-X messages are in nic_intr.h
 
 // change to your company name instead of using Microsoft
 #define NIC_VENDOR_DESC                 "vkorehov"
 
 // number of TCBs per processor - min, default and max
 #define NIC_MIN_TCBS                    16
-#define NIC_DEF_TCBS                    16
-#define NIC_MAX_TCBS                    16
+#define NIC_DEF_TCBS                    256
+#define NIC_MAX_TCBS                    4096
+
+// TCBs held back from ordinary writes for the priority send channel
+#define NIC_PRIORITY_TCBS               4
+
+C_ASSERT(NIC_MIN_TCBS > NIC_PRIORITY_TCBS + 1);
+
+
 
 
+// max number of queued write requests coalesced into a single TCB;
+// every coalesced request takes at least one of the TCB's TBDs
+#define NIC_MAX_COALESCE_REQUESTS       NIC_MAX_PHYS_BUF_COUNT
 
+// max number of finished write requests the send completion handler
+// collects before completing them in one pass
+#define NIC_SEND_COMPLETION_BATCH       32
 
-// max number of physical fragments supported per TCB
-#define NIC_MAX_PHYS_BUF_COUNT          8
+// number of write DMA transactions kept in the pool on top of one per TCB,
+// to cover requests between EvtIoWrite and their program DMA callback
+#define NIC_DMA_TRANSACTION_BACKLOG     16
+
+// number of read buffers that can be posted to the device for zero-copy
+// receive at once; a power of two
+#define NIC_MAX_POSTED_READS            64
+
+// how long NICFreePostedReads waits for an RBD ring flush, in 10us steps
+#define NIC_RX_FLUSH_WAIT               100
+
+// how long NICReset waits for the send engine to stop, in 10us steps
+#define NIC_TX_STOP_WAIT                100
 
 // number of RFDs - min, default and max
 #define MIN_NUM_RFD                     16
 #define NIC_MIN_RFDS                    16
 #define NIC_DEF_RFDS                    16
-#define NIC_MAX_RFDS                    16
+#define NIC_MAX_RFDS                    1024
 
 // only grow the RFDs up to this number
-#define NIC_MAX_GROW_RFDS               16
+#define NIC_MAX_GROW_RFDS               256
+
+// grow the RFDs, NIC_DEF_RFDS at a time, when fewer than this many are
+// ready while the receive handler works through a burst
+#define NIC_RFD_LOW_WATER               NIC_MIN_RFDS
 
 // How many intervals before the RFD list is shrinked?
-#define NIC_RFD_SHRINK_THRESHOLD        0
+#define NIC_RFD_SHRINK_THRESHOLD        10
+
+// number of received words held for readers when no read is pending -
+// default and max; rounded up to a power of two, at least NIC_DEF_RFDS
+#define NIC_DEF_RECV_BACKLOG            256
+#define NIC_MAX_RECV_BACKLOG            4096
 
-// local data buffer size (to copy send packet data into a local buffer)
-#define NIC_BUFFER_SIZE                 4
+// which word to drop when the receive backlog is full
+#define NIC_BACKLOG_DROP_OLDEST         0
+#define NIC_BACKLOG_DROP_NEWEST         1
+
+// largest payload of a received word
+#define NIC_RECV_WORD_SIZE              sizeof(ULONG)
+
+// received words processed per receive poll pass - min, default and max
+#define NIC_MIN_RECV_POLL_BUDGET        NIC_DEF_RFDS
+#define NIC_DEF_RECV_POLL_BUDGET        64
+#define NIC_MAX_RECV_POLL_BUDGET        NIC_MAX_RFDS
+
+// send interrupt moderation: completed TCBs per interrupt and the delay
+// in us the device may hold an interrupt back, at most - default and max
+#define NIC_DEF_SEND_INTR_MAX_COUNT     32
+#define NIC_DEF_SEND_INTR_MAX_DELAY     100
+#define NIC_MAX_SEND_INTR_DELAY         1000
+
+// watchdog timer period in ms
+#define NIC_WATCHDOG_PERIOD             2000
+
+// watchdog intervals with busy TCBs and no send completion before the
+// send side is considered hung and restarted
+#define NIC_SEND_HANG_TICKS             2
+
+// local data buffer size (to copy send packet data into a local buffer);
+// every TCB has one in the send common buffer, a cache line each
+#define NIC_BUFFER_SIZE                 64
+
+// writes up to this many bytes are copied into the TCB's local buffer
+// instead of being mapped for DMA, unless the registry says otherwise
+#define NIC_DEF_COPY_THRESHOLD          NIC_BUFFER_SIZE
 
 // max number of send packets the MiniportSendPackets function can accept
 #define NIC_MAX_SEND_PACKETS            10
@@ -102,7 +197,7 @@
 #endif
 
 #define MP_ALIGNMEM(_p, _align) (((_align) == 0) ? (_p) : (PUCHAR)(((ULONG_PTR)(_p) + ((_align)-1)) & (~((ULONG_PTR)(_align)-1))))
-#define MP_ALIGNMEM_PHYS(_p, _align) (((_align) == 0) ?  (_p) : (((ULONG)(_p) + ((_align)-1)) & (~((ULONG)(_align)-1))))
+#define MP_ALIGNMEM_PHYS(_p, _align) (((_align) == 0) ?  (_p) : (((ULONG64)(_p) + ((_align)-1)) & (~((ULONG64)(_align)-1))))
 #define MP_ALIGNMEM_PA(_p, _align) (((_align) == 0) ?  (_p).QuadPart : (((_p).QuadPart + ((_align)-1)) & (~((ULONGLONG)(_align)-1))))
 
 #define GetListHeadEntry(ListHead)  ((ListHead)->Flink)
@@ -111,6 +206,23 @@
 
 #define IsSListEmpty(ListHead)  (((PSINGLE_LIST_ENTRY)ListHead)->Next == NULL)
 
+#include "nic_ring.h"
+
+//
+// Log2 histogram bucket of a value, see PCIDRV_HISTOGRAM_BUCKETS.
+//
+__inline ULONG MP_HISTOGRAM_BUCKET(
+    IN ULONG64 Value)
+{
+    ULONG bucket = 0;
+
+    while (Value && bucket < PCIDRV_HISTOGRAM_BUCKETS - 1) {
+        Value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
 //--------------------------------------
 // Macros for flag and ref count operations
 //--------------------------------------
@@ -120,51 +232,151 @@
 #define MP_TEST_FLAG(_M, _F)        (((_M)->Flags & (_F)) != 0)
 #define MP_TEST_FLAGS(_M, _F)       (((_M)->Flags & (_F)) == (_F))
 
+//--------------------------------------
+// Hardware receive descriptors. The send descriptors are in nic_hw.h.
+//--------------------------------------
+
+// HW_RBD status bits, written back by the device
+#define HW_RBD_STATUS_COMPLETE          0x00008000
+
+#include <pshpack1.h>
+
+//
+// RBD (Receive Buffer Descriptor): a caller's read buffer posted to the
+// device for zero-copy receive. The device writes the received data into
+// the fragments, then RbdActualCount and RbdStatus.
+//
+typedef struct _HW_RBD
+{
+    ULONG           RbdStatus;          // HW_RBD_STATUS_xxx
+    ULONG           RbdActualCount;     // bytes written by the device
+    ULONG           RbdFragmentCount;   // number of valid fragments, written last
+    ULONG           Reserved1;
+    HW_TBD          RbdFragment[NIC_MAX_PHYS_BUF_COUNT];
+    ULONG           Reserved2[12];      // pad to three cache lines
+} HW_RBD, *PHW_RBD;
+
+// HW_RFD status bits, written back by the device
+#define HW_RFD_STATUS_COMPLETE          0x00008000
+#define HW_RFD_STATUS_CHANNEL           0x00000003  // channel tag of the word
+
+//
+// RFD (Receive Frame Descriptor): one received word. The device writes
+// the word into RfdData, then RfdActualCount, and RfdStatus last.
+//
+typedef struct _HW_RFD
+{
+    ULONG           RfdStatus;          // HW_RFD_STATUS_xxx, written last
+    ULONG           RfdActualCount;     // bytes in RfdData
+    UCHAR           RfdData[NIC_RECV_WORD_SIZE];
+} HW_RFD, *PHW_RFD;
+
+#include <poppack.h>
+
+C_ASSERT(HW_RFD_STATUS_CHANNEL + 1 == PCIDRV_MAX_CHANNELS);
+C_ASSERT(sizeof(HW_RBD) == 3 * MP_CACHE_LINE_SIZE);
+
 //--------------------------------------
 // TCB (Transmit Control Block)
 //--------------------------------------
 typedef struct _MP_TCB
 {
-    struct _MP_TCB    *Next;
     ULONG             Flags;
     ULONG             Count;
     WDFDMATRANSACTION DmaTransaction;
 
-    PULONG           HwTcb;            // ptr to HW TCB VA
-    ULONG            HwTcbPhys;        // ptr to HW TCB PA
-    PULONG           PrevHwTcb;        // ptr to previous HW TCB VA
+    PHW_TCB          HwTcb;            // ptr to HW TCB VA
+    ULONG64          HwTcbPhys;        // ptr to HW TCB PA
+    PHW_TCB          PrevHwTcb;        // ptr to previous HW TCB VA
+
+    PHW_TBD          HwTbd;            // ptr to first TBD
+    ULONG64          HwTbdPhys;        // ptr to first TBD PA
 
-    PULONG           HwTbd;            // ptr to first TBD
-    ULONG            HwTbdPhys;        // ptr to first TBD PA
+    PUCHAR           LocalBuffer;      // NIC_BUFFER_SIZE bytes of common buffer
+    ULONG64          LocalBufferPhys;  // PA of LocalBuffer
 
 } MP_TCB, *PMP_TCB;
 
+//--------------------------------------
+// Finished write requests collected by the send completion handler
+// while it walks the TCB ring, completed together afterwards
+//--------------------------------------
+typedef struct _MP_SEND_BATCH
+{
+    ULONG             Count;
+    ULONG64           Bytes;
+    WDFREQUEST        Requests[NIC_SEND_COMPLETION_BATCH];
+    ULONG             Lengths[NIC_SEND_COMPLETION_BATCH];
+    NTSTATUS          Status[NIC_SEND_COMPLETION_BATCH];
+
+} MP_SEND_BATCH, *PMP_SEND_BATCH;
+
+C_ASSERT(NIC_SEND_COMPLETION_BATCH >= NIC_MAX_COALESCE_REQUESTS);
+
+#define MP_INIT_SEND_BATCH(_B)      { (_B)->Count = 0; (_B)->Bytes = 0; }
+
 //--------------------------------------
 // RFD (Receive Frame Descriptor)
 //--------------------------------------
 typedef struct _MP_RFD
 {
-    LIST_ENTRY              List;
     PVOID                   Buffer;           // Pointer to Buffer
-    PMDL                    Mdl;
-    PULONG                  HwRfd;            // ptr to hardware RFD
-    WDFCOMMONBUFFER         WdfCommonBuffer;
-    PULONG                  OriginalHwRfd;    // ptr to shared memory
+    PHW_RFD                 HwRfd;            // ptr to hardware RFD, a slot of HwRfdMem
     PHYSICAL_ADDRESS        HwRfdLa;          // logical address of RFD
-    PHYSICAL_ADDRESS        OriginalHwRfdLa;  // Original physical address allocated by NDIS
-    ULONG                   HwRfdPhys;        // lower part of HwRfdPa
-    BOOLEAN                 DeleteCommonBuffer; // Indicates if WdfObjectDelete
-                                                      // is to be called when freeing MD_RFD.
+    ULONG64                 HwRfdPhys;        // HwRfdLa as the device sees it
     ULONG                   Flags;
     ULONG                   PacketSize;       // total size of receive frame
-    WDFMEMORY               LookasideMemoryHdl;
+    ULONG                   Channel;          // HW_RFD_STATUS_CHANNEL tag
+    ULONG                   Sequence;         // PCIDRV_RECORD_HEADER sequence
+    LARGE_INTEGER           TimeStamp;        // when the receive handler took it
 } MP_RFD, *PMP_RFD;
 
 
+//--------------------------------------
+// A read request posted to the device as a HW_RBD
+//--------------------------------------
+typedef struct _MP_RBD
+{
+    WDFDMATRANSACTION       DmaTransaction;
+    ULONG                   Length;           // bytes posted
+} MP_RBD, *PMP_RBD;
+
+
+//--------------------------------------
+// A received word waiting in the receive backlog for a reader
+//--------------------------------------
+typedef struct _MP_RECV_RECORD
+{
+    ULONG                   Sequence;
+    ULONG                   Length;
+    ULONG64                 TimeStamp;
+    UCHAR                   Data[NIC_RECV_WORD_SIZE];
+} MP_RECV_RECORD, *PMP_RECV_RECORD;
+
 //--------------------------------------
 // Macros specific to miniport adapter structure
 //--------------------------------------
-#define MP_TCB_RESOURCES_AVAIABLE(_M) ((_M)->nBusySend < (_M)->NumTcb)
+//
+// The TCB ring indices run freely and NumTcb is a power of two.
+//
+#define MP_GET_TCB(_M, _Index)      (&((PMP_TCB)(_M)->MpTcbMem)[(_Index) & ((_M)->NumTcb - 1)])
+#define MP_BUSY_SEND_COUNT(_M)      MP_RING_COUNT(&(_M)->SendHead, &(_M)->SendTail)
+//
+// One TCB is never used, so a full ring can't look empty to the device
+// (see MP_RING_CAPACITY). The NIC_PRIORITY_TCBS TCBs below it are only
+// handed out to priority sends, so an e-stop never waits for the write
+// backlog.
+//
+#define MP_MAX_BUSY_SEND(_M)          MP_RING_CAPACITY((_M)->NumTcb)
+#define MP_TCB_RESOURCES_AVAIABLE(_M) (MP_BUSY_SEND_COUNT(_M) < MP_MAX_BUSY_SEND(_M) - NIC_PRIORITY_TCBS)
+#define MP_PRIORITY_TCB_AVAILABLE(_M) (MP_BUSY_SEND_COUNT(_M) < MP_MAX_BUSY_SEND(_M))
+
+//
+// The receive ring indices run freely and RecvRingSize is a power of two.
+// Only touched with RcvLock held.
+//
+#define MP_RECV_RING_SLOT(_M, _Index) ((_M)->RecvRing[(_Index) & ((_M)->RecvRingSize - 1)])
+#define MP_READY_RECV_COUNT(_M)     ((_M)->RecvTail - (_M)->RecvHead)
 
 #define MP_OFFSET(field)   ((UINT)FIELD_OFFSET(MP_ADAPTER,field))
 #define MP_SIZE(field)     sizeof(((PMP_ADAPTER)0)->field)
@@ -206,6 +418,7 @@ __inline VOID MP_STALL_EXECUTION(
 }
 
 typedef struct _FDO_DATA FDO_DATA, *PFDO_DATA;
+typedef struct _MP_RECV_CHANNEL MP_RECV_CHANNEL, *PMP_RECV_CHANNEL;
 
 NTSTATUS
 NICGetDeviceInformation(
@@ -254,11 +467,70 @@ EVT_WDF_IO_QUEUE_IO_WRITE PciDrvEvtIoWrite;
 
 EVT_WDF_PROGRAM_DMA NICEvtProgramDmaFunction;
 
+EVT_WDF_IO_QUEUE_IO_READ PciDrvEvtIoRead;
+
+EVT_WDF_PROGRAM_DMA NICEvtProgramReadDmaFunction;
+
+EVT_WDF_REQUEST_CANCEL NICEvtPostedReadCancel;
+
 EVT_WDF_TIMER NICWatchDogEvtTimerFunc;
 
 EVT_WDF_WORKITEM NICAllocRfdWorkItem;
 EVT_WDF_WORKITEM NICFreeRfdWorkItem;
 
+EVT_WDF_IO_QUEUE_STATE NICEvtReadQueueReady;
+
+EVT_WDF_DPC NICEvtRecvPollDpc;
+
+EVT_WDF_INTERRUPT_ISR NICEvtInterruptIsr;
+EVT_WDF_INTERRUPT_DPC NICEvtInterruptDpc;
+EVT_WDF_INTERRUPT_ENABLE NICEvtInterruptEnable;
+EVT_WDF_INTERRUPT_DISABLE NICEvtInterruptDisable;
+
+VOID
+NICModerateSendInterrupt(
+    IN  PFDO_DATA       FdoData,
+    IN  ULONG           Completed
+    );
+
+VOID
+NICWriteSendModeration(
+    IN  PFDO_DATA       FdoData
+    );
+
+VOID
+NICRecordDpcLatency(
+    IN  PFDO_DATA       FdoData,
+    IN  LONG64          IsrTimeStamp,
+    IN  LONG64          Now
+    );
+
+VOID
+NICUnmaskInterrupt(
+    IN  WDFINTERRUPT    Interrupt,
+    IN  ULONG           Causes
+    );
+
+VOID
+NICCompleteRequest(
+    IN  PFDO_DATA       FdoData,
+    IN  WDFREQUEST      Request,
+    IN  NTSTATUS        Status,
+    IN  ULONG_PTR       Information
+    );
+
+NTSTATUS
+NICStartCompletionThread(
+    IN  PFDO_DATA       FdoData
+    );
+
+VOID
+NICStopCompletionThread(
+    IN  PFDO_DATA       FdoData
+    );
+
+KSTART_ROUTINE NICCompletionThread;
+
 NTSTATUS
 NICAllocAdapterMemory(
     IN  PFDO_DATA     FdoData
@@ -322,16 +594,26 @@ NICWritePacket(
     IN  PSCATTER_GATHER_LIST    SGList
     );
 
+NTSTATUS
+NICCopyWritePacket(
+    IN  PFDO_DATA               FdoData,
+    IN  WDFREQUEST              Request,
+    IN  ULONG                   Length
+    );
+
 NTSTATUS
 NICSendPacket(
     IN  PFDO_DATA     FdoData,
     IN  PMP_TCB       pMpTcb,
     IN  PSCATTER_GATHER_LIST   ScatterGather);
 
-NTSTATUS
+VOID
 NICStartSend(
-    IN  PFDO_DATA     FdoData,
-    IN  PMP_TCB       pMpTcb);
+    IN  PFDO_DATA     FdoData);
+
+VOID
+NICInitSendRegisters(
+    IN  PFDO_DATA     FdoData);
 
 NTSTATUS
 NICHandleSendInterrupt(
@@ -370,7 +652,7 @@ NICShutdown(
 
 __drv_sameIRQL
 __drv_requiresIRQL(DISPATCH_LEVEL)
-VOID
+BOOLEAN
 NICHandleRecvInterrupt(
     IN  PFDO_DATA  FdoData
     );
@@ -380,16 +662,33 @@ NICStartRecv(
     IN  PFDO_DATA  FdoData
     );
 
+VOID
+NICScheduleRecvPoll(
+    IN  PFDO_DATA  FdoData
+    );
+
 VOID
 NICResetRecv(
     IN  PFDO_DATA   FdoData
     );
 
-VOID
+ULONG
 NICServiceReadIrps(
     PFDO_DATA FdoData,
     PMP_RFD *PacketArray,
-    ULONG PacketArrayCount
+    ULONG PacketArrayCount,
+    PMP_RFD *PacketFreeArray
+    );
+
+BOOLEAN
+NICPushRecvBacklog(
+    IN  PMP_RECV_CHANNEL    Channel,
+    IN  PMP_RFD             pMpRfd
+    );
+
+VOID
+NICDrainRecvBacklog(
+    IN  PMP_RECV_CHANNEL    Channel
     );
 
 BOOLEAN
@@ -410,10 +709,73 @@ NICGetDeviceInfSettings(
 
 NTSTATUS
 NICInitiateDmaTransfer(
+    IN PFDO_DATA        FdoData,
+    IN WDFREQUEST       Request,
+    IN BOOLEAN          Priority,
+    IN BOOLEAN          Pended
+    );
+
+NTSTATUS
+NICSendPriorityRequest(
     IN PFDO_DATA        FdoData,
     IN WDFREQUEST       Request
     );
 
+NTSTATUS
+NICAllocDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    OUT WDFDMATRANSACTION   *DmaTransaction
+    );
+
+VOID
+NICFreeDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    IN  WDFDMATRANSACTION   DmaTransaction
+    );
+
+VOID
+NICCompletePostedReads(
+    IN  PFDO_DATA           FdoData
+    );
+
+VOID
+NICFreePostedReads(
+    IN  PFDO_DATA           FdoData
+    );
+
+VOID
+NICFlushPostedReads(
+    IN  PFDO_DATA           FdoData
+    );
+
+BOOLEAN
+NICReleasePostedRead(
+    IN  WDFREQUEST          Request
+    );
+
+VOID
+NICInitRecvRegisters(
+    IN  PFDO_DATA           FdoData
+    );
+
+NTSTATUS
+NICCreateDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    OUT WDFDMATRANSACTION   *DmaTransaction
+    );
+
+NTSTATUS
+NICInitDmaTransactionPool(
+    IN  PFDO_DATA     FdoData
+    );
+
+NTSTATUS
+NICInitiateCoalescedDmaTransfer(
+    IN PFDO_DATA        FdoData,
+    __in_ecount(RequestCount) WDFREQUEST *Requests,
+    IN ULONG            RequestCount
+    );
+
 typedef
 USHORT
 (*PREAD_PORT)(
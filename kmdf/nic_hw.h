@@ -0,0 +1,117 @@
+/*++
+
+Module Name:
+
+    nic_hw.h
+
+Abstract:
+
+    Layout of the send descriptors the device reads, and the encoder that
+    turns a scatter/gather list into TBDs. Nothing here depends on the
+    framework, so the user-mode descriptor test in test\unit builds it
+    as it is.
+
+--*/
+
+#ifndef _NIC_HW_H
+#define _NIC_HW_H
+
+// max number of physical fragments supported per TCB
+#define NIC_MAX_PHYS_BUF_COUNT          8
+
+// keeps fields written by different processors on separate cache lines
+#define MP_CACHE_LINE_SIZE         64
+
+//--------------------------------------
+// Hardware send descriptors
+//
+// The send common buffer holds NumTcb HW_TCBs followed by NumTcb arrays of
+// NIC_MAX_PHYS_BUF_COUNT HW_TBDs. Both start on a cache line; a TCB is
+// exactly one cache line long and a TBD array two, so the device fetches
+// a TCB or its whole TBD array in whole lines and two TCBs never share a
+// line. Every address in a descriptor is a full 64-bit logical address.
+//--------------------------------------
+
+// HW_TCB command bits
+#define HW_TCB_CMD_TRANSMIT             0x00000004
+#define HW_TCB_CMD_FLEXIBLE             0x00000008  // data described by TBDs
+
+// HW_TCB status bits, written back by the device
+#define HW_TCB_STATUS_COMPLETE          0x00008000
+#define HW_TCB_STATUS_OK                0x00002000
+
+#include <pshpack1.h>
+
+//
+// TBD (Transmit Buffer Descriptor): one physically contiguous fragment
+//
+typedef struct _HW_TBD
+{
+    ULONG64         TbdBufferAddress;   // PA of the fragment
+    ULONG           TbdCount;           // length of the fragment in bytes
+    ULONG           Reserved;
+} HW_TBD, *PHW_TBD;
+
+//
+// TCB (Transmit Command Block) as the device reads it
+//
+typedef struct _HW_TCB
+{
+    ULONG           TxCbStatus;         // HW_TCB_STATUS_xxx
+    ULONG           TxCbCommand;        // HW_TCB_CMD_xxx, written last
+    ULONG64         TxCbLink;           // PA of the next TCB in the ring
+    ULONG64         TxCbTbdPointer;     // PA of the TBD array
+    ULONG           TxCbByteCount;      // total bytes in the TBDs
+    UCHAR           TxCbTbdNumber;      // number of valid TBDs
+    UCHAR           TxCbThreshold;
+    USHORT          Reserved1;
+    ULONG           Reserved2[8];       // pad to a cache line
+} HW_TCB, *PHW_TCB;
+
+#include <poppack.h>
+
+C_ASSERT(sizeof(HW_TCB) == MP_CACHE_LINE_SIZE);
+C_ASSERT(sizeof(HW_TBD) * NIC_MAX_PHYS_BUF_COUNT == 2 * MP_CACHE_LINE_SIZE);
+C_ASSERT(FIELD_OFFSET(HW_TCB, TxCbLink) % sizeof(ULONG64) == 0);
+
+//
+// Fill TBDs from a scatter/gather list, one per element, skipping empty
+// elements. The caller has checked the list has no more than
+// NIC_MAX_PHYS_BUF_COUNT elements. Returns the number of TBDs filled;
+// ByteCount receives their total length and HighFragments how many of
+// them lie above 4GB.
+//
+__inline UCHAR NICEncodeTbds(
+    OUT PHW_TBD Tbd,
+    IN PSCATTER_GATHER_LIST ScatterGather,
+    OUT PULONG ByteCount,
+    OUT PULONG HighFragments)
+{
+    ULONG   index;
+    UCHAR   tbdCount = 0;
+
+    *ByteCount = 0;
+    *HighFragments = 0;
+
+    for (index = 0; index < ScatterGather->NumberOfElements; index++)
+    {
+        if (ScatterGather->Elements[index].Length)
+        {
+            Tbd->TbdBufferAddress =
+                ScatterGather->Elements[index].Address.QuadPart;
+            Tbd->TbdCount = ScatterGather->Elements[index].Length;
+
+            if (ScatterGather->Elements[index].Address.HighPart) {
+                (*HighFragments)++;
+            }
+
+            *ByteCount += Tbd->TbdCount;
+            Tbd++;
+            tbdCount++;
+        }
+    }
+
+    return tbdCount;
+}
+
+#endif  // _NIC_HW_H
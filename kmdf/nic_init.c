@@ -32,13 +32,17 @@ Environment:
 #pragma alloc_text (PAGE, NICAllocateSoftwareResources)
 #pragma alloc_text (PAGE, NICFreeSoftwareResources)
 #pragma alloc_text (PAGE, NICMapHWResources)
+#pragma alloc_text (PAGE, NICInitSendRegisters)
+#pragma alloc_text (PAGE, NICInitRecvRegisters)
 #pragma alloc_text (PAGE, NICUnmapHWResources)
 #pragma alloc_text (PAGE, NICGetDeviceInformation)
 #pragma alloc_text (PAGE, NICAllocAdapterMemory)
 #pragma alloc_text (PAGE, NICFreeAdapterMemory)
 #pragma alloc_text (PAGE, NICInitRecvBuffers)
+#pragma alloc_text (PAGE, NICInitDmaTransactionPool)
 #pragma alloc_text (PAGE, NICAllocRfd)
 #pragma alloc_text (PAGE, NICFreeRfd)
+#pragma alloc_text (PAGE, NICAllocRfdWorkItem)
 #pragma alloc_text (PAGE, NICFreeRfdWorkItem)
 #endif
 
@@ -70,8 +74,15 @@ Return Value:
     WDF_DMA_ENABLER_CONFIG          dmaConfig;
     ULONG                           maximumLength, maxLengthSupported;
     WDF_OBJECT_ATTRIBUTES           attributes;
+    WDF_WORKITEM_CONFIG             workItemConfig;
+    WDF_TIMER_CONFIG                timerConfig;
+    WDF_DPC_CONFIG                  dpcConfig;
+    WDF_INTERRUPT_CONFIG            interruptConfig;
+    LARGE_INTEGER                   frequency;
     ULONG                           maxMapRegistersRequired, miniMapRegisters;
     ULONG                           mapRegistersAllocated;
+    PMP_RECV_CHANNEL                channel;
+    ULONG                           index;
 
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "-->NICAllocateSoftwareResources\n");
 
@@ -82,7 +93,14 @@ Return Value:
     // uninitialized list in the ContextCleanup callback if the
     // AddDevice fails for any reason.
     //
-    InitializeListHead(&FdoData->RecvList);
+    InitializeSListHead(&FdoData->DmaTransactionPool);
+    KeInitializeSpinLock(&FdoData->DmaTransactionPoolLock);
+
+    InitializeSListHead(&FdoData->CompletionQueue);
+    KeInitializeEvent(&FdoData->CompletionEvent, SynchronizationEvent, FALSE);
+
+    KeQueryPerformanceCounter(&frequency);
+    FdoData->PerformanceFrequency = (ULONG64) frequency.QuadPart;
 
     //
     // This a global lock, to synchonize access to device context.
@@ -120,6 +138,18 @@ Return Value:
 
     NICGetDeviceInfSettings(FdoData);
 
+    //
+    // Without its thread, the DPCs complete the requests themselves.
+    //
+    if (FdoData->PassiveCompletion) {
+        status = NICStartCompletionThread(FdoData);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_WARNING, DBG_INIT,
+                        "Completing requests in the DPCs instead\n");
+            FdoData->PassiveCompletion = FALSE;
+        }
+    }
+
     //
     // We will create and configure a queue for receiving
     // write requests. If these requests have to be pended for any
@@ -188,13 +218,9 @@ Return Value:
         return status;
     }
 
-
     //
-    // Manual queue for read requests (WdfRequestTypeRead). We will configure the queue
-    // so that incoming read requests are directly dispatched to this queue. We will
-    // manually remove the requests from the queue and service them in our recv
-    // interrupt handler.  WDF_IO_QUEUE_CONFIG_INIT initializes queues to be
-    // auto managed by default.
+    // Manual internal queue for priority send requests that found even the
+    // reserved TCBs busy. It is always drained before the PendingWriteQueue.
     //
     WDF_IO_QUEUE_CONFIG_INIT(
         &ioQueueConfig,
@@ -205,7 +231,75 @@ Return Value:
                    FdoData->WdfDevice,
                    &ioQueueConfig,
                    WDF_NO_OBJECT_ATTRIBUTES,
-                   &FdoData->PendingReadQueue
+                   &FdoData->PendingPriorityQueue
+                   );
+
+    if(!NT_SUCCESS (status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Error Creating manual priority Queue 0x%x\n", status);
+        return status;
+    }
+
+    //
+    // Manual queues for read requests (WdfRequestTypeRead), one per receive
+    // channel. The parallel read queue below forwards every read to the
+    // queue of the channel its file was opened on. We will manually remove
+    // the requests from the queues and service them in our recv interrupt
+    // handler.
+    //
+    for (index = 0; index < PCIDRV_MAX_CHANNELS; index++) {
+
+        channel = &FdoData->RecvChannel[index];
+        channel->FdoData = FdoData;
+        channel->Index = index;
+
+        WDF_IO_QUEUE_CONFIG_INIT(
+            &ioQueueConfig,
+            WdfIoQueueDispatchManual
+            );
+
+        status = WdfIoQueueCreate (
+                       FdoData->WdfDevice,
+                       &ioQueueConfig,
+                       WDF_NO_OBJECT_ATTRIBUTES,
+                       &channel->PendingReadQueue
+                       );
+
+        if(!NT_SUCCESS (status)){
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Error Creating read Queue %d 0x%x\n", index, status);
+            return status;
+        }
+
+        //
+        // Words that came in while no read was pending wait in the backlog
+        // of their channel; hand them over as soon as a read shows up.
+        //
+        status = WdfIoQueueReadyNotify(channel->PendingReadQueue,
+                                       NICEvtReadQueueReady,
+                                       channel);
+
+        if(!NT_SUCCESS (status)){
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfIoQueueReadyNotify failed 0x%x\n", status);
+            return status;
+        }
+    }
+
+    //
+    // Read requests go to a parallel queue whose EvtIoRead picks the
+    // channel's manual queue above, or, for zero-copy receive, posts the
+    // request buffers to the device.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &ioQueueConfig,
+        WdfIoQueueDispatchParallel
+        );
+
+    ioQueueConfig.EvtIoRead = PciDrvEvtIoRead;
+
+    status = WdfIoQueueCreate (
+                   FdoData->WdfDevice,
+                   &ioQueueConfig,
+                   WDF_NO_OBJECT_ATTRIBUTES,
+                   &FdoData->ReadQueue
                    );
 
     if(!NT_SUCCESS (status)){
@@ -215,7 +309,7 @@ Return Value:
 
     status = WdfDeviceConfigureRequestDispatching(
                     FdoData->WdfDevice,
-                    FdoData->PendingReadQueue,
+                    FdoData->ReadQueue,
                     WdfRequestTypeRead);
 
     if(!NT_SUCCESS (status)){
@@ -224,6 +318,40 @@ Return Value:
         return status;
     }
 
+    //
+    // Parallel queue for device I/O control requests. These are handled
+    // right away and never pended.
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(
+        &ioQueueConfig,
+        WdfIoQueueDispatchParallel
+        );
+
+    ioQueueConfig.EvtIoDeviceControl = PciDrvEvtIoDeviceControl;
+
+    status = WdfIoQueueCreate (
+                   FdoData->WdfDevice,
+                   &ioQueueConfig,
+                   WDF_NO_OBJECT_ATTRIBUTES,
+                   &FdoData->IoctlQueue
+                   );
+
+    if(!NT_SUCCESS (status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Error Creating ioctl Queue 0x%x\n", status);
+        return status;
+    }
+
+    status = WdfDeviceConfigureRequestDispatching(
+                    FdoData->WdfDevice,
+                    FdoData->IoctlQueue,
+                    WdfRequestTypeDeviceControl);
+
+    if(!NT_SUCCESS (status)){
+        ASSERT(NT_SUCCESS(status));
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Error in config'ing ioctl Queue 0x%x\n", status);
+        return status;
+    }
+
     //
     // Alignment requirement must be 16-byte for this device. This alignment
     // value will be inherits by the DMA enabler and used when you allocate
@@ -238,11 +366,13 @@ Return Value:
     miniMapRegisters = BYTES_TO_PAGES(NIC_MAX_PACKET_SIZE) + 1;
 
     //
-    // Maximum map registers required to do simultaneous transfer
-    // of all TCBs assuming each packet spanning NIC_MAX_PHYS_BUF_COUNT
-    // Buffer can span multiple MDLs.
+    // Map registers are held per DMA transfer, not per TCB, so size the
+    // enabler for the largest single transfer we program into one TCB:
+    // NIC_MAX_PHYS_BUF_COUNT fragments. Budgeting for every TCB at once
+    // would grow linearly with the ring depth and exhaust the adapter's
+    // map registers long before a deep ring is full.
     //
-    maxMapRegistersRequired = FdoData->NumTcb * NIC_MAX_PHYS_BUF_COUNT;
+    maxMapRegistersRequired = NIC_MAX_PHYS_BUF_COUNT;
 
     //
     // The maximum length of buffer for maxMapRegistersRequired number of
@@ -251,10 +381,12 @@ Return Value:
     maximumLength = (maxMapRegistersRequired-1) << PAGE_SHIFT;
 
     //
-    // Create a new DMA Object for Scatter/Gather DMA mode.
+    // Create a new DMA Object for Scatter/Gather DMA mode. The descriptors
+    // carry 64-bit addresses, so buffers above 4GB go to the device as they
+    // are instead of through map register bounce buffers.
     //
     WDF_DMA_ENABLER_CONFIG_INIT( &dmaConfig,
-                                 WdfDmaProfileScatterGather,
+                                 WdfDmaProfileScatterGather64,
                                  maximumLength );
 
     status = WdfDmaEnablerCreate( FdoData->WdfDevice,
@@ -283,16 +415,23 @@ Return Value:
     }
 
     //
-    // Adjust our TCB count based on the MapRegisters we got. We will
-    // take the best case scenario where the packet is going to span
-    // no more than 2 pages.
+    // The ring depth is not derived from the map registers: a TCB only
+    // holds them while its transfer is in flight and the transfer length
+    // is capped by the enabler. Just make sure the registry value stays
+    // in range.
     //
-    FdoData->NumTcb = mapRegistersAllocated/miniMapRegisters;
+    FdoData->NumTcb = min(FdoData->NumTcb, NIC_MAX_TCBS);
+    FdoData->NumTcb = max(FdoData->NumTcb, NIC_MIN_TCBS);
 
     //
-    // Make sure it doesn't exceed NIC_MAX_TCBS.
+    // The TCB ring is indexed with free running counters masked by
+    // NumTcb - 1, so round it down to a power of two.
     //
-    FdoData->NumTcb = min(FdoData->NumTcb, NIC_MAX_TCBS);
+    while (FdoData->NumTcb & (FdoData->NumTcb - 1)) {
+        FdoData->NumTcb &= FdoData->NumTcb - 1;
+    }
+
+    FdoData->MapRegisters = mapRegistersAllocated;
 
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT,
                 "MapRegisters Allocated %d\n", mapRegistersAllocated);
@@ -325,6 +464,129 @@ Return Value:
         return status;
     }
 
+    //
+    // Work items to grow and shrink the RFD pool.
+    //
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, NICAllocRfdWorkItem);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FdoData->WdfDevice;
+    status = WdfWorkItemCreate(&workItemConfig,
+                               &attributes,
+                               &FdoData->AllocRfdWorkItem);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfWorkItemCreate failed 0x%x\n", status);
+        return status;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig, NICFreeRfdWorkItem);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FdoData->WdfDevice;
+    status = WdfWorkItemCreate(&workItemConfig,
+                               &attributes,
+                               &FdoData->FreeRfdWorkItem);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfWorkItemCreate failed 0x%x\n", status);
+        return status;
+    }
+
+    //
+    // DPC that polls the receive ring with the receive interrupt masked.
+    //
+    WDF_DPC_CONFIG_INIT(&dpcConfig, NICEvtRecvPollDpc);
+    dpcConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FdoData->WdfDevice;
+    status = WdfDpcCreate(&dpcConfig,
+                          &attributes,
+                          &FdoData->RecvPollDpc);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfDpcCreate failed 0x%x\n", status);
+        return status;
+    }
+
+    //
+    // The ISR queues the poll on its own processor unless it is bound to
+    // one of the receive interrupt's.
+    //
+    if (FdoData->RecvInterruptAffinity) {
+
+        FdoData->RecvPollProcessor =
+            RtlFindLeastSignificantBit(FdoData->RecvInterruptAffinity);
+
+        KeSetTargetProcessorDpc(WdfDpcWdmGetDpc(FdoData->RecvPollDpc),
+                                (CCHAR) FdoData->RecvPollProcessor);
+    }
+
+    //
+    // Interrupts. The framework hands out the interrupt resources in the
+    // order the objects are created, so with MSI-X the receive interrupt
+    // gets message NIC_MSIX_RECV_MESSAGE and the send interrupt
+    // NIC_MSIX_SEND_MESSAGE. NICMapHWResources decides which causes each
+    // one services once the resources are known.
+    //
+    WDF_INTERRUPT_CONFIG_INIT(&interruptConfig,
+                              NICEvtInterruptIsr,
+                              NICEvtInterruptDpc);
+
+    interruptConfig.EvtInterruptEnable = NICEvtInterruptEnable;
+    interruptConfig.EvtInterruptDisable = NICEvtInterruptDisable;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, INTERRUPT_DATA);
+
+    status = WdfInterruptCreate(FdoData->WdfDevice,
+                                &interruptConfig,
+                                &attributes,
+                                &FdoData->RecvInterrupt);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfInterruptCreate failed 0x%x\n", status);
+        return status;
+    }
+
+    if (FdoData->RecvInterruptAffinity) {
+        WdfInterruptSetPolicy(FdoData->RecvInterrupt,
+                              WdfIrqPolicySpecifiedProcessors,
+                              WdfIrqPriorityUndefined,
+                              (KAFFINITY) FdoData->RecvInterruptAffinity);
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, INTERRUPT_DATA);
+
+    status = WdfInterruptCreate(FdoData->WdfDevice,
+                                &interruptConfig,
+                                &attributes,
+                                &FdoData->SendInterrupt);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfInterruptCreate failed 0x%x\n", status);
+        return status;
+    }
+
+    if (FdoData->SendInterruptAffinity) {
+        WdfInterruptSetPolicy(FdoData->SendInterrupt,
+                              WdfIrqPolicySpecifiedProcessors,
+                              WdfIrqPriorityUndefined,
+                              (KAFFINITY) FdoData->SendInterruptAffinity);
+    }
+
+    //
+    // Periodic watchdog, started and stopped with the hardware.
+    //
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig,
+                                   NICWatchDogEvtTimerFunc,
+                                   NIC_WATCHDOG_PERIOD);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FdoData->WdfDevice;
+    status = WdfTimerCreate(&timerConfig,
+                            &attributes,
+                            &FdoData->WatchDogTimer);
+    if(!NT_SUCCESS(status)){
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfTimerCreate failed 0x%x\n", status);
+        return status;
+    }
+
     status = NICAllocAdapterMemory(FdoData);
 
     if (NT_SUCCESS(status)) {
@@ -342,6 +604,11 @@ Return Value:
         status = NICInitRecvBuffers(FdoData);
     }
 
+    if (NT_SUCCESS(status)) {
+
+        status = NICInitDmaTransactionPool(FdoData);
+    }
+
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "<-- NICAllocateSoftwareResources\n");
 
     return status;
@@ -377,6 +644,23 @@ Return Value:
 
     PAGED_CODE();
 
+    //
+    // Let a pending RFD grow or shrink finish before the pool goes away.
+    //
+    if (FdoData->AllocRfdWorkItem) {
+        WdfWorkItemFlush(FdoData->AllocRfdWorkItem);
+    }
+
+    if (FdoData->FreeRfdWorkItem) {
+        WdfWorkItemFlush(FdoData->FreeRfdWorkItem);
+    }
+
+    //
+    // Every request is completed by now, but the last ones may still be
+    // on their way through the completion thread.
+    //
+    NICStopCompletionThread(FdoData);
+
     NICFreeAdapterMemory(FdoData);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "<--NICFreeSoftwareResources\n");
@@ -449,6 +733,8 @@ Return Value:
 
     PAGED_CODE();
 
+    FdoData->InterruptMessages = 0;
+
     for (i=0; i<WdfCmResourceListGetCount(ResourcesTranslated); i++) {
 
         descriptor = WdfCmResourceListGetDescriptor(ResourcesTranslated, i);
@@ -557,14 +843,26 @@ Return Value:
 
         case CmResourceTypeInterrupt:
 
-            ASSERT(!bResInterrupt);
-
             bResInterrupt = TRUE;
 
-            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
-                "Interrupt level: 0x%0x, Vector: 0x%0x\n",
-                descriptor->u.Interrupt.Level,
-                descriptor->u.Interrupt.Vector);
+            if (descriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE) {
+
+                FdoData->InterruptMessages++;
+
+                TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
+                    "Message interrupt: 0x%0x, Vector: 0x%0x\n",
+                    descriptor->u.MessageInterrupt.Translated.Level,
+                    descriptor->u.MessageInterrupt.Translated.Vector);
+
+            } else {
+
+                ASSERT(FdoData->InterruptMessages == 0);
+
+                TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
+                    "Interrupt level: 0x%0x, Vector: 0x%0x\n",
+                    descriptor->u.Interrupt.Level,
+                    descriptor->u.Interrupt.Vector);
+            }
 
             break;
 
@@ -587,6 +885,18 @@ Return Value:
         status = STATUS_DEVICE_CONFIGURATION_ERROR;
     }
 
+    //
+    // Give send and receive a message each if we got enough of them;
+    // otherwise the receive interrupt services both and reads the status
+    // register to tell them apart.
+    //
+    NICAssignInterruptCauses(FdoData->InterruptMessages,
+                             &InterruptGetData(FdoData->RecvInterrupt)->State,
+                             &InterruptGetData(FdoData->SendInterrupt)->State);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT, "Interrupt messages: %d\n",
+                FdoData->InterruptMessages);
+
     return status;
 }
 
@@ -723,7 +1033,8 @@ Return Value:
 {
     NTSTATUS        status = STATUS_SUCCESS;
     PUCHAR          pMem;
-    ULONG           MemPhys;
+    ULONG           MemSize;
+    ULONG           index;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> NICAllocAdapterMemory\n");
 
@@ -736,8 +1047,69 @@ Return Value:
         //
         // Send
         //
+        // HW_START
+
+        //
+        // Allocate shared memory for send. The ring depth comes from the
+        // registry, so if a deep ring can't get a contiguous common buffer
+        // halve it and retry rather than failing the device.
+        //
+        for (;;) {
+            status = RtlULongMult(FdoData->NumTcb,
+                             sizeof(HW_TCB) +
+                             NIC_MAX_PHYS_BUF_COUNT * sizeof(HW_TBD) +
+                             NIC_BUFFER_SIZE,
+                             &FdoData->HwSendMemAllocSize);
+            if(NT_SUCCESS(status)){
+                //
+                // Room to align the descriptors on a cache line.
+                //
+                status = RtlULongAdd(FdoData->HwSendMemAllocSize,
+                                     MP_CACHE_LINE_SIZE,
+                                     &FdoData->HwSendMemAllocSize);
+            }
+            if(!NT_SUCCESS(status)){
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+                        "RtlUlongMult failed 0x%x\n", status);
+                break;
+            }
+
+            status = WdfCommonBufferCreate( FdoData->WdfDmaEnabler,
+                                            FdoData->HwSendMemAllocSize,
+                                            WDF_NO_OBJECT_ATTRIBUTES,
+                                            &FdoData->WdfSendCommonBuffer );
+
+            if (status == STATUS_SUCCESS || FdoData->NumTcb <= NIC_MIN_TCBS) {
+                break;
+            }
+
+            TraceEvents(TRACE_LEVEL_WARNING, DBG_INIT, "WdfCommonBufferCreate(Send) "
+                        "failed %08X for %d TCBs, retrying with %d\n",
+                        status, FdoData->NumTcb, FdoData->NumTcb / 2);
+
+            FdoData->NumTcb /= 2;
+        }
+
+        if (status != STATUS_SUCCESS)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfCommonBufferCreate(Send) "
+                                        "failed %08X\n", status );
+            break;
+        }
+
+        FdoData->HwSendMemAllocVa = WdfCommonBufferGetAlignedVirtualAddress(
+                                               FdoData->WdfSendCommonBuffer);
+
+        FdoData->HwSendMemAllocLa = WdfCommonBufferGetAlignedLogicalAddress(
+                                               FdoData->WdfSendCommonBuffer);
+
+        RtlZeroMemory(FdoData->HwSendMemAllocVa,
+                      FdoData->HwSendMemAllocSize);
+
+        // HW_END
+
         //
-        // Allocate MP_TCB's
+        // Allocate MP_TCB's to match the ring depth we settled on.
         //
         status = RtlULongMult(FdoData->NumTcb,
                          sizeof(MP_TCB),
@@ -760,54 +1132,141 @@ Return Value:
         RtlZeroMemory(pMem, FdoData->MpTcbMemSize);
         FdoData->MpTcbMem = pMem;
 
-        // HW_START
 
         //
-        // Allocate shared memory for send
+        // Recv
+        //
+
+        // set the max number of RFDs
+        // disable the RFD grow/shrink scheme if user specifies a NumRfd value
+        // larger than NIC_MAX_GROW_RFDS
+        FdoData->MaxNumRfd = max(FdoData->NumRfd, NIC_MAX_GROW_RFDS);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "NumRfd = %d\n", FdoData->NumRfd);
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "MaxNumRfd = %d\n", FdoData->MaxNumRfd);
+
+        //
+        // Allocate the dense MP_RFD array and, right behind it, the receive
+        // ring of RFD pointers. The ring is indexed with free running
+        // counters, so its size is rounded up to a power of two.
+        //
+        FdoData->RecvRingSize = 1;
+        while (FdoData->RecvRingSize < FdoData->MaxNumRfd) {
+            FdoData->RecvRingSize <<= 1;
+        }
+
+        FdoData->MpRfdMemSize = FdoData->MaxNumRfd * sizeof(MP_RFD) +
+                                FdoData->RecvRingSize * sizeof(PMP_RFD);
+
+        pMem = ExAllocatePoolWithTag(NonPagedPool,
+                            FdoData->MpRfdMemSize, PCIDRV_POOL_TAG);
+        if (NULL == pMem )
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Failed to allocate MP_RFD's\n");
+            break;
+        }
+
+        RtlZeroMemory(pMem, FdoData->MpRfdMemSize);
+        FdoData->MpRfdMem = (PMP_RFD) pMem;
+        FdoData->RecvRing = (PMP_RFD *) (FdoData->MpRfdMem + FdoData->MaxNumRfd);
+
+        //
+        // Shared memory for the RBDs of zero-copy receive, with room to
+        // align them on a cache line.
+        //
+        if (FdoData->ZeroCopyRecv) {
+
+            status = WdfCommonBufferCreate( FdoData->WdfDmaEnabler,
+                                            NIC_MAX_POSTED_READS * sizeof(HW_RBD) +
+                                            MP_CACHE_LINE_SIZE,
+                                            WDF_NO_OBJECT_ATTRIBUTES,
+                                            &FdoData->WdfRecvPostCommonBuffer );
+
+            if (status != STATUS_SUCCESS)
+            {
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfCommonBufferCreate(RecvPost) "
+                                            "failed %08X\n", status );
+                break;
+            }
+        }
+
+        //
+        // One HW_RFD per RFD; the slots below round it up to a cache line.
+        //
+        FdoData->HwRfdSize = sizeof(HW_RFD);
+
+        //
+        // One common buffer for the HW RFDs of every MP_RFD, a cache line
+        // each, instead of a common buffer (at least a page) and an MDL
+        // per RFD. The RFDs the pool grows into later are already in here.
         //
-        FdoData->HwSendMemAllocSize = FdoData->NumTcb * (sizeof(ULONG)/*TCB*/ +
-                                      NIC_MAX_PHYS_BUF_COUNT * sizeof(ULONG/*TBD*/));
+        FdoData->RfdSlotSize = (FdoData->HwRfdSize + MP_CACHE_LINE_SIZE - 1) &
+                               ~(MP_CACHE_LINE_SIZE - 1);
+        FdoData->RfdSlabSize = FdoData->MaxNumRfd * FdoData->RfdSlotSize;
 
         status = WdfCommonBufferCreate( FdoData->WdfDmaEnabler,
-                                        FdoData->HwSendMemAllocSize,
+                                        FdoData->RfdSlabSize + MP_CACHE_LINE_SIZE,
                                         WDF_NO_OBJECT_ATTRIBUTES,
-                                        &FdoData->WdfSendCommonBuffer );
+                                        &FdoData->WdfRecvCommonBuffer );
 
         if (status != STATUS_SUCCESS)
         {
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfCommonBufferCreate(Send) "
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "WdfCommonBufferCreate(Recv) "
                                         "failed %08X\n", status );
             break;
         }
 
-        FdoData->HwSendMemAllocVa = WdfCommonBufferGetAlignedVirtualAddress(
-                                               FdoData->WdfSendCommonBuffer);
+        pMem = WdfCommonBufferGetAlignedVirtualAddress(FdoData->WdfRecvCommonBuffer);
 
-        FdoData->HwSendMemAllocLa = WdfCommonBufferGetAlignedLogicalAddress(
-                                               FdoData->WdfSendCommonBuffer);
+        FdoData->HwRfdMem = MP_ALIGNMEM(pMem, MP_CACHE_LINE_SIZE);
+        FdoData->HwRfdMemLa = WdfCommonBufferGetAlignedLogicalAddress(
+                                        FdoData->WdfRecvCommonBuffer);
+        FdoData->HwRfdMemLa.QuadPart += BYTES_SHIFT(FdoData->HwRfdMem, pMem);
 
-        RtlZeroMemory(FdoData->HwSendMemAllocVa,
-                      FdoData->HwSendMemAllocSize);
+        FdoData->HwRfdMdl = IoAllocateMdl((PVOID)FdoData->HwRfdMem,
+                                          FdoData->RfdSlabSize,
+                                          FALSE,
+                                          FALSE,
+                                          NULL);
+        if (!FdoData->HwRfdMdl)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Failed to allocate the RFD MDL\n");
+            break;
+        }
 
-        // HW_END
+        MmBuildMdlForNonPagedPool(FdoData->HwRfdMdl);
+
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "RfdSlabSize = %d\n",
+                    FdoData->RfdSlabSize);
 
         //
-        // Recv
+        // Receive backlogs, one block carved up between the channels
         //
+        status = RtlULongMult(FdoData->RecvBacklogSize,
+                              PCIDRV_MAX_CHANNELS * sizeof(MP_RECV_RECORD),
+                              &MemSize);
+        if(!NT_SUCCESS(status)){
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+                    "RtlUlongMult failed 0x%x\n", status);
+            break;
+        }
 
-        // set the max number of RFDs
-        // disable the RFD grow/shrink scheme if user specifies a NumRfd value
-        // larger than NIC_MAX_GROW_RFDS
-        FdoData->MaxNumRfd = max(FdoData->NumRfd, NIC_MAX_GROW_RFDS);
+        pMem = ExAllocatePoolWithTag(NonPagedPool, MemSize, PCIDRV_POOL_TAG);
+        if (NULL == pMem )
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT, "Failed to allocate the receive backlog\n");
+            break;
+        }
 
-        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "NumRfd = %d\n", FdoData->NumRfd);
-        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "MaxNumRfd = %d\n", FdoData->MaxNumRfd);
+        RtlZeroMemory(pMem, MemSize);
 
-        //
-        // The driver should allocate more data than sizeof(RFD_STRUC) to allow the
-        // driver to align the data(after ethernet header) at 8 byte boundary
-        //
-        FdoData->HwRfdSize = sizeof(ULONG/*RFD*/);
+        for (index = 0; index < PCIDRV_MAX_CHANNELS; index++) {
+            FdoData->RecvChannel[index].Backlog =
+                (PMP_RECV_RECORD) pMem + index * FdoData->RecvBacklogSize;
+        }
 
         status = STATUS_SUCCESS;
 
@@ -840,29 +1299,68 @@ Return Value:
 --*/
 {
     PMP_RFD         pMpRfd;
+    ULONG           index;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> NICFreeAdapterMemory\n");
 
     PAGED_CODE();
 
     // No active and waiting sends
-    ASSERT(FdoData->nBusySend == 0);
+    ASSERT(MP_BUSY_SEND_COUNT(FdoData) == 0);
     ASSERT(FdoData->nWaitSend == 0);
+    ASSERT(FdoData->nWaitPrioritySend == 0);
 
-    ASSERT(FdoData->nReadyRecv == FdoData->CurrNumRfd);
+    ASSERT(MP_READY_RECV_COUNT(FdoData) == FdoData->CurrNumRfd);
 
-    while (!IsListEmpty(&FdoData->RecvList))
+    while (MP_READY_RECV_COUNT(FdoData) > 0)
     {
-        pMpRfd = (PMP_RFD)RemoveHeadList(&FdoData->RecvList);
-
-        pMpRfd->DeleteCommonBuffer = FALSE;
+        pMpRfd = MP_RECV_RING_SLOT(FdoData, FdoData->RecvHead);
+        FdoData->RecvHead++;
 
         NICFreeRfd(FdoData, pMpRfd);
     }
 
-    FdoData->WdfSendCommonBuffer = NULL;
+    // The RFD common buffer itself goes away with the DMA enabler
+    if (FdoData->HwRfdMdl)
+    {
+        IoFreeMdl(FdoData->HwRfdMdl);
+        FdoData->HwRfdMdl = NULL;
+    }
+
+    FdoData->WdfRecvCommonBuffer = NULL;
+    FdoData->HwRfdMem = NULL;
+
+    if (FdoData->RecvChannel[0].Backlog)
+    {
+        ExFreePoolWithTag(FdoData->RecvChannel[0].Backlog, PCIDRV_POOL_TAG);
+
+        for (index = 0; index < PCIDRV_MAX_CHANNELS; index++) {
+            FdoData->RecvChannel[index].Backlog = NULL;
+        }
+    }
+
+    // Free the memory for MP_RFD structures and the receive ring
+    if (FdoData->MpRfdMem)
+    {
+        ExFreePoolWithTag(FdoData->MpRfdMem, PCIDRV_POOL_TAG);
+        FdoData->MpRfdMem = NULL;
+        FdoData->RecvRing = NULL;
+    }
+
+    FdoData->WdfSendCommonBuffer = NULL;
     FdoData->HwSendMemAllocVa = NULL;
 
+    ASSERT(FdoData->RecvPostHead == FdoData->RecvPostTail);
+    FdoData->WdfRecvPostCommonBuffer = NULL;
+    FdoData->HwRbd = NULL;
+
+    //
+    // The pooled DMA transactions are children of the DMA enabler and
+    // are deleted by the framework along with it.
+    //
+    ASSERT(FdoData->DmaTransactionsOutstanding == 0);
+    InitializeSListHead(&FdoData->DmaTransactionPool);
+
     // Free the memory for MP_TCB structures
     if (FdoData->MpTcbMem)
     {
@@ -895,25 +1393,41 @@ Return Value:
 --*/
 {
     PMP_TCB         pMpTcb;
-    PULONG         pHwTcb;
-    ULONG           HwTcbPhys;
+    PHW_TCB         pHwTcb;
+    PHW_TCB         pFirstHwTcb;
+    ULONG64         HwTcbPhys;
+    ULONG64         FirstHwTcbPhys;
     ULONG           TcbCount;
 
-    PULONG      pHwTbd;
-    ULONG           HwTbdPhys;
+    PHW_TBD         pHwTbd;
+    ULONG64         HwTbdPhys;
+
+    PUCHAR          pLocalBuffer;
+    ULONG64         LocalBufferPhys;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> NICInitSendBuffers\n");
 
-    // Setup the initial pointers to the SW and HW TCB data space
+    RtlZeroMemory(FdoData->HwSendMemAllocVa, FdoData->HwSendMemAllocSize);
+
+    // Setup the initial pointers to the SW and HW TCB data space.
+    // The HW TCBs start on a cache line.
     pMpTcb = (PMP_TCB) FdoData->MpTcbMem;
-    pHwTcb = (PULONG) FdoData->HwSendMemAllocVa;
-    HwTcbPhys = FdoData->HwSendMemAllocLa.LowPart;
+    pFirstHwTcb = (PHW_TCB) MP_ALIGNMEM(FdoData->HwSendMemAllocVa,
+                                        MP_CACHE_LINE_SIZE);
+    FirstHwTcbPhys = FdoData->HwSendMemAllocLa.QuadPart +
+                     BYTES_SHIFT(pFirstHwTcb, FdoData->HwSendMemAllocVa);
+    pHwTcb = pFirstHwTcb;
+    HwTcbPhys = FirstHwTcbPhys;
 
     // Setup the initial pointers to the TBD data space.
     // TBDs are located immediately following the TCBs
-    pHwTbd = (PULONG) (FdoData->HwSendMemAllocVa +
-                 (sizeof(ULONG) * FdoData->NumTcb));
-    HwTbdPhys = HwTcbPhys + (sizeof(ULONG) * FdoData->NumTcb);
+    pHwTbd = (PHW_TBD) (pFirstHwTcb + FdoData->NumTcb);
+    HwTbdPhys = FirstHwTcbPhys + (sizeof(HW_TCB) * FdoData->NumTcb);
+
+    // The local buffers for copied writes follow the TBDs
+    pLocalBuffer = (PUCHAR) (pHwTbd + FdoData->NumTcb * NIC_MAX_PHYS_BUF_COUNT);
+    LocalBufferPhys = HwTbdPhys +
+                      (sizeof(HW_TBD) * NIC_MAX_PHYS_BUF_COUNT * FdoData->NumTcb);
 
     // Go through and set up each TCB
     for (TcbCount = 0; TcbCount < FdoData->NumTcb; TcbCount++)
@@ -922,41 +1436,181 @@ Return Value:
         pMpTcb->HwTcbPhys = HwTcbPhys;      // save HW TCB physical address
         pMpTcb->HwTbd = pHwTbd;                 // save ptr to TBD array
         pMpTcb->HwTbdPhys = HwTbdPhys;      // save TBD array physical address
+        pMpTcb->LocalBuffer = pLocalBuffer;
+        pMpTcb->LocalBufferPhys = LocalBufferPhys;
 
         if (TcbCount){
             pMpTcb->PrevHwTcb = pHwTcb - 1;
         }
         else {
-            pMpTcb->PrevHwTcb   = (PULONG)((PUCHAR)FdoData->HwSendMemAllocVa +
-                                  ((FdoData->NumTcb - 1) * sizeof(ULONG)));
+            pMpTcb->PrevHwTcb = pFirstHwTcb + (FdoData->NumTcb - 1);
         }
 
-        // Set the link pointer in HW TCB to the next TCB in the chain.
-        // If this is the last TCB in the chain, then set it to the first TCB.
-        if (TcbCount < FdoData->NumTcb - 1)
-        {
-            pMpTcb->Next = pMpTcb + 1;
-        }
-        else
-        {
-            pMpTcb->Next = (PMP_TCB) FdoData->MpTcbMem;
-        }
+        //
+        // The TCBs form a ring in the order they are handed out. A TCB's
+        // TBD array never moves, so its pointer is set once here.
+        //
+        pHwTcb->TxCbLink = (TcbCount == FdoData->NumTcb - 1) ?
+                           FirstHwTcbPhys : HwTcbPhys + sizeof(HW_TCB);
+        pHwTcb->TxCbTbdPointer = HwTbdPhys;
 
         pMpTcb++;
         pHwTcb++;
-        HwTcbPhys += sizeof(ULONG);
-        pHwTbd = (PULONG)((PUCHAR)pHwTbd + sizeof(ULONG) * NIC_MAX_PHYS_BUF_COUNT);
-        HwTbdPhys += sizeof(ULONG) * NIC_MAX_PHYS_BUF_COUNT;
+        HwTcbPhys += sizeof(HW_TCB);
+        pHwTbd += NIC_MAX_PHYS_BUF_COUNT;
+        HwTbdPhys += sizeof(HW_TBD) * NIC_MAX_PHYS_BUF_COUNT;
+        pLocalBuffer += NIC_BUFFER_SIZE;
+        LocalBufferPhys += NIC_BUFFER_SIZE;
     }
 
     // set the TCB head/tail indexes
     // head is the olded one to free, tail is the next one to use
-    FdoData->CurrSendHead = (PMP_TCB) FdoData->MpTcbMem;
-    FdoData->CurrSendTail = (PMP_TCB) FdoData->MpTcbMem;
+    FdoData->SendHead = 0;
+    FdoData->SendTail = 0;
+    FdoData->SendDoorbellTail = 0;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "<-- NICInitSendBuffers\n");
 }
 
+VOID
+NICInitSendRegisters(
+    IN  PFDO_DATA     FdoData
+    )
+/*++
+Routine Description:
+
+    Tell the device where the TCB ring is and how long it is, and reset
+    the send interrupt moderation. After this the device only needs the
+    producer index written by NICStartSend.
+
+Arguments:
+
+    FdoData - Pointer to our adapter context
+
+Return Value:
+
+    None
+
+--*/
+{
+    PMP_TCB         pMpTcb = (PMP_TCB) FdoData->MpTcbMem;
+
+    PAGED_CODE();
+
+    if (!FdoData->CSRAddress) {
+        return;
+    }
+
+    //
+    // The high half first: writing the low half latches the address.
+    //
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_RING_BASE_HI,
+                         (ULONG) (pMpTcb->HwTcbPhys >> 32));
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_RING_BASE,
+                         (ULONG) pMpTcb->HwTcbPhys);
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_RING_SIZE,
+                         FdoData->NumTcb);
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_PRODUCER,
+                         FdoData->SendDoorbellTail & (FdoData->NumTcb - 1));
+
+    //
+    // Start out with an interrupt per completed TCB.
+    //
+    FdoData->SendIntrCount = 1;
+    FdoData->SendIntrDelay = 0;
+
+    NICWriteSendModeration(FdoData);
+}
+
+VOID
+NICInitRecvRegisters(
+    IN  PFDO_DATA     FdoData
+    )
+/*++
+Routine Description:
+
+    Tell the device where the RBD ring of zero-copy receive is.
+
+Arguments:
+
+    FdoData - Pointer to our adapter context
+
+Return Value:
+
+    None
+
+--*/
+{
+    PAGED_CODE();
+
+    if (!FdoData->CSRAddress || !FdoData->HwRbd) {
+        return;
+    }
+
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_BASE_HI,
+                         (ULONG) (FdoData->HwRbdPhys >> 32));
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_BASE,
+                         (ULONG) FdoData->HwRbdPhys);
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_SIZE,
+                         NIC_MAX_POSTED_READS);
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_PRODUCER,
+                         FdoData->RecvPostTail & (NIC_MAX_POSTED_READS - 1));
+}
+
+NTSTATUS
+NICInitDmaTransactionPool(
+    IN  PFDO_DATA     FdoData
+    )
+/*++
+Routine Description:
+
+    Preallocate the DMA transactions: one for every TCB plus a backlog
+    for the requests on their way to the program DMA callback, and one
+    for every posted read if zero-copy receive is on.
+    The send path recycles them instead of creating a new one per write.
+
+Arguments:
+
+    FdoData - Pointer to our adapter context
+
+Return Value:
+
+--*/
+{
+    NTSTATUS            status = STATUS_SUCCESS;
+    WDFDMATRANSACTION   dmaTransaction;
+    ULONG               index;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> NICInitDmaTransactionPool\n");
+
+    PAGED_CODE();
+
+    FdoData->DmaTransactionPoolSize = FdoData->NumTcb + NIC_DMA_TRANSACTION_BACKLOG;
+    if (FdoData->ZeroCopyRecv) {
+        FdoData->DmaTransactionPoolSize += NIC_MAX_POSTED_READS;
+    }
+
+    for (index = 0; index < FdoData->DmaTransactionPoolSize; index++)
+    {
+        status = NICCreateDmaTransaction(FdoData, &dmaTransaction);
+        if (!NT_SUCCESS(status))
+        {
+            break;
+        }
+
+        ExInterlockedPushEntrySList(
+            &FdoData->DmaTransactionPool,
+            &GetDmaTransactionContext(dmaTransaction)->PoolEntry,
+            &FdoData->DmaTransactionPoolLock);
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
+                "<-- NICInitDmaTransactionPool, %d transactions, status=%x\n",
+                index, status);
+
+    return status;
+}
+
 NTSTATUS
 NICInitRecvBuffers(
     IN  PFDO_DATA     FdoData
@@ -977,71 +1631,58 @@ Return Value:
     NTSTATUS        status = STATUS_INSUFFICIENT_RESOURCES;
     PMP_RFD         pMpRfd;
     ULONG           RfdCount;
-    WDFMEMORY       memoryHdl;
-    PDRIVER_CONTEXT  driverContext = GetDriverContext(WdfGetDriver());
+    ULONG           index;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> NICInitRecvBuffers\n");
 
     PAGED_CODE();
 
-    // Setup each RFD
-    for (RfdCount = 0; RfdCount < FdoData->NumRfd; RfdCount++)
-    {
-        status = WdfMemoryCreateFromLookaside(
-                driverContext->RecvLookaside,
-                &memoryHdl
-                );
-        if(!NT_SUCCESS(status)){
-            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "Failed to get lookaside buffer\n");
-            continue;
-        }
-        pMpRfd = WdfMemoryGetBuffer(memoryHdl, NULL);
-        if (!pMpRfd)
-        {
-            //ErrorValue = ERRLOG_OUT_OF_LOOKASIDE_MEMORY;
-            continue;
-        }
-        pMpRfd->LookasideMemoryHdl = memoryHdl;
-        //
-        // Allocate the shared memory for this RFD.
-        //
-        status = WdfCommonBufferCreate( FdoData->WdfDmaEnabler,
-                                        FdoData->HwRfdSize,
-                                        WDF_NO_OBJECT_ATTRIBUTES,
-                                        &pMpRfd->WdfCommonBuffer );
+    FdoData->RecvHead = 0;
+    FdoData->RecvTail = 0;
 
-        if (status != STATUS_SUCCESS)
-        {
-            pMpRfd->WdfCommonBuffer = NULL;
-            WdfObjectDelete(pMpRfd->LookasideMemoryHdl);
-            continue;
-        }
+    for (index = 0; index < PCIDRV_MAX_CHANNELS; index++) {
+        FdoData->RecvChannel[index].BacklogHead = 0;
+        FdoData->RecvChannel[index].BacklogTail = 0;
+        FdoData->RecvChannel[index].DrainOwner = 0;
+    }
 
-        pMpRfd->OriginalHwRfd =
-            WdfCommonBufferGetAlignedVirtualAddress(pMpRfd->WdfCommonBuffer);
+    if (FdoData->WdfRecvPostCommonBuffer) {
 
-        pMpRfd->OriginalHwRfdLa =
-            WdfCommonBufferGetAlignedLogicalAddress(pMpRfd->WdfCommonBuffer);
+        PUCHAR              va;
+        PHYSICAL_ADDRESS    la;
 
-        //
-        // Get a 8-byts aligned memory from the original HwRfd
-        //
-        pMpRfd->HwRfd = (PULONG)DATA_ALIGN(pMpRfd->OriginalHwRfd);
+        va = WdfCommonBufferGetAlignedVirtualAddress(
+                                FdoData->WdfRecvPostCommonBuffer);
+        la = WdfCommonBufferGetAlignedLogicalAddress(
+                                FdoData->WdfRecvPostCommonBuffer);
+
+        RtlZeroMemory(va, NIC_MAX_POSTED_READS * sizeof(HW_RBD) +
+                          MP_CACHE_LINE_SIZE);
+
+        FdoData->HwRbd = (PHW_RBD) MP_ALIGNMEM(va, MP_CACHE_LINE_SIZE);
+        FdoData->HwRbdPhys = la.QuadPart +
+                             BYTES_SHIFT(FdoData->HwRbd, va);
+        FdoData->RecvPostHead = 0;
+        FdoData->RecvPostTail = 0;
+    }
 
+    // Setup each RFD
+    for (RfdCount = 0; RfdCount < FdoData->NumRfd; RfdCount++)
+    {
         //
-        // Update physical address accordingly
+        // Use the next unused entry of the dense MP_RFD array. An entry
+        // whose setup fails is simply reused by the next iteration.
         //
-        pMpRfd->HwRfdLa.QuadPart = pMpRfd->OriginalHwRfdLa.QuadPart +
-                         BYTES_SHIFT(pMpRfd->HwRfd, pMpRfd->OriginalHwRfd);
+        pMpRfd = &FdoData->MpRfdMem[FdoData->CurrNumRfd];
+        RtlZeroMemory(pMpRfd, sizeof(MP_RFD));
 
         status = NICAllocRfd(FdoData, pMpRfd);
         if (!NT_SUCCESS(status))
         {
-            WdfObjectDelete(pMpRfd->LookasideMemoryHdl);
             continue;
         }
         //
-        // Add this RFD to the RecvList
+        // Add this RFD to the receive ring
         //
         FdoData->CurrNumRfd++;
         NICReturnRFD(FdoData, pMpRfd);
@@ -1073,8 +1714,8 @@ NICAllocRfd(
 /*++
 Routine Description:
 
-    Allocate NDIS_PACKET and NDIS_BUFFER associated with a RFD.
-    Can be called at DISPATCH_LEVEL.
+    Set up a RFD on its slot of the RFD common buffer. An entry of
+    MpRfdMem is free as long as its HwRfd is NULL.
 
 Arguments:
 
@@ -1086,73 +1727,155 @@ Return Value:
 
 --*/
 {
-    NTSTATUS    status = STATUS_SUCCESS;
-    PULONG     pHwRfd;
+    ULONG       offset;
 
-    UNREFERENCED_PARAMETER(FdoData);
+    PAGED_CODE();
 
+    ASSERT(pMpRfd >= FdoData->MpRfdMem &&
+           pMpRfd < FdoData->MpRfdMem + FdoData->MaxNumRfd);
+
+    offset = (ULONG)(pMpRfd - FdoData->MpRfdMem) * FdoData->RfdSlotSize;
+
+    pMpRfd->HwRfd = (PHW_RFD)(FdoData->HwRfdMem + offset);
+    pMpRfd->HwRfdLa.QuadPart = FdoData->HwRfdMemLa.QuadPart + offset;
+    pMpRfd->HwRfdPhys = pMpRfd->HwRfdLa.QuadPart;
+
+    pMpRfd->Flags = 0;
+
+    pMpRfd->HwRfd->RfdStatus = 0;
+    pMpRfd->Buffer = pMpRfd->HwRfd->RfdData;
+
+    return STATUS_SUCCESS;
+
+}
+
+VOID
+NICFreeRfd(
+    IN  PFDO_DATA     FdoData,
+    IN  PMP_RFD       pMpRfd
+    )
+/*++
+Routine Description:
+
+    Free a RFD. Its slot of the RFD common buffer stays reserved for
+    the entry.
+
+Arguments:
+
+    FdoData     Pointer to our adapter
+    pMpRfd      Pointer to a RFD
+
+Return Value:
+
+    None
+
+--*/
+{
+    UNREFERENCED_PARAMETER(FdoData);
     PAGED_CODE();
 
-    do{
-        pHwRfd = pMpRfd->HwRfd;
-        pMpRfd->HwRfdPhys = pMpRfd->HwRfdLa.LowPart;
+    ASSERT(pMpRfd->HwRfd);
 
-        pMpRfd->Flags = 0;
+    pMpRfd->HwRfd = NULL;
+    pMpRfd->Buffer = NULL;
+}
 
-        pMpRfd->Mdl = IoAllocateMdl((PVOID)pHwRfd,
-                                    4,
-                                    FALSE,
-                                    FALSE,
-                                    NULL);
-        if (!pMpRfd->Mdl)
-        {
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            break;
-        }
 
-        MmBuildMdlForNonPagedPool(pMpRfd->Mdl);
+VOID
+NICAllocRfdWorkItem(
+    IN WDFWORKITEM  WorkItem
+    )
+/*++
+Routine Description:
 
-        pMpRfd->Buffer = pHwRfd;
-    } WHILE (FALSE);
+    Grow the RFD pool by up to NIC_DEF_RFDS RFDs, without going past
+    MaxNumRfd. Scheduled by the receive handler when the ready RFDs
+    drop below NIC_RFD_LOW_WATER.
+
+Arguments:
 
+    WorkItem    Handle to the work item; its parent is the device
 
-    if (!NT_SUCCESS(status))
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    PMP_RFD         pMpRfd;
+    PMP_RFD         newRfds[NIC_DEF_RFDS];
+    ULONG           count = 0;
+    ULONG           index;
+    NTSTATUS        status;
+
+    PAGED_CODE();
+
+    fdoData = FdoGetData(WdfWorkItemGetParentObject(WorkItem));
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "--> NICAllocRfdWorkItem\n");
+
+    //
+    // AllocNewRfd keeps the shrink work item out, so nobody else touches
+    // the free entries of MpRfdMem or CurrNumRfd until we are done.
+    //
+    for (index = 0;
+         index < fdoData->MaxNumRfd && count < NIC_DEF_RFDS &&
+         fdoData->CurrNumRfd + count < fdoData->MaxNumRfd;
+         index++)
     {
-        if (pMpRfd->WdfCommonBuffer)
-        {
-            //
-            // Free HwRfd, we need to free the original memory
-            // pointed by OriginalHwRfd.
-            //
-            WdfObjectDelete( pMpRfd->WdfCommonBuffer );
+        pMpRfd = &fdoData->MpRfdMem[index];
+        if (pMpRfd->HwRfd != NULL) {
+            continue;
+        }
 
-            pMpRfd->WdfCommonBuffer  = NULL;
-            pMpRfd->HwRfd            = NULL;
-            pMpRfd->OriginalHwRfd    = NULL;
+        RtlZeroMemory(pMpRfd, sizeof(MP_RFD));
 
-            pMpRfd->DeleteCommonBuffer = TRUE;
+        status = NICAllocRfd(fdoData, pMpRfd);
+        if (!NT_SUCCESS(status)) {
+            break;
         }
+
+        newRfds[count] = pMpRfd;
+        count++;
     }
 
-    return status;
+    WdfSpinLockAcquire(fdoData->RcvLock);
+
+    for (index = 0; index < count; index++)
+    {
+        fdoData->CurrNumRfd++;
+        NICReturnRFD(fdoData, newRfds[index]);
+    }
+
+    if (count) {
+        fdoData->RfdGrowEvents++;
+    }
+
+    fdoData->AllocNewRfd = FALSE;
 
+    WdfSpinLockRelease(fdoData->RcvLock);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ,
+                "<-- NICAllocRfdWorkItem, added %d, CurrNumRfd=%d\n",
+                count, fdoData->CurrNumRfd);
 }
 
 VOID
-NICFreeRfd(
-    IN  PFDO_DATA     FdoData,
-    IN  PMP_RFD       pMpRfd
+NICFreeRfdWorkItem(
+    IN WDFWORKITEM  WorkItem
     )
 /*++
 Routine Description:
 
-    Free a RFD.
-    Can be called at DISPATCH_LEVEL.
+    Shrink the RFD pool by up to NIC_DEF_RFDS ready RFDs, without going
+    below NumRfd. Scheduled by the watchdog once the receive side has been
+    idle for NIC_RFD_SHRINK_THRESHOLD intervals, and again every interval
+    after that while it stays idle.
 
 Arguments:
 
-    FdoData     Pointer to our adapter
-    pMpRfd      Pointer to a RFD
+    WorkItem    Handle to the work item; its parent is the device
 
 Return Value:
 
@@ -1160,30 +1883,293 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(FdoData);
+    PFDO_DATA       fdoData;
+    PMP_RFD         pMpRfd;
+    PMP_RFD         freeRfds[NIC_DEF_RFDS];
+    ULONG           count = 0;
+    ULONG           index;
+
     PAGED_CODE();
 
-    ASSERT(pMpRfd->HwRfd);
-    ASSERT(pMpRfd->Mdl);
+    fdoData = FdoGetData(WdfWorkItemGetParentObject(WorkItem));
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "--> NICFreeRfdWorkItem\n");
+
+    WdfSpinLockAcquire(fdoData->RcvLock);
+
+    while (count < NIC_DEF_RFDS &&
+           fdoData->CurrNumRfd > fdoData->NumRfd &&
+           MP_READY_RECV_COUNT(fdoData) > NIC_MIN_RFDS)
+    {
+        //
+        // Take them off the tail: the device fills RFDs from the head.
+        //
+        fdoData->RecvTail--;
+        pMpRfd = MP_RECV_RING_SLOT(fdoData, fdoData->RecvTail);
+
+        ASSERT(MP_TEST_FLAG(pMpRfd, fMP_RFD_RECV_READY));
+        MP_CLEAR_FLAG(pMpRfd, fMP_RFD_RECV_READY);
+
+        fdoData->CurrNumRfd--;
+
+        freeRfds[count] = pMpRfd;
+        count++;
+    }
+
+    if (count) {
+        fdoData->RfdShrinkEvents++;
+    }
 
-    IoFreeMdl(pMpRfd->Mdl);
+    WdfSpinLockRelease(fdoData->RcvLock);
+
+    for (index = 0; index < count; index++)
+    {
+        NICFreeRfd(fdoData, freeRfds[index]);
+    }
 
     //
-    // Free HwRfd, we need to free the original memory pointed
-    // by OriginalHwRfd.
+    // The freed entries of MpRfdMem can be reused by the next grow.
     //
-    if (pMpRfd->DeleteCommonBuffer == TRUE) {
+    WdfSpinLockAcquire(fdoData->RcvLock);
+    fdoData->FreeRfdPending = FALSE;
+    WdfSpinLockRelease(fdoData->RcvLock);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ,
+                "<-- NICFreeRfdWorkItem, freed %d, CurrNumRfd=%d\n",
+                count, fdoData->CurrNumRfd);
+}
+
+VOID
+NICWatchDogEvtTimerFunc(
+    IN WDFTIMER Timer
+    )
+/*++
+Routine Description:
+
+    Periodic timer, every NIC_WATCHDOG_PERIOD ms while the hardware is
+    started. Checks the send side for a hang and has it restarted.
+
+    Counts the intervals in which no word was received and every RFD was
+    back on the receive ring, and schedules the RFD pool to shrink once
+    there have been NIC_RFD_SHRINK_THRESHOLD of them in a row.
+
+Arguments:
+
+    Timer   Handle to the timer; its parent is the device
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    BOOLEAN         bFreeRfd = FALSE;
+
+    fdoData = FdoGetData(WdfTimerGetParentObject(Timer));
 
-        WdfObjectDelete( pMpRfd->WdfCommonBuffer );
+    if (NICCheckForHang(fdoData)) {
+
+        fdoData->HwErrCount++;
+
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_DPC,
+                    "Send hang: %d busy TCBs, restarting\n",
+                    MP_BUSY_SEND_COUNT(fdoData));
+
+        //
+        // Recovery has to run in the consumer of the TCB ring.
+        //
+        InterlockedExchange(&fdoData->SendResetPending, TRUE);
+
+        if (InterruptGetData(fdoData->SendInterrupt)->State.Causes & NIC_INTR_TX) {
+            WdfInterruptQueueDpcForIsr(fdoData->SendInterrupt);
+        } else {
+            WdfInterruptQueueDpcForIsr(fdoData->RecvInterrupt);
+        }
     }
 
-    pMpRfd->WdfCommonBuffer = NULL;
-    pMpRfd->HwRfd = NULL;
-    pMpRfd->OriginalHwRfd = NULL;
+    WdfSpinLockAcquire(fdoData->RcvLock);
+
+    if (fdoData->RecvSequence == fdoData->WatchDogRecvSequence &&
+        MP_READY_RECV_COUNT(fdoData) == fdoData->CurrNumRfd)
+    {
+        if (fdoData->RfdShrinkCount < NIC_RFD_SHRINK_THRESHOLD) {
+            fdoData->RfdShrinkCount++;
+        }
+    }
+    else
+    {
+        fdoData->RfdShrinkCount = 0;
+    }
+
+    fdoData->WatchDogRecvSequence = fdoData->RecvSequence;
+
+    if (fdoData->RfdShrinkCount >= NIC_RFD_SHRINK_THRESHOLD &&
+        fdoData->CurrNumRfd > fdoData->NumRfd &&
+        !fdoData->AllocNewRfd && !fdoData->FreeRfdPending)
+    {
+        fdoData->FreeRfdPending = TRUE;
+        bFreeRfd = TRUE;
+    }
+
+    WdfSpinLockRelease(fdoData->RcvLock);
+
+    if (bFreeRfd) {
+        WdfWorkItemEnqueue(fdoData->FreeRfdWorkItem);
+    }
+}
+
+BOOLEAN
+NICCheckForHang(
+    IN  PFDO_DATA     FdoData
+    )
+/*++
+Routine Description:
+
+    Called by the watchdog every NIC_WATCHDOG_PERIOD ms. The send side is
+    hung when TCBs stayed busy for NIC_SEND_HANG_TICKS intervals in a row
+    without a single one completing.
+
+    Only reads SendHead, SendTail and SendCompletions, so the send path
+    pays nothing for it. SendCompletions is read with an interlocked
+    compare-exchange, since the send DPC may be bumping it on another
+    processor and a plain 64-bit read can tear on x86.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    TRUE if the send side is hung
+
+--*/
+{
+    ULONG64     completions;
 
-    WdfObjectDelete(pMpRfd->LookasideMemoryHdl);
+    completions = (ULONG64) InterlockedCompareExchange64(
+                                (LONG64 volatile *) &FdoData->SendCompletions,
+                                0,
+                                0);
+
+    if (MP_BUSY_SEND_COUNT(FdoData) == 0 ||
+        completions != FdoData->WatchDogSendCompletions)
+    {
+        FdoData->WatchDogSendCompletions = completions;
+        FdoData->SendStallTicks = 0;
+        return FALSE;
+    }
+
+    if (++FdoData->SendStallTicks < NIC_SEND_HANG_TICKS) {
+        return FALSE;
+    }
+
+    FdoData->SendStallTicks = 0;
+    return TRUE;
 }
 
+NTSTATUS
+NICReset(
+    IN PFDO_DATA FdoData
+    )
+/*++
+Routine Description:
+
+    Recover from a send hang without failing any request: stop the send
+    engine, pick up the TCBs it finished, re-arm the rest and restart the
+    device at the oldest of them. The requests stay with their TCBs and
+    complete as usual once the device gets through them.
+
+    The engine is stopped before anything is re-armed, so a TCB can't
+    complete behind our back and be sent twice; a duplicated command word
+    means duplicated motion.
+
+    Assumption: Called from the send interrupt DPC, the only consumer of
+    the TCB ring. SendLock is not held.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    NTSTATUS code
+
+--*/
+{
+    PMP_TCB     pMpTcb;
+    ULONG       index;
+    ULONG       restart;
+    ULONG       wait;
+
+    if (!FdoData->CSRAddress) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_STOP, 1);
+
+    for (wait = 0; wait < NIC_TX_STOP_WAIT; wait++)
+    {
+        if (READ_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_STOP) == 0) {
+            break;
+        }
+        KeStallExecutionProcessor(10);
+    }
+
+    if (wait == NIC_TX_STOP_WAIT) {
+        //
+        // Leave the TCBs alone; the watchdog tries again if the device
+        // stays stuck.
+        //
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "NICReset: send engine didn't stop\n");
+        return STATUS_IO_TIMEOUT;
+    }
+
+    //
+    // Complete whatever the device finished before it stopped. This
+    // completes requests, so it runs without SendLock.
+    //
+    NICHandleSendInterrupt(FdoData);
+
+    //
+    // Hold off the doorbell while the device is pointed back at the first
+    // unfinished TCB. Nothing can complete now, but a finished TCB is never
+    // re-armed all the same.
+    //
+    WdfSpinLockAcquire(FdoData->SendLock);
+
+    restart = FdoData->SendDoorbellTail;
+
+    for (index = FdoData->SendHead; index != FdoData->SendDoorbellTail; index++)
+    {
+        pMpTcb = MP_GET_TCB(FdoData, index);
+        if (pMpTcb->HwTcb->TxCbStatus & HW_TCB_STATUS_COMPLETE) {
+            continue;
+        }
+        if (restart == FdoData->SendDoorbellTail) {
+            restart = index;
+        }
+        pMpTcb->HwTcb->TxCbStatus = 0;
+    }
+
+    KeMemoryBarrier();
+
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_RESTART,
+                         restart & (FdoData->NumTcb - 1));
+    WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_PRODUCER,
+                         FdoData->SendDoorbellTail & (FdoData->NumTcb - 1));
+
+    FdoData->SendResets++;
+
+    WdfSpinLockRelease(FdoData->SendLock);
+
+    TraceEvents(TRACE_LEVEL_WARNING, DBG_WRITE,
+                "NICReset: restarted at TCB %d\n",
+                restart & (FdoData->NumTcb - 1));
+
+    return STATUS_SUCCESS;
+}
 
 VOID
 NICShutdown(
@@ -1265,7 +2251,131 @@ NICGetDeviceInfSettings(
     }
 
     FdoData->NumTcb = min(FdoData->NumTcb, NIC_MAX_TCBS);
-    FdoData->NumTcb = max(FdoData->NumTcb, 1);
+    FdoData->NumTcb = max(FdoData->NumTcb, NIC_MIN_TCBS);
+
+    //
+    // Largest write copied into a TCB's local buffer. 0 disables copying.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"CopyThreshold",
+                                &FdoData->CopyThreshold)){
+        FdoData->CopyThreshold = NIC_DEF_COPY_THRESHOLD;
+    }
+
+    FdoData->CopyThreshold = min(FdoData->CopyThreshold, NIC_BUFFER_SIZE);
+
+    //
+    // Post read buffers to the device instead of copying from the RFDs.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"ZeroCopyRecv",
+                                &FdoData->ZeroCopyRecv)){
+        FdoData->ZeroCopyRecv = 0;
+    }
+
+    //
+    // Number of received words held while no read is pending. The
+    // backlog is a ring indexed with free running counters, so round it
+    // up to a power of two.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"RecvBacklog",
+                                &FdoData->RecvBacklogSize)){
+        FdoData->RecvBacklogSize = NIC_DEF_RECV_BACKLOG;
+    }
+
+    FdoData->RecvBacklogSize = min(FdoData->RecvBacklogSize, NIC_MAX_RECV_BACKLOG);
+    FdoData->RecvBacklogSize = max(FdoData->RecvBacklogSize, NIC_DEF_RFDS);
+
+    while (FdoData->RecvBacklogSize & (FdoData->RecvBacklogSize - 1)) {
+        FdoData->RecvBacklogSize += FdoData->RecvBacklogSize & ~(FdoData->RecvBacklogSize - 1);
+    }
+
+    //
+    // Words processed per receive poll pass before giving up the CPU.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"RecvPollBudget",
+                                &FdoData->RecvPollBudget)){
+        FdoData->RecvPollBudget = NIC_DEF_RECV_POLL_BUDGET;
+    }
+
+    FdoData->RecvPollBudget = min(FdoData->RecvPollBudget, NIC_MAX_RECV_POLL_BUDGET);
+    FdoData->RecvPollBudget = max(FdoData->RecvPollBudget, NIC_MIN_RECV_POLL_BUDGET);
+
+    //
+    // Which word to drop when the backlog is full. For position feedback
+    // the newest word matters most, so drop the oldest by default.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"RecvBacklogPolicy",
+                                &FdoData->RecvBacklogPolicy) ||
+       FdoData->RecvBacklogPolicy > NIC_BACKLOG_DROP_NEWEST){
+        FdoData->RecvBacklogPolicy = NIC_BACKLOG_DROP_OLDEST;
+    }
+
+    //
+    // Send interrupt moderation, on unless turned off, and how far it may
+    // go. A SendIntrMaxCount of 1 with no delay is the same as off.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"SendIntrModeration",
+                                &FdoData->SendIntrModeration)){
+        FdoData->SendIntrModeration = TRUE;
+    }
+
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"SendIntrMaxCount",
+                                &FdoData->SendIntrMaxCount)){
+        FdoData->SendIntrMaxCount = NIC_DEF_SEND_INTR_MAX_COUNT;
+    }
+
+    FdoData->SendIntrMaxCount = min(FdoData->SendIntrMaxCount, NIC_MAX_TCBS);
+    FdoData->SendIntrMaxCount = max(FdoData->SendIntrMaxCount, 1);
+
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"SendIntrMaxDelay",
+                                &FdoData->SendIntrMaxDelay)){
+        FdoData->SendIntrMaxDelay = NIC_DEF_SEND_INTR_MAX_DELAY;
+    }
+
+    FdoData->SendIntrMaxDelay = min(FdoData->SendIntrMaxDelay, NIC_MAX_SEND_INTR_DELAY);
+
+    //
+    // Processors for the receive and send interrupts and their DPCs, so
+    // that they can be kept off the cores busy with other work. Processors
+    // that don't exist are dropped. The masks are REG_DWORDs, so they can
+    // only name the first 32 processors (genpci.inx says so too); the cast
+    // of the active processor mask drops nothing they could have set.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"RecvInterruptAffinity",
+                                &FdoData->RecvInterruptAffinity)){
+        FdoData->RecvInterruptAffinity = 0;
+    }
+
+    FdoData->RecvInterruptAffinity &= (ULONG) KeQueryActiveProcessors();
+
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"SendInterruptAffinity",
+                                &FdoData->SendInterruptAffinity)){
+        FdoData->SendInterruptAffinity = 0;
+    }
+
+    FdoData->SendInterruptAffinity &= (ULONG) KeQueryActiveProcessors();
+
+    //
+    // Complete the requests the DPCs finish on the completion thread
+    // instead of in the DPCs. Off by default: it takes DPC time out of the
+    // system at the cost of a thread switch per batch.
+    //
+    if(!PciDrvReadRegistryValue(FdoData,
+                                L"PassiveCompletion",
+                                &FdoData->PassiveCompletion)){
+        FdoData->PassiveCompletion = FALSE;
+    }
+
+    FdoData->PassiveCompletion = (FdoData->PassiveCompletion != 0);
 
     return;
  }
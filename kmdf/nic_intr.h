@@ -0,0 +1,152 @@
+/*++
+
+Module Name:
+
+    nic_intr.h
+
+Abstract:
+
+    Interrupt causes of the device and the decisions the interrupt paths
+    make about them: which interrupt object services which cause, what an
+    ISR claims, masks and acknowledges, and when a DPC may unmask again.
+    The CSR accesses and the framework calls stay in isrdpc.c; nothing
+    here depends on the framework, so the user-mode interrupt test in
+    test\unit runs these against a simulated device.
+
+--*/
+
+#ifndef _NIC_INTR_H
+#define _NIC_INTR_H
+
+// interrupt causes
+#define NIC_INTR_RX                     0x00000001
+#define NIC_INTR_TX                     0x00000002
+#define NIC_INTR_ALL                    (NIC_INTR_RX | NIC_INTR_TX)
+
+//
+// With MSI-X the device signals each cause with its own message, so the
+// ISR needs no status read and the two paths can run on different CPUs.
+// The interrupt objects are created in message order.
+//
+#define NIC_MSIX_RECV_MESSAGE           0   // NIC_INTR_RX
+#define NIC_MSIX_SEND_MESSAGE           1   // NIC_INTR_TX
+#define NIC_MSIX_MESSAGES               2
+
+//
+// The causes an interrupt object services. Dedicated means its message is
+// the cause, so the ISR doesn't read the status register. Enabled is
+// protected by the interrupt lock.
+//
+typedef struct _NIC_INTR_STATE
+{
+    ULONG                   Causes;
+    BOOLEAN                 Dedicated;
+    BOOLEAN                 Enabled;
+} NIC_INTR_STATE, *PNIC_INTR_STATE;
+
+__inline VOID
+NICAssignInterruptCauses(
+    IN  ULONG               Messages,
+    OUT PNIC_INTR_STATE     Recv,
+    OUT PNIC_INTR_STATE     Send
+    )
+/*++
+
+    Give send and receive a message each if there are enough of them;
+    otherwise the receive interrupt services both and reads the status
+    register to tell them apart.
+ --*/
+{
+    if (Messages >= NIC_MSIX_MESSAGES) {
+        Recv->Causes = NIC_INTR_RX;
+        Recv->Dedicated = TRUE;
+        Send->Causes = NIC_INTR_TX;
+        Send->Dedicated = TRUE;
+    } else {
+        Recv->Causes = NIC_INTR_ALL;
+        Recv->Dedicated = FALSE;
+        Send->Causes = 0;
+        Send->Dedicated = FALSE;
+    }
+}
+
+__inline BOOLEAN
+NICIsrReadsStatus(
+    IN  PNIC_INTR_STATE     State
+    )
+{
+    return (BOOLEAN) (State->Causes != 0 && !State->Dedicated);
+}
+
+__inline ULONG
+NICIsrClaim(
+    IN  PNIC_INTR_STATE     State,
+    IN  ULONG               Status
+    )
+/*++
+
+    The causes an ISR takes on, 0 if the interrupt isn't ours. Status is
+    the INTR_STATUS register if NICIsrReadsStatus said to read it. The ISR
+    masks what it claims before acknowledging it, so that a level
+    interrupt drops right away, and the DPCs unmask it once they are done.
+ --*/
+{
+    if (State->Dedicated) {
+        return State->Causes;
+    }
+
+    return Status & State->Causes;
+}
+
+__inline ULONG
+NICUnmaskCauses(
+    IN  PNIC_INTR_STATE     State,
+    IN  ULONG               Causes
+    )
+/*++
+
+    The causes a DPC done with Causes may unmask: none once the interrupt
+    has been disabled, and never one another interrupt object services.
+    Called with the interrupt lock held.
+ --*/
+{
+    return State->Enabled ? (Causes & State->Causes) : 0;
+}
+
+__inline ULONG
+NICEnableCauses(
+    IN OUT PNIC_INTR_STATE  State
+    )
+/*++
+
+    The causes to acknowledge, dropping anything stale, and then unmask
+    when the interrupt is enabled. Called with the interrupt lock held.
+ --*/
+{
+    if (State->Causes == 0) {
+        return 0;
+    }
+
+    State->Enabled = TRUE;
+    return State->Causes;
+}
+
+__inline ULONG
+NICDisableCauses(
+    IN OUT PNIC_INTR_STATE  State
+    )
+/*++
+
+    The causes to mask when the interrupt is disabled. Called with the
+    interrupt lock held.
+ --*/
+{
+    if (!State->Enabled) {
+        return 0;
+    }
+
+    State->Enabled = FALSE;
+    return State->Causes;
+}
+
+#endif  // _NIC_INTR_H
@@ -28,7 +28,7 @@ Environment:
 
 __drv_sameIRQL
 __drv_requiresIRQL(DISPATCH_LEVEL)
-VOID
+BOOLEAN
 NICHandleRecvInterrupt(
     IN  PFDO_DATA  FdoData
     )
@@ -36,8 +36,9 @@ NICHandleRecvInterrupt(
 Routine Description:
 
     Interrupt handler for receive processing. Put the received packets
-    into an array and call NICServiceReadIrps. If we run low on
-    RFDs, allocate another one.
+    into an array and call NICServiceReadIrps, then put the RFDs it is
+    done with back on the ring in one pass. If we run low on RFDs,
+    allocate more in the background. Stops after RecvPollBudget words.
 
     Assumption: This function is called with the Rcv SPINLOCK held.
 
@@ -47,67 +48,91 @@ Arguments:
 
 Return Value:
 
-    None
+    TRUE if the budget ran out before the completed RFDs did
 
 --*/
 {
     PMP_RFD         pMpRfd = NULL;
-    PULONG          pHwRfd = NULL;
+    PHW_RFD         pHwRfd = NULL;
 
     PMP_RFD         PacketArray[NIC_DEF_RFDS];
     PMP_RFD         PacketFreeArray[NIC_DEF_RFDS];
     UINT            PacketArrayCount;
     UINT            PacketFreeCount;
     UINT            Index;
-    UINT            LoopIndex = 0;
-    UINT            LoopCount = NIC_MAX_RFDS / NIC_DEF_RFDS + 1;    // avoid staying here too long
+    ULONG           Processed = 0;
+    LARGE_INTEGER   lockStart, lockEnd;
+    LARGE_INTEGER   timeStamp;
+    ULONG64         lockTicks;
 
     BOOLEAN         bContinue = TRUE;
     BOOLEAN         bAllocNewRfd = FALSE;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "---> NICHandleRecvInterrupt\n");
 
-    ASSERT(FdoData->nReadyRecv >= NIC_MIN_RFDS);
+    ASSERT(MP_READY_RECV_COUNT(FdoData) >= NIC_MIN_RFDS);
+
+    //
+    // Words that landed in posted read buffers first; the RFDs only hold
+    // what arrived while no read was posted.
+    //
+    if (FdoData->ZeroCopyRecv) {
+        NICCompletePostedReads(FdoData);
+    }
 
-    while (LoopIndex++ < LoopCount && bContinue)
+    while (Processed < FdoData->RecvPollBudget && bContinue)
     {
         PacketArrayCount = 0;
         PacketFreeCount = 0;
 
         //
-        // Process up to the array size RFD's
+        // Everything in this pass was there when we looked.
+        //
+        timeStamp = KeQueryPerformanceCounter(NULL);
+
+        //
+        // Process up to the array size RFD's, within the budget
         //
-        while (PacketArrayCount < NIC_DEF_RFDS)
+        while (PacketArrayCount < NIC_DEF_RFDS &&
+               Processed + PacketArrayCount < FdoData->RecvPollBudget)
         {
-            if (IsListEmpty(&FdoData->RecvList))
+            if (FdoData->RecvHead == FdoData->RecvTail)
             {
-                ASSERT(FdoData->nReadyRecv == 0);
                 bContinue = FALSE;
                 break;
             }
 
             //
-            // Get the next MP_RFD to process
+            // Look at the next MP_RFD on the head of the ring
             //
-            pMpRfd = (PMP_RFD)GetListHeadEntry(&FdoData->RecvList);
+            pMpRfd = MP_RECV_RING_SLOT(FdoData, FdoData->RecvHead);
 
             //
-            // Get the associated HW_RFD
+            // Get the associated HW_RFD; stop at the first one the device
+            // hasn't filled yet
             //
             pHwRfd = pMpRfd->HwRfd;
 
-            //
-            // Remove the RFD from the head of the List
-            //
-            RemoveEntryList((PLIST_ENTRY)pMpRfd);
-            FdoData->nReadyRecv--;
+            if (!(pHwRfd->RfdStatus & HW_RFD_STATUS_COMPLETE))
+            {
+                bContinue = FALSE;
+                break;
+            }
+
+            KeMemoryBarrier();
+
+            FdoData->RecvHead++;
 
             ASSERT(MP_TEST_FLAG(pMpRfd, fMP_RFD_RECV_READY));
             MP_CLEAR_FLAG(pMpRfd, fMP_RFD_RECV_READY);
 
-            pMpRfd->PacketSize = 4;
+            pMpRfd->PacketSize = min(pHwRfd->RfdActualCount, NIC_RECV_WORD_SIZE);
+            pMpRfd->Channel = pHwRfd->RfdStatus & HW_RFD_STATUS_CHANNEL;
+            pMpRfd->Sequence = FdoData->RecvChannel[pMpRfd->Channel].Sequence++;
+            FdoData->RecvSequence++;
+            pMpRfd->TimeStamp = timeStamp;
 
-            KeFlushIoBuffers(pMpRfd->Mdl, TRUE, TRUE);
+            KeFlushIoBuffers(FdoData->HwRfdMdl, TRUE, TRUE);
 
             MP_SET_FLAG(pMpRfd, fMP_RFD_RECV_PEND);
 
@@ -115,6 +140,18 @@ Return Value:
             PacketArrayCount++;
         }
 
+        //
+        // Running low on ready RFDs in a burst: grow the pool in the
+        // background.
+        //
+        if (MP_READY_RECV_COUNT(FdoData) < NIC_RFD_LOW_WATER &&
+            FdoData->CurrNumRfd < FdoData->MaxNumRfd &&
+            !FdoData->AllocNewRfd && !FdoData->FreeRfdPending)
+        {
+            FdoData->AllocNewRfd = TRUE;
+            bAllocNewRfd = TRUE;
+        }
+
         //
         // if we didn't process any receives, just return from here
         //
@@ -124,38 +161,55 @@ Return Value:
         }
 
 
+        Processed += PacketArrayCount;
+
         WdfSpinLockRelease(FdoData->RcvLock);
 
-        NICServiceReadIrps(
-            FdoData,
-            PacketArray,
-            PacketArrayCount);
+        PacketFreeCount = NICServiceReadIrps(
+                              FdoData,
+                              PacketArray,
+                              PacketArrayCount,
+                              PacketFreeArray);
 
 
         WdfSpinLockAcquire(FdoData->RcvLock);
 
+        lockStart = KeQueryPerformanceCounter(NULL);
+
         //
-        // Return all the RFDs to the pool.
+        // Return all the RFDs of the batch to the ring at once.
         //
         for (Index = 0; Index < PacketFreeCount; Index++)
         {
-
-            //
-            // Get the MP_RFD saved in this packet, in NICAllocRfd
-            //
             pMpRfd = PacketFreeArray[Index];
 
-            ASSERT(MP_TEST_FLAG(pMpRfd, fMP_RFD_RESOURCES));
-            MP_CLEAR_FLAG(pMpRfd, fMP_RFD_RESOURCES);
+            ASSERT(MP_TEST_FLAG(pMpRfd, fMP_RFD_RECV_PEND));
+            MP_CLEAR_FLAG(pMpRfd, fMP_RFD_RECV_PEND);
 
             NICReturnRFD(FdoData, pMpRfd);
         }
 
+        lockEnd = KeQueryPerformanceCounter(NULL);
+        lockTicks = (ULONG64) (lockEnd.QuadPart - lockStart.QuadPart);
+
+        FdoData->RfdReturnBatches++;
+        FdoData->RfdsReturned += PacketFreeCount;
+        FdoData->RfdReturnLockTicks += lockTicks;
+        if (lockTicks > FdoData->RfdReturnLockTicksMax) {
+            FdoData->RfdReturnLockTicksMax = lockTicks;
+        }
     }
 
-    ASSERT(FdoData->nReadyRecv >= NIC_MIN_RFDS);
+    ASSERT(MP_READY_RECV_COUNT(FdoData) >= NIC_MIN_RFDS);
+
+    if (bAllocNewRfd)
+    {
+        WdfWorkItemEnqueue(FdoData->AllocRfdWorkItem);
+    }
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<--- NICHandleRecvInterrupt\n");
+
+    return bContinue;
 }
 
 VOID
@@ -166,7 +220,7 @@ NICReturnRFD(
 /*++
 Routine Description:
 
-    Recycle a RFD and put it back onto the receive list
+    Recycle a RFD and put it back at the tail of the receive ring
 
     Assumption: This function is called with the Rcv SPINLOCK held.
 
@@ -181,19 +235,22 @@ Return Value:
 
 --*/
 {
-    PMP_RFD   pLastMpRfd;
-    PULONG   pHwRfd = pMpRfd->HwRfd;
-
     ASSERT(pMpRfd->Flags == 0);
     MP_SET_FLAG(pMpRfd, fMP_RFD_RECV_READY);
 
+    //
+    // Hand the HW_RFD back to the device.
+    //
+    pMpRfd->HwRfd->RfdStatus = 0;
+
     //
     // The processing on this RFD is done, so put it back on the tail of
-    // our list
+    // our ring. There is a slot for every RFD, so it can't overflow.
     //
-    InsertTailList(&FdoData->RecvList, (PLIST_ENTRY)pMpRfd);
-    FdoData->nReadyRecv++;
-    ASSERT(FdoData->nReadyRecv <= FdoData->CurrNumRfd);
+    ASSERT(MP_READY_RECV_COUNT(FdoData) < FdoData->CurrNumRfd);
+
+    MP_RECV_RING_SLOT(FdoData, FdoData->RecvTail) = pMpRfd;
+    FdoData->RecvTail++;
 }
 
 NTSTATUS
@@ -217,140 +274,1081 @@ Return Value:
 
 --*/
 {
-    PMP_RFD         pMpRfd;
     NTSTATUS        status = STATUS_SUCCESS;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "---> NICStartRecv\n");
-    ASSERT(!IsListEmpty(&FdoData->RecvList));
+    ASSERT(MP_READY_RECV_COUNT(FdoData) > 0);
+
+    NICHandleRecvInterrupt(FdoData);
+    ASSERT(MP_READY_RECV_COUNT(FdoData) > 0);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<--- NICStartRecv, Status=%x\n", status);
+    return status;
+}
+
+
+VOID
+NICScheduleRecvPoll(
+    IN  PFDO_DATA  FdoData
+    )
+/*++
+Routine Description:
+
+    Switch receive processing to polling: queue the poll DPC. Called from
+    the ISR when a receive interrupt comes in; the ISR has masked it
+    already, and the poll DPC unmasks it once the ring is drained.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    WdfDpcEnqueue(FdoData->RecvPollDpc);
+}
+
+VOID
+NICEvtRecvPollDpc(
+    IN WDFDPC   Dpc
+    )
+/*++
+Routine Description:
+
+    One receive poll pass of at most RecvPollBudget words. While completed
+    RFDs remain, queue another pass and leave the receive interrupt
+    masked, so a sustained stream costs no interrupts at all. Once the
+    ring is drained, unmask it again and look one more time for a word
+    that came in before the unmask.
+
+    Without an affinity the DPC can be queued on a second processor while
+    a pass runs, from the ISR after the unmask or from NICScheduleRecvPoll.
+    Only one pass may take words off the ring, since the backlogs have a
+    single producer, so that pass leaves RecvPolling raised and the one
+    that owns it runs again.
+
+Arguments:
+
+    Dpc     Handle to the DPC; its parent is the device
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA       fdoData;
+    LARGE_INTEGER   start, end;
+    ULONG64         microseconds;
+    LONG64          isrTimeStamp;
+    BOOLEAN         bMoreWork;
+
+    fdoData = FdoGetData(WdfDpcGetParentObject(Dpc));
+
+    if (InterlockedIncrement(&fdoData->RecvPolling) != 1) {
+        return;
+    }
+
+    start = KeQueryPerformanceCounter(NULL);
 
     //
-    // Get the MP_RFD head
+    // The first pass after a receive interrupt
     //
-    pMpRfd = (PMP_RFD)GetListHeadEntry(&FdoData->RecvList);
+    isrTimeStamp = InterlockedExchange64(&fdoData->RecvIsrTimeStamp, 0);
+    if (isrTimeStamp) {
+        NICRecordDpcLatency(fdoData, isrTimeStamp, start.QuadPart);
+    }
 
-    NICHandleRecvInterrupt(FdoData);
-    ASSERT(!IsListEmpty(&FdoData->RecvList));
+    WdfSpinLockAcquire(fdoData->RcvLock);
+
+    bMoreWork = NICHandleRecvInterrupt(fdoData);
+
+    if (!bMoreWork) {
+
+        fdoData->RecvPollRearms++;
+
+        NICUnmaskInterrupt(fdoData->RecvInterrupt, NIC_INTR_RX);
+
+        //
+        // A word that completed between the last look and the unmask may
+        // not raise an interrupt of its own.
+        //
+        if (fdoData->RecvHead != fdoData->RecvTail &&
+            (MP_RECV_RING_SLOT(fdoData, fdoData->RecvHead)->HwRfd->RfdStatus &
+             HW_RFD_STATUS_COMPLETE)) {
+
+            if (fdoData->CSRAddress) {
+                WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_INTR_MASK_SET,
+                                     NIC_INTR_RX);
+            }
+            bMoreWork = TRUE;
+        }
+    }
+
+    end = KeQueryPerformanceCounter(NULL);
+
+    fdoData->RecvPolls++;
+    fdoData->RecvPollTicks += (ULONG64) (end.QuadPart - start.QuadPart);
+
+    microseconds = (ULONG64) (end.QuadPart - start.QuadPart) * 1000000 /
+                   fdoData->PerformanceFrequency;
+
+    fdoData->RecvDpcHistogram[MP_HISTOGRAM_BUCKET(microseconds)]++;
+
+    WdfSpinLockRelease(fdoData->RcvLock);
 
     //
-    // Get the new MP_RFD head
+    // A pass that was queued while this one ran has left it to us.
     //
-    pMpRfd = (PMP_RFD)GetListHeadEntry(&FdoData->RecvList);
+    if (InterlockedExchange(&fdoData->RecvPolling, 0) != 1) {
+        bMoreWork = TRUE;
+    }
 
-exit:
-    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<--- NICStartRecv, Status=%x\n", status);
-    return status;
+    if (bMoreWork) {
+        WdfDpcEnqueue(Dpc);
+    }
 }
 
-
-VOID
+ULONG
 NICServiceReadIrps(
     PFDO_DATA   FdoData,
     PMP_RFD     *PacketArray,
-    ULONG       PacketArrayCount
+    ULONG       PacketArrayCount,
+    PMP_RFD     *PacketFreeArray
     )
 /*++
 Routine Description:
 
-    Copy the data from the recv buffers to pending read IRP buffers
-    and complete the IRP. When used as network driver, copy operation
-    can be avoided by devising a private interface between us and the
-    NDIS-WDM filter and have the NDIS-WDM edge to indicate our buffers
-    directly to NDIS.
+    Copy the received words from the recv buffers into the backlogs of
+    their channels and hand the backlogs to the pending read IRPs. When used as
+    network driver, copy operation can be avoided by devising a private
+    interface between us and the NDIS-WDM filter and have the NDIS-WDM
+    edge to indicate our buffers directly to NDIS.
 
-    Called at DISPATCH_LEVEL. Take advantage of that fact while
-     acquiring spinlocks.
+    Called at DISPATCH_LEVEL without RcvLock. The RFDs are not put back
+    on the receive ring here; the ones we are done with are handed back
+    in PacketFreeArray so the caller can return them under a single
+    acquisition of RcvLock. Since the words are copied out right away,
+    that is all of them.
 
 Arguments:
 
-    FdoData     Pointer to our FdoData
+    FdoData             Pointer to our FdoData
+    PacketArray         RFDs received
+    PacketArrayCount    Number of RFDs in PacketArray
+    PacketFreeArray     Receives the RFDs that can be returned, at least
+                        PacketArrayCount entries
 
 Return Value:
 
-     None
+     Number of RFDs in PacketFreeArray
 
 --*/
 {
-    PMP_RFD             pMpRfd = NULL;
+    PMP_RFD             pMpRfd;
     ULONG               index;
-    NTSTATUS            status;
-    PVOID               buffer;
-    WDFREQUEST          request;
-    size_t              bufLength=0;
+    ULONG               channels = 0;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "--> NICServiceReadIrps\n");
 
-
     for(index=0; index < PacketArrayCount; index++)
     {
         pMpRfd = PacketArray[index];
         ASSERT(pMpRfd);
+        ASSERT(pMpRfd->Channel < PCIDRV_MAX_CHANNELS);
 
-        do {
-            status = WdfIoQueueRetrieveNextRequest( FdoData->PendingReadQueue,
-                                                    &request );
+        NICPushRecvBacklog(&FdoData->RecvChannel[pMpRfd->Channel], pMpRfd);
+        channels |= 1 << pMpRfd->Channel;
 
-            if(NT_SUCCESS(status)){
+        PacketFreeArray[index] = pMpRfd;
+    }
 
-                WDF_REQUEST_PARAMETERS  params;
-                ULONG                   length = 0;
+    //
+    // Only the channels that got words can have new work for their reads.
+    //
+    for (index = 0; index < PCIDRV_MAX_CHANNELS; index++)
+    {
+        if (channels & (1 << index)) {
+            NICDrainRecvBacklog(&FdoData->RecvChannel[index]);
+        }
+    }
 
-                WDF_REQUEST_PARAMETERS_INIT(&params);
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<-- NICServiceReadIrps\n");
 
-                WdfRequestGetParameters(
-                    request,
-                    &params
-                     );
+    return PacketArrayCount;
 
-                ASSERT(status == STATUS_SUCCESS);
+}
 
-                bufLength = params.Parameters.Read.Length;
+BOOLEAN
+NICPushRecvBacklog(
+    IN  PMP_RECV_CHANNEL    Channel,
+    IN  PMP_RFD             pMpRfd
+    )
+/*++
+Routine Description:
 
-                status = WdfRequestRetrieveOutputBuffer(request,
-                                                        bufLength,
-                                                        &buffer,
-                                                        &bufLength);
-                if(NT_SUCCESS(status) ) {
+    Copy a received word at the tail of its channel's backlog. If the
+    backlog is full, drop the oldest or this word, per RecvBacklogPolicy.
 
-                    length = min((ULONG)bufLength, pMpRfd->PacketSize);
+    Assumption: Only called from the receive path, which is the single
+    producer of the backlog.
 
-                    RtlCopyMemory(buffer, pMpRfd->Buffer, length);
+Arguments:
 
-                    Hexdump((TRACE_LEVEL_VERBOSE, DBG_READ,
-                             "Received Packet Data: %!HEXDUMP!\n",
-                             log_xstr(buffer, (USHORT)length)));
-                    FdoData->BytesReceived += length;
-                }
+    Channel     The channel the word was tagged with
+    pMpRfd      The RFD the word was received in
 
-                WdfRequestCompleteWithInformation(request, status, length);
+Return Value:
+
+    FALSE if the word was dropped
+
+--*/
+{
+    PFDO_DATA           FdoData = Channel->FdoData;
+    PMP_RECV_RECORD     pRecord;
+    ULONG               head;
+    ULONG               tail;
+
+    tail = Channel->BacklogTail;
+    head = MP_LOAD_ACQUIRE(&Channel->BacklogHead);
+
+    if (tail - head >= FdoData->RecvBacklogSize)
+    {
+        //
+        // Dropping the oldest word moves the head, which only the drain
+        // owner may do. If a reader is draining right now it is about to
+        // make room anyway, so drop this word instead.
+        //
+        if (FdoData->RecvBacklogPolicy == NIC_BACKLOG_DROP_OLDEST &&
+            InterlockedCompareExchange(&Channel->DrainOwner, 1, 0) == 0)
+        {
+            head = Channel->BacklogHead;
+            if (tail - head >= FdoData->RecvBacklogSize) {
+                head++;
+                MP_STORE_RELEASE(&Channel->BacklogHead, head);
+                Channel->BacklogOverflows++;
+            }
+
+            InterlockedExchange(&Channel->DrainOwner, 0);
+        }
+        else
+        {
+            Channel->BacklogOverflows++;
+            return FALSE;
+        }
+    }
+
+    pRecord = &Channel->Backlog[tail & (FdoData->RecvBacklogSize - 1)];
+
+    pRecord->Sequence = pMpRfd->Sequence;
+    pRecord->TimeStamp = (ULONG64) pMpRfd->TimeStamp.QuadPart;
+    pRecord->Length = min(pMpRfd->PacketSize, NIC_RECV_WORD_SIZE);
+    RtlCopyMemory(pRecord->Data, pMpRfd->Buffer, pRecord->Length);
+
+    MP_STORE_RELEASE(&Channel->BacklogTail, tail + 1);
+
+    if (tail + 1 - head > Channel->BacklogHighWater) {
+        Channel->BacklogHighWater = tail + 1 - head;
+    }
+
+    return TRUE;
+}
+
+__inline
+VOID
+NICRecordRecvLatency(
+    IN  PFDO_DATA           FdoData,
+    IN  PMP_RECV_RECORD     pRecord,
+    IN  ULONG64             Now
+    )
+/*++
+Routine Description:
+
+    Count a word's time from the receive handler to now, in microseconds,
+    in RecvLatencyHistogram. The drain owners of several channels can be
+    in here at once.
+
+--*/
+{
+    ULONG64 microseconds;
+    ULONG   bucket;
+
+    microseconds = (Now - pRecord->TimeStamp) * 1000000 /
+                   FdoData->PerformanceFrequency;
+
+    bucket = MP_HISTOGRAM_BUCKET(microseconds);
+
+    InterlockedIncrement64(&FdoData->RecvLatencyHistogram[bucket]);
+}
+
+VOID
+NICDrainRecvBacklog(
+    IN  PMP_RECV_CHANNEL    Channel
+    )
+/*++
+Routine Description:
+
+    Copy the words waiting in a channel's backlog into the buffers of the
+    read IRPs pending on the channel and complete the IRPs. A read with room for it gets a
+    burst of words as PCIDRV_RECORD_HEADER framed records, see public.h.
+
+    Can be called by the receive path and by a read showing up at the
+    same time. Only one of them drains; the other one leaves it to the
+    drain owner, who checks for more work after letting go.
+
+Arguments:
+
+    Channel     The channel to drain
+
+Return Value:
+
+     None
+
+--*/
+{
+    PFDO_DATA               FdoData = Channel->FdoData;
+    PMP_RECV_RECORD         pRecord;
+    PPCIDRV_RECORD_HEADER   pHeader;
+    WDF_REQUEST_PARAMETERS  params;
+    WDFREQUEST              request;
+    PVOID                   buffer;
+    size_t                  bufLength;
+    ULONG                   head;
+    ULONG                   tail;
+    ULONG                   length;
+    ULONG                   records;
+    ULONG                   recordSize;
+    ULONG                   queuedReads = 0;
+    ULONG64                 now;
+    NTSTATUS                status;
+
+    if (Channel->Backlog == NULL) {
+        return;
+    }
+
+    do {
+        if (InterlockedCompareExchange(&Channel->DrainOwner, 1, 0) != 0) {
+            break;
+        }
+
+        head = Channel->BacklogHead;
+
+        for (;;)
+        {
+            tail = MP_LOAD_ACQUIRE(&Channel->BacklogTail);
+            if (head == tail) {
                 break;
-            }else {
+            }
+
+            status = WdfIoQueueRetrieveNextRequest( Channel->PendingReadQueue,
+                                                    &request );
+
+            if(!NT_SUCCESS(status)){
                 ASSERTMSG("WdfIoQueueRetrieveNextRequest failed",
                           (status == STATUS_NO_MORE_ENTRIES ||
                            status == STATUS_WDF_PAUSED));
                 break;
             }
 
-        } WHILE (TRUE);
+            WDF_REQUEST_PARAMETERS_INIT(&params);
 
+            WdfRequestGetParameters(
+                request,
+                &params
+                 );
 
-        WdfSpinLockAcquire(FdoData->RcvLock);
+            bufLength = params.Parameters.Read.Length;
+
+            status = WdfRequestRetrieveOutputBuffer(request,
+                                                    bufLength,
+                                                    &buffer,
+                                                    &bufLength);
+            if(!NT_SUCCESS(status) ) {
+                NICCompleteRequest(FdoData, request, status, 0);
+                continue;
+            }
 
-        ASSERT(MP_TEST_FLAG(pMpRfd, fMP_RFD_RECV_PEND));
-        MP_CLEAR_FLAG(pMpRfd, fMP_RFD_RECV_PEND);
+            length = 0;
+            pRecord = &Channel->Backlog[head & (FdoData->RecvBacklogSize - 1)];
 
+            //
+            // The read completes right after the copy; close enough for
+            // the latency of every word it carries.
+            //
+            now = (ULONG64) KeQueryPerformanceCounter(NULL).QuadPart;
 
-        NICReturnRFD(FdoData, pMpRfd);
+            if (bufLength < PCIDRV_RECORD_SIZE(pRecord->Length)) {
 
-        WdfSpinLockRelease(FdoData->RcvLock);
+                //
+                // Too small for a record: return the bare payload.
+                //
+                length = min((ULONG)bufLength, pRecord->Length);
 
-    }// end of loop
+                RtlCopyMemory(buffer, pRecord->Data, length);
+                NICRecordRecvLatency(FdoData, pRecord, now);
+                head++;
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<-- NICServiceReadIrps\n");
+            } else {
+
+                records = 0;
+
+                while (head != tail)
+                {
+                    pRecord = &Channel->Backlog[head & (FdoData->RecvBacklogSize - 1)];
+                    recordSize = PCIDRV_RECORD_SIZE(pRecord->Length);
+
+                    if (length + recordSize > bufLength) {
+                        break;
+                    }
+
+                    pHeader = (PPCIDRV_RECORD_HEADER)((PUCHAR)buffer + length);
+                    RtlZeroMemory(pHeader, recordSize);
+                    pHeader->Length = (USHORT)pRecord->Length;
+                    pHeader->Sequence = pRecord->Sequence;
+                    pHeader->TimeStamp = pRecord->TimeStamp;
+
+                    RtlCopyMemory(pHeader + 1, pRecord->Data, pRecord->Length);
+                    NICRecordRecvLatency(FdoData, pRecord, now);
+
+                    length += recordSize;
+                    records++;
+                    head++;
+                }
+
+                InterlockedIncrement64(&FdoData->FramedReads);
+                InterlockedExchangeAdd64(&FdoData->FramedRecords, records);
+            }
+
+            //
+            // Give the slots back to the producer before completing.
+            //
+            MP_STORE_RELEASE(&Channel->BacklogHead, head);
+
+            Hexdump((TRACE_LEVEL_VERBOSE, DBG_READ,
+                     "Received Packet Data: %!HEXDUMP!\n",
+                     log_xstr(buffer, (USHORT)length)));
+            InterlockedExchangeAdd64(&FdoData->BytesReceived, length);
+
+            NICCompleteRequest(FdoData, request, STATUS_SUCCESS, length);
+        }
+
+        InterlockedExchange(&Channel->DrainOwner, 0);
+
+        //
+        // A word or a read may have come in while we were draining and
+        // been left to us.
+        //
+        WdfIoQueueGetState(Channel->PendingReadQueue, &queuedReads, NULL);
+
+    } while (queuedReads > 0 &&
+             MP_RING_COUNT(&Channel->BacklogHead,
+                           &Channel->BacklogTail) > 0);
+}
+
+VOID
+NICEvtReadQueueReady(
+    IN WDFQUEUE     Queue,
+    IN WDFCONTEXT   Context
+    )
+/*++
+Routine Description:
+
+    Called by the framework when a read lands in the empty
+    PendingReadQueue of a channel. Hand it the words waiting in the
+    channel's backlog.
+
+Arguments:
+
+    Queue   - Handle to the channel's PendingReadQueue
+    Context - The channel
+
+Return Value:
 
-    return;
+    VOID
 
+--*/
+{
+    UNREFERENCED_PARAMETER(Queue);
+
+    NICDrainRecvBacklog((PMP_RECV_CHANNEL) Context);
 }
 
+VOID
+PciDrvEvtIoRead(
+    IN WDFQUEUE         Queue,
+    IN WDFREQUEST       Request,
+    IN size_t           Length
+    )
+/*++
+
+Routine Description:
+
+    Called by the framework for every read request. A read goes to the
+    PendingReadQueue of the channel its file was opened on, to be served
+    from the channel's backlog.
+
+    With zero-copy receive on, a read on channel 0 instead starts a DMA
+    transaction for the request buffer; the program DMA callback posts it
+    to the device. A read too big for a single transfer falls back to the
+    PendingReadQueue.
+
+Arguments:
+
+    Queue - Handle to the framework queue object that is associated
+            with the I/O request.
+    Request - Handle to a framework request object.
+    Length - Length of the IO operation
+
+Return Value:
+
+    VOID
 
+--*/
+{
+    PFDO_DATA                   fdoData;
+    PMP_RECV_CHANNEL            channel;
+    WDFDMATRANSACTION           dmaTransaction;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    NTSTATUS                    status;
+    BOOLEAN                     bCreated = FALSE;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ,
+                "--> PciDrvEvtIoRead Request %p\n", Request);
+
+    fdoData = FdoGetData(WdfIoQueueGetDevice(Queue));
+    channel = &fdoData->RecvChannel[
+                  FileGetData(WdfRequestGetFileObject(Request))->Channel];
 
+    //
+    // The device fills posted buffers without looking at the channel tag,
+    // so only channel 0 reads can be posted, and only while no file is
+    // open on another channel.
+    //
+    if (!fdoData->ZeroCopyRecv || channel->Index != 0 ||
+        fdoData->TaggedFilesOpen != 0) {
 
+        status = WdfRequestForwardToIoQueue(Request,
+                                            channel->PendingReadQueue);
+        if(!NT_SUCCESS(status)) {
+            WdfRequestCompleteWithInformation(Request, status, 0);
+        }
+        return;
+    }
+
+    //
+    // Words that came in while no read was posted wait in the backlog, and
+    // a posted read would get the newer words ahead of them. Let the copy
+    // path serve reads until the backlog is empty.
+    //
+    if (MP_RING_COUNT(&channel->BacklogHead, &channel->BacklogTail) > 0) {
+
+        InterlockedIncrement64(&fdoData->ZeroCopyFallbacks);
+
+        status = WdfRequestForwardToIoQueue(Request,
+                                            channel->PendingReadQueue);
+        if(!NT_SUCCESS(status)) {
+            WdfRequestCompleteWithInformation(Request, status, 0);
+        }
+        return;
+    }
+
+    do {
+        if (Length > (NIC_MAX_PHYS_BUF_COUNT - 1) * PAGE_SIZE) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        status = NICAllocDmaTransaction(fdoData, &dmaTransaction);
+        if(!NT_SUCCESS(status)) {
+            break;
+        }
+
+        bCreated = TRUE;
+
+        status = WdfDmaTransactionInitializeUsingRequest(
+                                     dmaTransaction,
+                                     Request,
+                                     NICEvtProgramReadDmaFunction,
+                                     WdfDmaDirectionReadFromDevice );
+
+        if(!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+                       "WdfDmaTransactionInitalizeUsingRequest failed %X\n",
+                       status);
+            break;
+        }
+
+        dmaContext = GetDmaTransactionContext(dmaTransaction);
+        dmaContext->Initialized = TRUE;
+        dmaContext->RequestCount = 1;
+        dmaContext->Requests[0] = Request;
+        dmaContext->Lengths[0] = (ULONG) Length;
+
+        InterlockedIncrement(&dmaContext->References);
+
+        status = WdfDmaTransactionExecute( dmaTransaction,
+                                           dmaTransaction );
+
+        NICFreeDmaTransaction(fdoData, dmaTransaction);
+
+        if(!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+                            "WdfDmaTransactionExecute failed %X\n", status);
+            break;
+        }
+
+    } WHILE (FALSE);
+
+    if(!NT_SUCCESS(status)) {
+
+        if(bCreated) {
+            NICFreeDmaTransaction(fdoData, dmaTransaction);
+        }
+
+        //
+        // Fall back to the copy path.
+        //
+        InterlockedIncrement64(&fdoData->ZeroCopyFallbacks);
+
+        status = WdfRequestForwardToIoQueue(Request,
+                                            channel->PendingReadQueue);
+        if(!NT_SUCCESS(status)) {
+            WdfRequestCompleteWithInformation(Request, status, 0);
+        }
+    }
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ,
+                "<-- PciDrvEvtIoRead %X\n", status);
+}
+
+BOOLEAN
+NICEvtProgramReadDmaFunction(
+    IN  WDFDMATRANSACTION       Transaction,
+    IN  WDFDEVICE               Device,
+    IN  PVOID                   Context,
+    IN  WDF_DMA_DIRECTION       Direction,
+    IN  PSCATTER_GATHER_LIST    ScatterGather
+    )
+/*++
+
+Routine Description:
+
+    Post the buffer of a zero-copy read to the device: fill the HW_RBD at
+    RecvPostTail with the scatter-gather list and ring the receive
+    doorbell. If the RBD ring is full, a file is open on another channel
+    or channel 0 has words in its backlog, the read falls back to the copy
+    path.
+
+Arguments:
+
+Return Value:
+
+--*/
+{
+    PFDO_DATA                   fdoData;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    PHW_RBD                     pHwRbd;
+    PMP_RBD                     pMpRbd;
+    WDFREQUEST                  request;
+    ULONG                       fragmentCount;
+    ULONG                       highFragments;
+    ULONG                       length;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER( Context );
+    UNREFERENCED_PARAMETER( Direction );
+
+    fdoData = FdoGetData(Device);
+    dmaContext = GetDmaTransactionContext(Transaction);
+
+    WdfSpinLockAcquire(fdoData->RcvLock);
+
+    //
+    // TaggedFilesOpen and the backlog are checked again under the lock, in
+    // case a file was opened on another channel and the ring flushed, or
+    // words were left in the backlog, since PciDrvEvtIoRead.
+    //
+    if (fdoData->RecvPostTail - fdoData->RecvPostHead >= NIC_MAX_POSTED_READS ||
+        ScatterGather->NumberOfElements > NIC_MAX_PHYS_BUF_COUNT ||
+        fdoData->TaggedFilesOpen != 0 ||
+        MP_RING_COUNT(&fdoData->RecvChannel[0].BacklogHead,
+                      &fdoData->RecvChannel[0].BacklogTail) > 0) {
+
+        WdfSpinLockRelease(fdoData->RcvLock);
+
+        request = dmaContext->Requests[0];
+
+        //
+        // Must abort the transaction before deleting. It goes back to the
+        // pool once PciDrvEvtIoRead lets go of it.
+        //
+        (VOID) WdfDmaTransactionDmaCompletedFinal(Transaction, 0, &status);
+        NICFreeDmaTransaction(fdoData, Transaction);
+
+        InterlockedIncrement64(&fdoData->ZeroCopyFallbacks);
+
+        status = WdfRequestForwardToIoQueue(request,
+                                            fdoData->RecvChannel[0].PendingReadQueue);
+        if(!NT_SUCCESS(status)) {
+            WdfRequestCompleteWithInformation(request, status, 0);
+        }
+        return TRUE;
+    }
+
+    //
+    // A posted read can sit in the ring until the device has a word for
+    // it, so let it be cancelled. The cancel routine takes RcvLock, so it
+    // can't flush the ring before this read is in it.
+    //
+    request = dmaContext->Requests[0];
+    RequestGetData(request)->CancelRefs = 0;
+
+    status = WdfRequestMarkCancelableEx(request, NICEvtPostedReadCancel);
+    if (!NT_SUCCESS(status)) {
+
+        WdfSpinLockRelease(fdoData->RcvLock);
+
+        (VOID) WdfDmaTransactionDmaCompletedFinal(Transaction, 0, &status);
+        NICFreeDmaTransaction(fdoData, Transaction);
+
+        WdfRequestCompleteWithInformation(request, STATUS_CANCELLED, 0);
+        return TRUE;
+    }
+
+    pHwRbd = &fdoData->HwRbd[fdoData->RecvPostTail & (NIC_MAX_POSTED_READS - 1)];
+    pMpRbd = &fdoData->RecvPost[fdoData->RecvPostTail & (NIC_MAX_POSTED_READS - 1)];
+
+    ASSERT(pMpRbd->DmaTransaction == NULL);
+
+    fragmentCount = NICEncodeTbds(pHwRbd->RbdFragment, ScatterGather,
+                                  &length, &highFragments);
+
+    pMpRbd->DmaTransaction = Transaction;
+    pMpRbd->Length = length;
+
+    pHwRbd->RbdStatus = 0;
+    pHwRbd->RbdActualCount = 0;
+
+    KeMemoryBarrier();
+
+    pHwRbd->RbdFragmentCount = fragmentCount;
+
+    fdoData->RecvPostTail++;
+
+    InterlockedExchangeAdd64(&fdoData->DmaFragments, fragmentCount);
+    if (highFragments) {
+        InterlockedExchangeAdd64(&fdoData->DmaFragmentsAbove4GB, highFragments);
+    }
+
+    if (fdoData->CSRAddress) {
+        WRITE_REGISTER_ULONG(fdoData->CSRAddress + NIC_CSR_RX_POST_PRODUCER,
+                             fdoData->RecvPostTail & (NIC_MAX_POSTED_READS - 1));
+    }
+
+    WdfSpinLockRelease(fdoData->RcvLock);
+
+    return TRUE;
+}
+
+__drv_sameIRQL
+__drv_requiresIRQL(DISPATCH_LEVEL)
+VOID
+NICCompletePostedReads(
+    IN  PFDO_DATA  FdoData
+    )
+/*++
+Routine Description:
+
+    Complete the zero-copy reads the device has written to, in the order
+    they were posted. The data is already in the callers' buffers.
+
+    Assumption: This function is called with the Rcv SPINLOCK held. The
+    lock is dropped while the requests are completed.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    WDFDMATRANSACTION   transactions[NIC_DEF_RFDS];
+    ULONG               actualCounts[NIC_DEF_RFDS];
+    ULONG               postedLengths[NIC_DEF_RFDS];
+    PDMA_TRANSACTION_CONTEXT dmaContext;
+    PHW_RBD             pHwRbd;
+    PMP_RBD             pMpRbd;
+    WDFREQUEST          request;
+    ULONG               count;
+    ULONG               index;
+    ULONG               length;
+    NTSTATUS            status;
+
+    do {
+        count = 0;
+
+        while (count < NIC_DEF_RFDS &&
+               FdoData->RecvPostHead != FdoData->RecvPostTail)
+        {
+            pHwRbd = &FdoData->HwRbd[FdoData->RecvPostHead & (NIC_MAX_POSTED_READS - 1)];
+            pMpRbd = &FdoData->RecvPost[FdoData->RecvPostHead & (NIC_MAX_POSTED_READS - 1)];
+
+            if (!(pHwRbd->RbdStatus & HW_RBD_STATUS_COMPLETE)) {
+                break;
+            }
+
+            KeMemoryBarrier();
+
+            transactions[count] = pMpRbd->DmaTransaction;
+            actualCounts[count] = min(pHwRbd->RbdActualCount, pMpRbd->Length);
+            postedLengths[count] = pMpRbd->Length;
+            count++;
+
+            pMpRbd->DmaTransaction = NULL;
+            pHwRbd->RbdFragmentCount = 0;
+            pHwRbd->RbdStatus = 0;
+
+            FdoData->RecvPostHead++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        WdfSpinLockRelease(FdoData->RcvLock);
+
+        for (index = 0; index < count; index++)
+        {
+            dmaContext = GetDmaTransactionContext(transactions[index]);
+            request = dmaContext->Requests[0];
+            length = actualCounts[index];
+
+            //
+            // A read is a single transfer; a short one ends it early.
+            //
+            if (length < postedLengths[index]) {
+                (VOID) WdfDmaTransactionDmaCompletedFinal(transactions[index],
+                                                          length,
+                                                          &status);
+            } else {
+                (VOID) WdfDmaTransactionDmaCompletedWithLength(transactions[index],
+                                                               length,
+                                                               &status);
+            }
+
+            NICFreeDmaTransaction(FdoData, transactions[index]);
+
+            if (!NICReleasePostedRead(request)) {
+                continue;
+            }
+
+            //
+            // An RBD comes back empty only when the ring was flushed for
+            // a cancel. The other reads in it go to the copy path.
+            //
+            if (length == 0) {
+
+                InterlockedIncrement64(&FdoData->ZeroCopyFallbacks);
+
+                status = WdfRequestForwardToIoQueue(request,
+                                                    FdoData->RecvChannel[0].PendingReadQueue);
+                if(!NT_SUCCESS(status)) {
+                    NICCompleteRequest(FdoData, request, status, 0);
+                }
+                continue;
+            }
+
+            InterlockedExchangeAdd64(&FdoData->BytesReceived, length);
+            InterlockedIncrement64(&FdoData->ZeroCopyReads);
+
+            NICCompleteRequest(FdoData, request, STATUS_SUCCESS, length);
+        }
+
+        WdfSpinLockAcquire(FdoData->RcvLock);
+
+    } WHILE (TRUE);
+}
+
+VOID
+NICFreePostedReads(
+    IN  PFDO_DATA  FdoData
+    )
+/*++
+Routine Description:
+
+    Take back all the reads posted to the device and cancel them. Called
+    from PciDrvEvtDeviceReleaseHardware, once the poll DPC is cancelled.
+    The ring is flushed first so the device no longer writes to the
+    posted buffers.
+
+    Assumption: RcvLock is not held.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+     None
+
+--*/
+{
+    WDFDMATRANSACTION   dmaTransaction;
+    WDFREQUEST          request;
+    PMP_RBD             pMpRbd;
+    ULONG               wait;
+    NTSTATUS            status;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "--> NICFreePostedReads\n");
+
+    WdfSpinLockAcquire(FdoData->RcvLock);
+
+    if (FdoData->CSRAddress && FdoData->RecvPostHead != FdoData->RecvPostTail) {
+
+        WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_FLUSH, 1);
+
+        for (wait = 0; wait < NIC_RX_FLUSH_WAIT; wait++)
+        {
+            if (READ_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_FLUSH) == 0) {
+                break;
+            }
+            KeStallExecutionProcessor(10);
+        }
+    }
+
+    while (FdoData->RecvPostHead != FdoData->RecvPostTail)
+    {
+        pMpRbd = &FdoData->RecvPost[FdoData->RecvPostHead & (NIC_MAX_POSTED_READS - 1)];
+        dmaTransaction = pMpRbd->DmaTransaction;
+        pMpRbd->DmaTransaction = NULL;
+        FdoData->HwRbd[FdoData->RecvPostHead & (NIC_MAX_POSTED_READS - 1)].RbdFragmentCount = 0;
+        FdoData->RecvPostHead++;
+
+        WdfSpinLockRelease(FdoData->RcvLock);
+
+        request = GetDmaTransactionContext(dmaTransaction)->Requests[0];
+
+        (VOID) WdfDmaTransactionDmaCompletedFinal(dmaTransaction, 0, &status);
+        NICFreeDmaTransaction(FdoData, dmaTransaction);
+
+        if (NICReleasePostedRead(request)) {
+            WdfRequestCompleteWithInformation(request, STATUS_CANCELLED, 0);
+        }
+
+        WdfSpinLockAcquire(FdoData->RcvLock);
+    }
+
+    WdfSpinLockRelease(FdoData->RcvLock);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ, "<-- NICFreePostedReads\n");
+}
+
+VOID
+NICEvtPostedReadCancel(
+    IN  WDFREQUEST  Request
+    )
+/*++
+Routine Description:
+
+    Cancel routine of a posted read. The device owns the buffer, so the
+    request can't be completed here: flush the RBD ring instead and let
+    the poll DPC take the reads back. Whichever of this routine and
+    NICReleasePostedRead runs last completes the request.
+
+Arguments:
+
+    Request     The posted read
+
+Return Value:
+
+    None
+
+--*/
+{
+    PFDO_DATA   fdoData;
+
+    fdoData = FdoGetData(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)));
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_READ,
+                "NICEvtPostedReadCancel request %p\n", Request);
+
+    NICFlushPostedReads(fdoData);
+
+    if (InterlockedIncrement(&RequestGetData(Request)->CancelRefs) == 2) {
+        WdfRequestCompleteWithInformation(Request, STATUS_CANCELLED, 0);
+    }
+}
+
+VOID
+NICFlushPostedReads(
+    IN  PFDO_DATA  FdoData
+    )
+/*++
+Routine Description:
+
+    Have the device hand back every posted read as it is, and queue the
+    poll DPC to complete them. Reads that come back empty go to the copy
+    path.
+
+    Takes RcvLock, so a read being posted is either flushed too or not
+    posted at all.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    WdfSpinLockAcquire(FdoData->RcvLock);
+
+    if (FdoData->CSRAddress) {
+        WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_RX_POST_FLUSH, 1);
+    }
+
+    WdfSpinLockRelease(FdoData->RcvLock);
+
+    WdfDpcEnqueue(FdoData->RecvPollDpc);
+}
+
+BOOLEAN
+NICReleasePostedRead(
+    IN  WDFREQUEST  Request
+    )
+/*++
+Routine Description:
+
+    Called once the device has given the buffer of a posted read back.
+    Make the request non-cancelable again.
+
+Arguments:
+
+    Request     The posted read
+
+Return Value:
+
+    TRUE if the caller owns the request and must complete it. FALSE if
+    it was cancelled; NICEvtPostedReadCancel completes it, or this
+    function did if the cancel routine already ran.
+
+--*/
+{
+    if (WdfRequestUnmarkCancelable(Request) != STATUS_CANCELLED) {
+        return TRUE;
+    }
+
+    if (InterlockedIncrement(&RequestGetData(Request)->CancelRefs) == 2) {
+        WdfRequestCompleteWithInformation(Request, STATUS_CANCELLED, 0);
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,67 @@
+/*++
+
+Module Name:
+
+    nic_ring.h
+
+Abstract:
+
+    Index accessors of the lock-free single-producer/single-consumer
+    rings (the TCB ring). They only depend on KeMemoryBarrier and
+    KeMemoryBarrierWithoutFence, so the user-mode ring test in test\unit
+    builds them as they are.
+
+--*/
+
+#ifndef _NIC_RING_H
+#define _NIC_RING_H
+
+//--------------------------------------
+// Acquire/release accessors for the indices of the lock-free rings.
+// x86 and x64 don't reorder loads with loads or stores with stores, so
+// only the compiler has to be kept from moving accesses across them.
+//--------------------------------------
+#if defined(_M_IX86) || defined(_M_AMD64)
+#define MP_ORDER_BARRIER()          KeMemoryBarrierWithoutFence()
+#else
+#define MP_ORDER_BARRIER()          KeMemoryBarrier()
+#endif
+
+__inline ULONG MP_LOAD_ACQUIRE(
+    IN volatile ULONG *Index)
+{
+    ULONG value = *Index;
+    MP_ORDER_BARRIER();
+    return value;
+}
+
+__inline VOID MP_STORE_RELEASE(
+    IN volatile ULONG *Index,
+    IN ULONG Value)
+{
+    MP_ORDER_BARRIER();
+    *Index = Value;
+}
+
+//
+// Number of entries between the free running head and tail of a ring.
+// The head is read first: it never passes the tail, so this can't wrap.
+//
+__inline ULONG MP_RING_COUNT(
+    IN volatile ULONG *Head,
+    IN volatile ULONG *Tail)
+{
+    ULONG head = MP_LOAD_ACQUIRE(Head);
+    return MP_LOAD_ACQUIRE(Tail) - head;
+}
+
+//
+// A ring shared with the device: the device only sees an index masked by
+// the ring size (a power of two), and takes a producer index equal to its
+// own as an empty ring. So the ring holds one entry less than its size,
+// or a full ring would look empty.
+//
+#define MP_RING_CAPACITY(_Size)             ((_Size) - 1)
+#define MP_RING_DEVICE_INDEX(_Index, _Size) ((_Index) & ((_Size) - 1))
+
+#endif  // _NIC_RING_H
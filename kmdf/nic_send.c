@@ -24,60 +24,354 @@ Environment:
 #include "nic_send.tmh"
 #endif
 
-__drv_sameIRQL
-__drv_requiresIRQL(DISPATCH_LEVEL)
 __inline
-VOID
-MP_FREE_SEND_PACKET(
-    IN  PFDO_DATA   FdoData,
-    IN  PMP_TCB     pMpTcb,
-    IN  NTSTATUS    Status
+ULONG
+NICGetWriteLength(
+    IN  WDFREQUEST  Request
+    )
+{
+    WDF_REQUEST_PARAMETERS  params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    //
+    // Priority sends come in as METHOD_IN_DIRECT ioctls with the data in
+    // the output buffer.
+    //
+    if (params.Type == WdfRequestTypeDeviceControl) {
+        return (ULONG) params.Parameters.DeviceIoControl.OutputBufferLength;
+    }
+
+    return (ULONG) params.Parameters.Write.Length;
+}
+
+NTSTATUS
+NICCreateDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    OUT WDFDMATRANSACTION   *DmaTransaction
     )
 /*++
 Routine Description:
 
-    Recycle a MP_TCB and complete the packet if necessary
+    Create a write DMA transaction with a DMA_TRANSACTION_CONTEXT.
+    Can be called at DISPATCH_LEVEL.
 
-    Assumption: This function is called with the Send SPINLOCK held.
+--*/
+{
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    NTSTATUS                status;
 
-Arguments:
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes,
+                                            DMA_TRANSACTION_CONTEXT);
 
-    FdoData     Pointer to our FdoData
-    pMpTcb      Pointer to MP_TCB
+    status = WdfDmaTransactionCreate( FdoData->WdfDmaEnabler,
+                                      &attributes,
+                                      DmaTransaction );
 
-Return Value:
+    if(!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "WdfDmaTransactionCreate failed %X\n", status);
+    }
 
-    None
+    return status;
+}
+
+NTSTATUS
+NICAllocDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    OUT WDFDMATRANSACTION   *DmaTransaction
+    )
+/*++
+Routine Description:
+
+    Take a DMA transaction from the pool. If the pool is empty a
+    new one is created and counted as a miss.
 
 --*/
 {
+    PSLIST_ENTRY    entry;
+    LONG            outstanding;
+    LONG            highWater;
+    NTSTATUS        status = STATUS_SUCCESS;
+
+    entry = ExInterlockedPopEntrySList(&FdoData->DmaTransactionPool,
+                                       &FdoData->DmaTransactionPoolLock);
+    if (entry) {
 
-    WDFREQUEST          request;
+        *DmaTransaction = WdfObjectContextGetObject(
+            CONTAINING_RECORD(entry, DMA_TRANSACTION_CONTEXT, PoolEntry));
+        InterlockedIncrement64(&FdoData->DmaTransactionPoolHits);
+
+    } else {
+
+        status = NICCreateDmaTransaction(FdoData, DmaTransaction);
+        if(!NT_SUCCESS(status)) {
+            return status;
+        }
+        InterlockedIncrement64(&FdoData->DmaTransactionPoolMisses);
+    }
+
+    GetDmaTransactionContext(*DmaTransaction)->References = 1;
+
+    outstanding = InterlockedIncrement(&FdoData->DmaTransactionsOutstanding);
+
+    do {
+        highWater = FdoData->DmaTransactionsHighWater;
+        if (outstanding <= highWater) {
+            break;
+        }
+    } while (InterlockedCompareExchange(&FdoData->DmaTransactionsHighWater,
+                                        outstanding,
+                                        highWater) != highWater);
+
+    return status;
+}
+
+VOID
+NICFreeDmaTransaction(
+    IN  PFDO_DATA           FdoData,
+    IN  WDFDMATRANSACTION   DmaTransaction
+    )
+/*++
+Routine Description:
+
+    Drop a reference to a DMA transaction. With the last one, release
+    the transaction, free the partial MDLs built for it if it carried a
+    coalesced batch, and give it back to the pool. Once the pool is full
+    the transaction is deleted instead. The requests of the transaction
+    are not touched.
+
+    The reference from NICAllocDmaTransaction belongs to whoever finishes
+    the transaction. WdfDmaTransactionExecute and WdfDmaTransactionDmaCompleted
+    callers hold another one across the call, so a program DMA callback
+    that gives up on the transaction can't hand it to another CPU while
+    the framework is still using it.
+
+--*/
+{
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    PMDL                        mdl;
+    PMDL                        nextMdl;
+
+    dmaContext = GetDmaTransactionContext(DmaTransaction);
+
+    if (InterlockedDecrement(&dmaContext->References) > 0) {
+        return;
+    }
+
+    if (dmaContext->Initialized) {
+        WdfDmaTransactionRelease(DmaTransaction);
+    }
+
+    mdl = dmaContext->MdlChain;
+    while (mdl)
+    {
+        nextMdl = mdl->Next;
+        IoFreeMdl(mdl);
+        mdl = nextMdl;
+    }
+
+    dmaContext->Initialized = FALSE;
+    dmaContext->Priority = FALSE;
+    dmaContext->Pended = FALSE;
+    dmaContext->RequestCount = 0;
+    dmaContext->MdlChain = NULL;
+
+    InterlockedDecrement(&FdoData->DmaTransactionsOutstanding);
+
+    if (ExQueryDepthSList(&FdoData->DmaTransactionPool) <
+        FdoData->DmaTransactionPoolSize) {
+
+        ExInterlockedPushEntrySList(&FdoData->DmaTransactionPool,
+                                    &dmaContext->PoolEntry,
+                                    &FdoData->DmaTransactionPoolLock);
+    } else {
+        WdfObjectDelete( DmaTransaction );
+    }
+}
+
+__inline
+WDFDMATRANSACTION
+MP_RECYCLE_TCB(
+    IN  PFDO_DATA   FdoData,
+    IN  PMP_TCB     pMpTcb
+    )
+/*++
+Routine Description:
+
+    Hand the TCB at the head of the ring back to the producer and return
+    the transaction it was carrying.
+
+    Assumption: Only the send consumer calls this. SendLock is not held.
+
+--*/
+{
     WDFDMATRANSACTION   dmaTransaction;
-    size_t              length;
 
+    ASSERT(pMpTcb == MP_GET_TCB(FdoData, FdoData->SendHead));
     ASSERT(MP_TEST_FLAG(pMpTcb, fMP_TCB_IN_USE));
 
     dmaTransaction = pMpTcb->DmaTransaction;
     pMpTcb->DmaTransaction = NULL;
 
+    //
+    // Invalidate the HW TCB so the device never sees a stale command.
+    //
+    pMpTcb->HwTcb->TxCbCommand = 0;
+
     MP_CLEAR_FLAGS(pMpTcb);
 
-    FdoData->CurrSendHead = FdoData->CurrSendHead->Next;
-    FdoData->nBusySend--;
+    //
+    // Publish the head only once we are done touching the TCB.
+    //
+    MP_STORE_RELEASE(&FdoData->SendHead, FdoData->SendHead + 1);
+
+    return dmaTransaction;
+}
+
+__drv_sameIRQL
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__inline
+VOID
+NICCompleteSendBatch(
+    IN  PFDO_DATA       FdoData,
+    IN  PMP_SEND_BATCH  Batch
+    )
+/*++
+Routine Description:
 
-    request = WdfDmaTransactionGetRequest(dmaTransaction);
-    length  = WdfDmaTransactionGetBytesTransferred(dmaTransaction);
+    Complete every request collected in the batch and account for the
+    bytes in one go. With PassiveCompletion the requests only go to the
+    completion thread.
 
-    WdfObjectDelete( dmaTransaction );
+--*/
+{
+    ULONG   index;
 
-    if (request)
+    for (index = 0; index < Batch->Count; index++)
     {
-        WdfSpinLockRelease(FdoData->SendLock);
-        WdfRequestCompleteWithInformation(request, Status, length);
-        FdoData->BytesTransmitted += length;
+        NICCompleteRequest(FdoData,
+                           Batch->Requests[index],
+                           Batch->Status[index],
+                           Batch->Lengths[index]);
+    }
 
-        WdfSpinLockAcquire(FdoData->SendLock);
+    if (Batch->Bytes) {
+        InterlockedExchangeAdd64((LONG64 volatile *)&FdoData->BytesTransmitted,
+                                 (LONG64)Batch->Bytes);
+    }
+
+    MP_INIT_SEND_BATCH(Batch);
+}
+
+__drv_sameIRQL
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__inline
+VOID
+NICBatchWriteTransaction(
+    IN  PFDO_DATA           FdoData,
+    IN  PMP_SEND_BATCH      Batch,
+    IN  WDFDMATRANSACTION   DmaTransaction,
+    IN  NTSTATUS            Status
+    )
+/*++
+Routine Description:
+
+    Move the request of a finished write transaction, or every request
+    of the batch if it was coalesced, into the completion batch and give
+    the transaction back to the pool. The requests are completed later by
+    NICCompleteSendBatch; if the batch can't take them all, the requests
+    collected so far are completed first.
+
+    Assumption: Only the send consumer calls this. SendLock is not held.
+
+--*/
+{
+    ULONG                       index;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+
+    dmaContext = GetDmaTransactionContext(DmaTransaction);
+
+    if (Batch->Count + dmaContext->RequestCount > NIC_SEND_COMPLETION_BATCH) {
+        NICCompleteSendBatch(FdoData, Batch);
+    }
+
+    for (index = 0; index < dmaContext->RequestCount; index++)
+    {
+        Batch->Requests[Batch->Count] = dmaContext->Requests[index];
+        Batch->Lengths[Batch->Count] = dmaContext->Lengths[index];
+        Batch->Status[Batch->Count] = Status;
+        Batch->Bytes += dmaContext->Lengths[index];
+        Batch->Count++;
+    }
+
+    NICFreeDmaTransaction(FdoData, DmaTransaction);
+}
+
+__drv_sameIRQL
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__inline
+VOID
+MP_FREE_SEND_PACKET(
+    IN  PFDO_DATA       FdoData,
+    IN  PMP_TCB         pMpTcb,
+    IN  NTSTATUS        Status,
+    IN  PMP_SEND_BATCH  Batch
+    )
+/*++
+Routine Description:
+
+    Recycle a MP_TCB and queue its packet for completion. A TCB carrying
+    a coalesced transaction queues every request of the batch.
+
+    Assumption: Only the send consumer calls this. SendLock is not held.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    pMpTcb      Pointer to MP_TCB
+    Status      Completion status of the packet
+    Batch       Completion batch to add the requests to
+
+Return Value:
+
+    None
+
+--*/
+{
+    //
+    // A copied write was completed when it was copied.
+    //
+    if (MP_TEST_FLAG(pMpTcb, fMP_TCB_USE_LOCAL_BUF)) {
+        (VOID) MP_RECYCLE_TCB(FdoData, pMpTcb);
+        return;
+    }
+
+    NICBatchWriteTransaction(FdoData,
+                             Batch,
+                             MP_RECYCLE_TCB(FdoData, pMpTcb),
+                             Status);
+}
+
+__inline
+VOID
+NICKickQueuedSends(
+    IN  PFDO_DATA   FdoData
+    )
+/*++
+Routine Description:
+
+    A request was just queued. If there is a TCB for it, nobody else may
+    come along to send it: the send consumer runs without SendLock, so the
+    last busy TCB can complete, and its NICCheckForQueuedSends find the
+    queue empty, just before we queue. Drain, or leave it to the drain
+    owner.
+
+--*/
+{
+    if (MP_TCB_RESOURCES_AVAIABLE(FdoData)) {
+        NICCheckForQueuedSends(FdoData);
     }
 }
 
@@ -117,8 +411,8 @@ Return Value:
     PFDO_DATA       FdoData;
     WDFDEVICE       hDevice;
     PMDL            mdl = NULL;
-
-    UNREFERENCED_PARAMETER(Length);
+    BOOLEAN         bQueued = FALSE;
+    BOOLEAN         bCopied = FALSE;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "--> PciDrvEvtIoWrite Request %p\n", Request);
@@ -135,10 +429,63 @@ Return Value:
 
     } else {
 
-        status = NICInitiateDmaTransfer(FdoData, Request);
-        if(!NT_SUCCESS(status)) {
+        //
+        // Once writes are backing up in the PendingWriteQueue, or a drain
+        // holds requests it took from there but hasn't posted yet, line up
+        // behind them instead of starting a transaction of our own or
+        // copying. That keeps the words in order and lets
+        // NICCheckForQueuedSends coalesce them.
+        //
+        WdfSpinLockAcquire(FdoData->SendLock);
 
-            WdfRequestCompleteWithInformation(Request, status, 0);
+        if (FdoData->nWaitSend > 0 || FdoData->SendDrainOwner) {
+
+            status = WdfRequestForwardToIoQueue(Request,
+                                                FdoData->PendingWriteQueue);
+            if(NT_SUCCESS(status)) {
+                FdoData->nWaitSend++;
+                bQueued = TRUE;
+            }
+
+        } else if (Length <= FdoData->CopyThreshold &&
+                   MP_TCB_RESOURCES_AVAIABLE(FdoData)) {
+
+            //
+            // Tiny write: copy it into a TCB and skip the DMA transaction.
+            //
+            status = NICCopyWritePacket(FdoData, Request, (ULONG) Length);
+            bCopied = NT_SUCCESS(status);
+
+            if (bCopied && FdoData->SendDoorbellHold == 0) {
+                NICStartSend(FdoData);
+            }
+        }
+
+        WdfSpinLockRelease(FdoData->SendLock);
+
+        if (bQueued) {
+
+            NICKickQueuedSends(FdoData);
+
+        } else if (bCopied) {
+
+            //
+            // The data is in the common buffer, so the caller's buffer is
+            // no longer needed.
+            //
+            InterlockedExchangeAdd64((LONG64 volatile *)&FdoData->BytesTransmitted,
+                                     (LONG64) Length);
+            InterlockedIncrement64(&FdoData->CopiedWrites);
+
+            WdfRequestCompleteWithInformation(Request, status, Length);
+
+        } else {
+
+            status = NICInitiateDmaTransfer(FdoData, Request, FALSE, FALSE);
+            if(!NT_SUCCESS(status)) {
+
+                WdfRequestCompleteWithInformation(Request, status, 0);
+            }
         }
     }
 
@@ -149,32 +496,72 @@ Return Value:
 }
 
 NTSTATUS
-NICInitiateDmaTransfer(
+NICSendPriorityRequest(
     IN PFDO_DATA        FdoData,
     IN WDFREQUEST       Request
     )
+/*++
+Routine Description:
+
+    Send an IOCTL_PCIDRV_SEND_PRIORITY request. It skips the
+    PendingWriteQueue and may use the NIC_PRIORITY_TCBS TCBs that
+    ordinary writes leave free, so it only waits for the sends already
+    on the ring.
+
+    The command must fit in one TCB, which is why it is limited to
+    NIC_MAX_PACKET_SIZE.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Request     The priority send request
+
+Return Value:
+
+    NTSTATUS code. On failure the caller still owns the request.
+
+--*/
 {
-    WDFDMATRANSACTION   dmaTransaction;
-    NTSTATUS            status;
-    BOOLEAN             bCreated = FALSE;
+    ULONG       length;
+
+    length = NICGetWriteLength(Request);
+    if (length == 0 || length > NIC_MAX_PACKET_SIZE) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "Priority send of %d bytes rejected\n", length);
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    InterlockedIncrement64(&FdoData->PrioritySends);
+
+    return NICInitiateDmaTransfer(FdoData, Request, TRUE, FALSE);
+}
+
+NTSTATUS
+NICInitiateDmaTransfer(
+    IN PFDO_DATA        FdoData,
+    IN WDFREQUEST       Request,
+    IN BOOLEAN          Priority,
+    IN BOOLEAN          Pended
+    )
+{
+    WDFDMATRANSACTION           dmaTransaction;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    NTSTATUS                    status;
+    BOOLEAN                     bCreated = FALSE;
 
     do {
         //
-        // Create a new DmaTransaction.
+        // Get a DmaTransaction from the pool.
         //
-        status = WdfDmaTransactionCreate( FdoData->WdfDmaEnabler,
-                                          WDF_NO_OBJECT_ATTRIBUTES,
-                                          &dmaTransaction );
-
+        status = NICAllocDmaTransaction(FdoData, &dmaTransaction);
         if(!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                        "WdfDmaTransactionCreate failed %X\n", status);
             break;
         }
 
         bCreated = TRUE;
+
         //
-        // Initialize the new DmaTransaction.
+        // Initialize the DmaTransaction.
         //
 
         status = WdfDmaTransactionInitializeUsingRequest(
@@ -190,12 +577,24 @@ NICInitiateDmaTransfer(
             break;
         }
 
+        dmaContext = GetDmaTransactionContext(dmaTransaction);
+        dmaContext->Initialized = TRUE;
+        dmaContext->Priority = Priority;
+        dmaContext->Pended = Pended;
+        dmaContext->RequestCount = 1;
+        dmaContext->Requests[0] = Request;
+        dmaContext->Lengths[0] = NICGetWriteLength(Request);
+
         //
         // Execute this DmaTransaction.
         //
+        InterlockedIncrement(&dmaContext->References);
+
         status = WdfDmaTransactionExecute( dmaTransaction,
                                            dmaTransaction );
 
+        NICFreeDmaTransaction( FdoData, dmaTransaction );
+
         if(!NT_SUCCESS(status)) {
             TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
                             "WdfDmaTransactionExecute failed %X\n", status);
@@ -207,7 +606,7 @@ NICInitiateDmaTransfer(
     if(!NT_SUCCESS(status)){
 
         if(bCreated) {
-            WdfObjectDelete( dmaTransaction );
+            NICFreeDmaTransaction( FdoData, dmaTransaction );
 
         }
     }
@@ -215,6 +614,144 @@ NICInitiateDmaTransfer(
     return status;
 }
 
+NTSTATUS
+NICInitiateCoalescedDmaTransfer(
+    IN PFDO_DATA        FdoData,
+    __in_ecount(RequestCount) WDFREQUEST *Requests,
+    IN ULONG            RequestCount
+    )
+/*++
+Routine Description:
+
+    Start one DMA transaction for a batch of small write requests taken
+    from the PendingWriteQueue. The buffer of every request is described
+    by a partial MDL and the MDLs are chained, so the whole batch maps to
+    a single scatter-gather list and goes out on a single TCB. All the
+    requests are completed together when that TCB completes.
+
+    The caller must make sure the batch fits in NIC_MAX_PHYS_BUF_COUNT
+    fragments, otherwise the framework would split the transaction.
+
+Arguments:
+
+    FdoData         Pointer to our FdoData
+    Requests        Write requests in the order they are to be sent
+    RequestCount    Number of requests, at most NIC_MAX_COALESCE_REQUESTS
+
+Return Value:
+
+    NTSTATUS code. On failure the requests are still owned by the caller.
+
+--*/
+{
+    WDFDMATRANSACTION           dmaTransaction;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    NTSTATUS                    status;
+    PMDL                        mdl;
+    PMDL                        partialMdl;
+    PMDL                        *nextMdl;
+    PVOID                       va;
+    ULONG                       length;
+    ULONG                       totalLength = 0;
+    ULONG                       index;
+    BOOLEAN                     bCreated = FALSE;
+
+    ASSERT(RequestCount <= NIC_MAX_COALESCE_REQUESTS);
+
+    do {
+        status = NICAllocDmaTransaction(FdoData, &dmaTransaction);
+        if(!NT_SUCCESS(status)) {
+            break;
+        }
+
+        bCreated = TRUE;
+
+        dmaContext = GetDmaTransactionContext(dmaTransaction);
+        nextMdl = &dmaContext->MdlChain;
+
+        //
+        // We can't link the MDLs owned by the requests, so describe each
+        // buffer with a partial MDL of our own and chain those.
+        //
+        for (index = 0; index < RequestCount; index++)
+        {
+            status = WdfRequestRetrieveInputWdmMdl(Requests[index], &mdl);
+            if(!NT_SUCCESS(status)) {
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                            "WdfRequestRetrieveInputWdmMdl failed %X\n", status);
+                break;
+            }
+
+            length = NICGetWriteLength(Requests[index]);
+            va = MmGetMdlVirtualAddress(mdl);
+
+            partialMdl = IoAllocateMdl(va, length, FALSE, FALSE, NULL);
+            if (!partialMdl) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+
+            IoBuildPartialMdl(mdl, partialMdl, va, length);
+
+            *nextMdl = partialMdl;
+            nextMdl = &partialMdl->Next;
+
+            dmaContext->Requests[index] = Requests[index];
+            dmaContext->Lengths[index] = length;
+            totalLength += length;
+        }
+
+        if(!NT_SUCCESS(status)) {
+            break;
+        }
+
+        dmaContext->RequestCount = RequestCount;
+        dmaContext->Pended = TRUE;
+
+        status = WdfDmaTransactionInitialize(
+                                     dmaTransaction,
+                                     NICEvtProgramDmaFunction,
+                                     WdfDmaDirectionWriteToDevice,
+                                     dmaContext->MdlChain,
+                                     MmGetMdlVirtualAddress(dmaContext->MdlChain),
+                                     totalLength );
+
+        if(!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                       "WdfDmaTransactionInitialize failed %X\n", status);
+            break;
+        }
+
+        dmaContext->Initialized = TRUE;
+
+        InterlockedIncrement64(&FdoData->CoalescedTransactions);
+        InterlockedExchangeAdd64(&FdoData->CoalescedRequests, RequestCount);
+
+        InterlockedIncrement(&dmaContext->References);
+
+        status = WdfDmaTransactionExecute( dmaTransaction,
+                                           dmaTransaction );
+
+        NICFreeDmaTransaction( FdoData, dmaTransaction );
+
+        if(!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                            "WdfDmaTransactionExecute failed %X\n", status);
+            break;
+        }
+
+    } WHILE (FALSE);
+
+    if(!NT_SUCCESS(status)){
+
+        if(bCreated) {
+            NICFreeDmaTransaction( FdoData, dmaTransaction );
+        }
+    }
+
+    return status;
+}
+
 
 BOOLEAN
 NICEvtProgramDmaFunction(
@@ -234,9 +771,16 @@ Return Value:
 
 --*/
 {
-    PFDO_DATA           fdoData;
-    WDFREQUEST          request;
-    NTSTATUS            status;
+    PFDO_DATA                   fdoData;
+    PDMA_TRANSACTION_CONTEXT    dmaContext;
+    WDFREQUEST                  requests[NIC_MAX_COALESCE_REQUESTS];
+    ULONG                       requestCount;
+    ULONG                       index;
+    BOOLEAN                     bPended;
+    BOOLEAN                     bPriority;
+    BOOLEAN                     bAvailable;
+    BOOLEAN                     bResult = TRUE;
+    NTSTATUS                    status;
 
     UNREFERENCED_PARAMETER( Context );
     UNREFERENCED_PARAMETER( Direction );
@@ -245,39 +789,90 @@ Return Value:
                 "--> NICEvtProgramDmaFunction\n");
 
     fdoData = FdoGetData(Device);
-    request = WdfDmaTransactionGetRequest(Transaction);
+    dmaContext = GetDmaTransactionContext(Transaction);
 
+    requestCount = dmaContext->RequestCount;
+    bPended = dmaContext->Pended;
+    bPriority = dmaContext->Priority;
+    for (index = 0; index < requestCount; index++)
+    {
+        requests[index] = dmaContext->Requests[index];
+    }
 
     WdfSpinLockAcquire(fdoData->SendLock);
 
+    bAvailable = bPriority ? MP_PRIORITY_TCB_AVAILABLE(fdoData) :
+                             MP_TCB_RESOURCES_AVAIABLE(fdoData);
+
     //
     // If tcb or link is not available, queue the request
     //
-    if (!MP_TCB_RESOURCES_AVAIABLE(fdoData))
+    if (!bAvailable)
     {
         TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
-                "Resource is not available: queue Request %p\n", request);
+                "Resource is not available: queue %d Request(s) %p\n",
+                requestCount, requests[0]);
 
         //
-        // Must abort the transaction before deleting.
+        // Must abort the transaction before deleting. It goes back to the
+        // pool once the caller of Execute lets go of it.
         //
         (VOID) WdfDmaTransactionDmaCompletedFinal(Transaction, 0, &status);
         ASSERT(NT_SUCCESS(status));
-        WdfObjectDelete( Transaction );
+        NICFreeDmaTransaction( fdoData, Transaction );
 
         //
-        // Queue the request for later processing.
+        // Queue the request for later processing. Requests taken off the
+        // head of a pending queue go back there, in reverse order to keep
+        // the words in order. Only a request fresh from the write or IOCTL
+        // queue joins the tail. A priority send waits in its own queue.
         //
-        status = WdfRequestForwardToIoQueue(request,
-                                           fdoData->PendingWriteQueue);
+        for (index = requestCount; index-- > 0; )
+        {
+            if (bPended) {
+                status = WdfRequestRequeue(requests[index]);
+            } else {
+                status = WdfRequestForwardToIoQueue(requests[index],
+                                 bPriority ? fdoData->PendingPriorityQueue :
+                                             fdoData->PendingWriteQueue);
+            }
 
-        if(!NT_SUCCESS(status)) {
-            ASSERTMSG(" WdfRequestForwardToIoQueue failed ", FALSE);
+            if(!NT_SUCCESS(status)) {
+                ASSERTMSG(" Requeueing the write request failed ", FALSE);
+                bResult = FALSE;
+                continue;
+            }
+
+            requests[index] = NULL;
+            if (bPriority) {
+                fdoData->nWaitPrioritySend++;
+                fdoData->PriorityDeferred++;
+            } else {
+                fdoData->nWaitSend++;
+            }
+        }
+
+        if (bResult) {
+            WdfSpinLockRelease(fdoData->SendLock);
+
+            NICKickQueuedSends(fdoData);
+
+            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
+                        "<-- NICEvtProgramDmaFunction\n");
+            return TRUE;
+
+        } else {
             WdfSpinLockRelease(fdoData->SendLock);
-            WdfRequestCompleteWithInformation(request, STATUS_UNSUCCESSFUL, 0);
+
+            for (index = 0; index < requestCount; index++)
+            {
+                if (requests[index]) {
+                    WdfRequestCompleteWithInformation(requests[index],
+                                                      STATUS_UNSUCCESSFUL, 0);
+                }
+            }
             return FALSE;
         }
-        fdoData->nWaitSend++;
 
     } else {
 
@@ -292,15 +887,32 @@ Return Value:
             //
             (VOID )WdfDmaTransactionDmaCompletedFinal(Transaction, 0, &status);
             ASSERT(NT_SUCCESS(status));
-            WdfObjectDelete( Transaction );
+            NICFreeDmaTransaction( fdoData, Transaction );
 
             WdfSpinLockRelease(fdoData->SendLock);
-            WdfRequestCompleteWithInformation(request, STATUS_UNSUCCESSFUL, 0);
-            return FALSE;
+
+            for (index = 0; index < requestCount; index++)
+            {
+                WdfRequestCompleteWithInformation(requests[index],
+                                                  STATUS_UNSUCCESSFUL, 0);
+            }
+
+            //
+            // The requests are done with; nothing is left for the caller.
+            //
+            return TRUE;
         }
     }
 
 
+    //
+    // NICCheckForQueuedSends rings once for all the TCBs it posts, but a
+    // priority send doesn't wait for that.
+    //
+    if (bPriority || fdoData->SendDoorbellHold == 0) {
+        NICStartSend(fdoData);
+    }
+
     WdfSpinLockRelease(fdoData->SendLock);
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
@@ -319,7 +931,8 @@ NICWritePacket(
 /*++
 Routine Description:
 
-    Do the work to send a packet
+    Do the work to send a packet. This is the producer side of the TCB
+    ring: it fills the TCB at SendTail and then publishes it.
 
     Assumption: This function is called with the Send SPINLOCK held.
 
@@ -338,9 +951,12 @@ Return Value:
                 "--> NICWritePacket: SGList %p\n", SGList);
 
     //
-    // Initialize the Transfer Control Block.
+    // Initialize the Transfer Control Block. The caller has checked the
+    // TCB is available to this kind of send.
     //
-    pMpTcb = FdoData->CurrSendTail;
+    ASSERT(MP_PRIORITY_TCB_AVAILABLE(FdoData));
+
+    pMpTcb = MP_GET_TCB(FdoData, FdoData->SendTail);
     ASSERT(!MP_TEST_FLAG(pMpTcb, fMP_TCB_IN_USE));
 
     pMpTcb->DmaTransaction = DmaTransaction;
@@ -356,16 +972,87 @@ Return Value:
         return status;
     }
 
-    FdoData->nBusySend++;
-    ASSERT(FdoData->nBusySend <= FdoData->NumTcb);
-
-    FdoData->CurrSendTail = FdoData->CurrSendTail->Next;
+    //
+    // Hand the filled TCB over to the send consumer.
+    //
+    MP_STORE_RELEASE(&FdoData->SendTail, FdoData->SendTail + 1);
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE, "<-- NICWritePacket\n");
 
     return status;
 }
 
+NTSTATUS
+NICCopyWritePacket(
+    IN  PFDO_DATA               FdoData,
+    IN  WDFREQUEST              Request,
+    IN  ULONG                   Length
+    )
+/*++
+Routine Description:
+
+    Send a write of at most CopyThreshold bytes by copying it into the
+    local buffer of the TCB at SendTail. That buffer is in the send common
+    buffer, so no DMA transaction or map registers are needed and the
+    request can be completed as soon as this returns. The TCB is marked
+    fMP_TCB_USE_LOCAL_BUF and carries no transaction.
+
+    Assumption: This function is called with the Send SPINLOCK held and
+    a TCB available.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+    Request     The write request, still owned by the caller
+    Length      Length of the write
+
+Return Value:
+
+    NTSTATUS code
+
+--*/
+{
+    PMP_TCB     pMpTcb;
+    PHW_TCB     pHwTcb;
+    PVOID       buffer;
+    NTSTATUS    status;
+
+    ASSERT(Length <= NIC_BUFFER_SIZE);
+    ASSERT(MP_TCB_RESOURCES_AVAIABLE(FdoData));
+
+    status = WdfRequestRetrieveInputBuffer(Request, Length, &buffer, NULL);
+    if(!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "WdfRequestRetrieveInputBuffer failed %X\n", status);
+        return status;
+    }
+
+    pMpTcb = MP_GET_TCB(FdoData, FdoData->SendTail);
+    ASSERT(!MP_TEST_FLAG(pMpTcb, fMP_TCB_IN_USE));
+
+    RtlCopyMemory(pMpTcb->LocalBuffer, buffer, Length);
+
+    pMpTcb->DmaTransaction = NULL;
+    MP_SET_FLAG(pMpTcb, fMP_TCB_IN_USE | fMP_TCB_USE_LOCAL_BUF);
+
+    pMpTcb->HwTbd->TbdBufferAddress = pMpTcb->LocalBufferPhys;
+    pMpTcb->HwTbd->TbdCount = Length;
+
+    pHwTcb = pMpTcb->HwTcb;
+    pHwTcb->TxCbStatus = 0;
+    pHwTcb->TxCbByteCount = Length;
+    pHwTcb->TxCbTbdNumber = 1;
+    pHwTcb->TxCbThreshold = 0;
+
+    KeMemoryBarrier();
+
+    pHwTcb->TxCbCommand = HW_TCB_CMD_TRANSMIT | HW_TCB_CMD_FLEXIBLE;
+
+    MP_STORE_RELEASE(&FdoData->SendTail, FdoData->SendTail + 1);
+
+    return status;
+}
+
 NTSTATUS
 NICSendPacket(
     IN  PFDO_DATA              FdoData,
@@ -391,85 +1078,103 @@ Return Value:
 
 --*/
 {
-    NTSTATUS    status;
-    ULONG       index;
-    UCHAR       TbdCount = 0;
+    UCHAR       TbdCount;
+    ULONG       ByteCount;
+    ULONG       highFragments;
 
-    PULONG      pHwTcb = pMpTcb->HwTcb;
-    PULONG   pHwTbd = pMpTcb->HwTbd;
+    PHW_TCB     pHwTcb = pMpTcb->HwTcb;
+    PHW_TBD     pHwTbd = pMpTcb->HwTbd;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE, "--> NICSendPacket\n");
 
-    for (index = 0; index < ScatterGather->NumberOfElements; index++)
-    {
-        if (ScatterGather->Elements[index].Length)
-        {
-			//FIXME: restructure these
-            //pHwTbd->TbdBufferAddress =
-            //    ScatterGather->Elements[index].Address.LowPart;
-
-            //pHwTbd->TbdCount = ScatterGather->Elements[index].Length;
-
-            pHwTbd++;
-            TbdCount++;
-        }
+    //
+    // The enabler's maximum length keeps every transfer within the TBDs
+    // of one TCB.
+    //
+    if (ScatterGather->NumberOfElements > NIC_MAX_PHYS_BUF_COUNT) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "SGList has %d elements, TCB holds %d\n",
+                    ScatterGather->NumberOfElements, NIC_MAX_PHYS_BUF_COUNT);
+        return STATUS_INVALID_PARAMETER;
     }
 
-    //pHwTcb->TxCbTbdPointer = pMpTcb->HwTbdPhys;
-    //pHwTcb->TxCbTbdNumber = TbdCount;
-    //pHwTcb->TxCbCount = 0;
-    //pHwTcb->TxCbThreshold = (UCHAR) FdoData->AiThreshold;
+    TbdCount = NICEncodeTbds(pHwTbd, ScatterGather, &ByteCount, &highFragments);
 
+    //
+    // TxCbLink and TxCbTbdPointer were set up by NICInitSendBuffers.
+    // The command goes in last: it is what makes the TCB valid.
+    //
+    pHwTcb->TxCbStatus = 0;
+    pHwTcb->TxCbByteCount = ByteCount;
+    pHwTcb->TxCbTbdNumber = TbdCount;
+    pHwTcb->TxCbThreshold = 0;
 
-    status = NICStartSend(FdoData, pMpTcb);
+    KeMemoryBarrier();
 
-    if(!NT_SUCCESS(status)){
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                   "NICStartSend returned error %x\n", status);
+    pHwTcb->TxCbCommand = HW_TCB_CMD_TRANSMIT | HW_TCB_CMD_FLEXIBLE;
+
+    InterlockedExchangeAdd64(&FdoData->DmaFragments, TbdCount);
+    if (highFragments) {
+        InterlockedExchangeAdd64(&FdoData->DmaFragmentsAbove4GB, highFragments);
     }
 
+    //
+    // The device learns about the TCB when NICStartSend rings the
+    // doorbell for the whole batch.
+    //
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE, "<-- NICSendPacket\n");
 
-    return status;
+    return STATUS_SUCCESS;
 }
 
-NTSTATUS
+VOID
 NICStartSend(
-    IN  PFDO_DATA  FdoData,
-    IN  PMP_TCB    pMpTcb
+    IN  PFDO_DATA  FdoData
     )
 /*++
 Routine Description:
 
-    Issue a send command to the NIC
+    Ring the send doorbell: tell the device about every TCB posted since
+    the last call by writing the producer index once. The uncached CSR
+    write is the most expensive step of a send, so callers that post a
+    run of TCBs ring once at the end of it.
 
     Assumption: This function is called with the Send SPINLOCK held.
 
 Arguments:
 
     FdoData     Pointer to our FdoData
-    pMpTcb      Pointer to MP_TCB
 
 Return Value:
 
-    NTSTATUS code
+    None
 
 --*/
 {
-	NTSTATUS     status = STATUS_SUCCESS;
+    ULONG       sendTail = FdoData->SendTail;
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE, "--> NICStartSend\n");
+    if (sendTail == FdoData->SendDoorbellTail) {
+        return;
+    }
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
-                "CU is idle -- TCB added to Active List\n");
-
-    //FdoData->CSRAddress->ScbGeneralPointer = pMpTcb->HwTcbPhys;
+                "Doorbell for %d TCB(s)\n", sendTail - FdoData->SendDoorbellTail);
 
-    exit:
+    FdoData->DoorbellTcbs += sendTail - FdoData->SendDoorbellTail;
+    FdoData->Doorbells++;
+    FdoData->SendDoorbellTail = sendTail;
 
-    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE, "<-- NICStartSend\n");
+    //
+    // MP_MAX_BUSY_SEND leaves a TCB unused, so the masked index can only
+    // equal the device's own when everything posted has been sent.
+    //
+    ASSERT(sendTail - FdoData->SendHead <= MP_MAX_BUSY_SEND(FdoData));
 
-    return status;
+    if (FdoData->CSRAddress) {
+        WRITE_REGISTER_ULONG(FdoData->CSRAddress + NIC_CSR_TX_PRODUCER,
+                             MP_RING_DEVICE_INDEX(sendTail, FdoData->NumTcb));
+    }
 }
 
 NTSTATUS
@@ -482,7 +1187,12 @@ Routine Description:
     Interrupt handler for sending processing. Re-claim the send resources,
     complete sends and get more to send from the send wait queue.
 
-    Assumption: This function is called with the Send SPINLOCK held.
+    This is the consumer side of the TCB ring. It takes the TCBs published
+    by the producer up to SendTail and hands them back by advancing
+    SendHead; it doesn't take SendLock.
+
+    Assumption: This function is not called concurrently with itself, with
+    NICReset or with NICFreeBusySendPackets.
 
 Arguments:
 
@@ -494,137 +1204,323 @@ Return Value:
 
 --*/
 {
-    NTSTATUS   status = STATUS_SUCCESS;
-    PMP_TCB    pMpTcb;
-    BOOLEAN transactionComplete;
-
-
-#if DBG
-    ULONG      i;
-#endif
+    NTSTATUS            status = STATUS_SUCCESS;
+    PMP_TCB             pMpTcb;
+    WDFDMATRANSACTION   dmaTransaction;
+    ULONG               sendTail;
+    BOOLEAN             transactionComplete;
+    MP_SEND_BATCH       batch;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "--> NICHandleSendInterrupt\n");
 
+    MP_INIT_SEND_BATCH(&batch);
+
     //
     // Any packets being sent? Any packet waiting in the send queue?
     //
-    if (FdoData->nBusySend == 0)
-    {
-        ASSERT(FdoData->CurrSendHead == FdoData->CurrSendTail);
-        return status;
-    }
+    sendTail = MP_LOAD_ACQUIRE(&FdoData->SendTail);
+
+    ASSERT(sendTail - FdoData->SendHead <= MP_MAX_BUSY_SEND(FdoData));
 
     //
     // Check the first TCB on the send list
     //
-    while (FdoData->nBusySend > 0)
+    while (FdoData->SendHead != sendTail)
     {
+        pMpTcb = MP_GET_TCB(FdoData, FdoData->SendHead);
 
-#if DBG
-        pMpTcb = FdoData->CurrSendHead;
-        for (i = 0; i < FdoData->nBusySend; i++)
-        {
-            pMpTcb = pMpTcb->Next;
+        //
+        // Stop at the first TCB the device hasn't finished; NICReset
+        // restarts the device there if it never does.
+        //
+        if (!(pMpTcb->HwTcb->TxCbStatus & HW_TCB_STATUS_COMPLETE)) {
+            break;
         }
 
-        if (pMpTcb != FdoData->CurrSendTail)
-        {
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                        "nBusySend= %d\n", FdoData->nBusySend);
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                        "CurrSendhead= %p\n", FdoData->CurrSendHead);
-            TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                        "CurrSendTail= %p\n", FdoData->CurrSendTail);
-            ASSERT(FALSE);
-        }
-#endif
+        KeMemoryBarrier();
+
+        FdoData->SendCompletions++;
 
-        pMpTcb = FdoData->CurrSendHead;
+        //
+        // A copied write has no transaction and was completed already.
+        //
+        if (MP_TEST_FLAG(pMpTcb, fMP_TCB_USE_LOCAL_BUF)) {
+            (VOID) MP_RECYCLE_TCB(FdoData, pMpTcb);
+            continue;
+        }
 
         ASSERT(pMpTcb->DmaTransaction);
 
+        //
+        // Give the TCB back before telling the framework the DMA is done:
+        // if the transaction has more to transfer, the framework programs
+        // the next part right away and needs a free TCB for it.
+        //
+        dmaTransaction = MP_RECYCLE_TCB(FdoData, pMpTcb);
+
         //
         // Indicate this DMA operation has completed:
         // This may drive the transfer on the next packet if
         // there is still data to be transfered in the DmaTransaction.
         //
+        InterlockedIncrement(&GetDmaTransactionContext(dmaTransaction)->References);
+
         transactionComplete =
-            WdfDmaTransactionDmaCompleted( pMpTcb->DmaTransaction,
+            WdfDmaTransactionDmaCompleted( dmaTransaction,
                                            &status );
         if(transactionComplete == TRUE) {
             ASSERT(status == STATUS_SUCCESS);
-            MP_FREE_SEND_PACKET(FdoData, pMpTcb, status);
+            NICBatchWriteTransaction(FdoData, &batch, dmaTransaction, status);
         } else {
             //
-            // NOTE: For this ethernet driver this should never
-            //       be returned as the packets are <= 1514 bytes.
-            //       It is included to show the complete DmaTransaction
-            //       coding pattern.
+            // The rest of the transaction went out on another TCB.
             //
-            ASSERT(!"STATUS_MORE_PROCESSING_REQUIRED");
+            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
+                        "Transaction %p continues on the next TCB\n",
+                        dmaTransaction);
         }
+
+        NICFreeDmaTransaction(FdoData, dmaTransaction);
     }
 
+    //
+    // Now that the ring is drained, complete everything we collected.
+    //
+    NICCompleteSendBatch(FdoData, &batch);
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "<-- NICHandleSendInterrupt\n");
     return status;
 }
 
+__inline
 VOID
-NICCheckForQueuedSends(
+NICPostQueuedSends(
     IN  PFDO_DATA  FdoData
     )
 /*++
 Routine Description:
 
-Arguments:
-
-    FdoData     Pointer to our FdoData
+    Send the write requests that were queued because we ran out of TCBs.
+    Consecutive small requests are coalesced so that one TCB carries as
+    many of them as its TBDs can describe. A request that is too big to
+    be coalesced goes out in a transaction of its own, in order.
 
-Return Value:
+    Assumption: Only the drain owner calls this, see NICCheckForQueuedSends.
 
 --*/
 {
-    WDFREQUEST         request;
-    WDFDMATRANSACTION  dmaTransaction;
+    WDFREQUEST         requests[NIC_MAX_COALESCE_REQUESTS];
+    WDFREQUEST         request = NULL;
+    ULONG              requestCount;
+    ULONG              fragmentCount;
+    ULONG              fragments;
+    ULONG              length;
+    ULONG              index;
+    PMDL               mdl;
     NTSTATUS           status;
 
-    UNREFERENCED_PARAMETER( dmaTransaction );
-
-    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
-                "--> NICCheckForQueuedSends\n");
+    //
+    // Hold the doorbell while we post; it is rung once on the way out.
+    //
+    InterlockedIncrement(&FdoData->SendDoorbellHold);
 
     //
-    // If we queued any transmits because we didn't have any TCBs earlier,
-    // dequeue and send those packets now, as long as we have free TCBs.
+    // Priority sends go first and may use the reserved TCBs.
     //
-    while (MP_TCB_RESOURCES_AVAIABLE(FdoData))
+    while (MP_PRIORITY_TCB_AVAILABLE(FdoData))
     {
         status = WdfIoQueueRetrieveNextRequest(
-                     FdoData->PendingWriteQueue,
+                     FdoData->PendingPriorityQueue,
                      &request
                      );
 
         if(!NT_SUCCESS(status) ) {
-            if(STATUS_NO_MORE_ENTRIES != status) {
-                TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
-                    "WdfIoQueueRetrieveNextRequest failed %X\n", status);
+            request = NULL;
+            break;
+        }
+
+        WdfSpinLockAcquire(FdoData->SendLock);
+        FdoData->nWaitPrioritySend--;
+        WdfSpinLockRelease(FdoData->SendLock);
+
+        status = NICInitiateDmaTransfer(FdoData, request, TRUE, TRUE);
+        if(!NT_SUCCESS(status)) {
+            WdfRequestCompleteWithInformation(request, status, 0);
+        }
+        request = NULL;
+    }
+
+    //
+    // If we queued any transmits because we didn't have any TCBs earlier,
+    // dequeue and send those packets now, as long as we have free TCBs.
+    //
+    while (MP_TCB_RESOURCES_AVAIABLE(FdoData))
+    {
+        requestCount = 0;
+        fragmentCount = 0;
+
+        do {
+            //
+            // A request that didn't fit in the previous batch starts this one.
+            //
+            if (request == NULL) {
+
+                status = WdfIoQueueRetrieveNextRequest(
+                             FdoData->PendingWriteQueue,
+                             &request
+                             );
+
+                if(!NT_SUCCESS(status) ) {
+                    if(STATUS_NO_MORE_ENTRIES != status) {
+                        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
+                            "WdfIoQueueRetrieveNextRequest failed %X\n", status);
+                    }
+                    request = NULL;
+                    break;
+                }
+
+                WdfSpinLockAcquire(FdoData->SendLock);
+                FdoData->nWaitSend--;
+                WdfSpinLockRelease(FdoData->SendLock);
+            }
+
+            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
+                        "\t processing Request %p \n", request);
+
+            length = NICGetWriteLength(request);
+            fragments = NIC_MAX_PHYS_BUF_COUNT + 1;
+
+            status = WdfRequestRetrieveInputWdmMdl(request, &mdl);
+            if(NT_SUCCESS(status) && length <= NIC_MAX_PACKET_SIZE) {
+                fragments = ADDRESS_AND_SIZE_TO_SPAN_PAGES(
+                                MmGetMdlVirtualAddress(mdl), length);
+            }
+
+            if (fragmentCount + fragments > NIC_MAX_PHYS_BUF_COUNT) {
+                //
+                // Doesn't fit. Send it by itself if it's the first one,
+                // otherwise carry it over to the next batch.
+                //
+                if (requestCount == 0) {
+                    requests[requestCount++] = request;
+                    request = NULL;
+                }
+                break;
             }
+
+            fragmentCount += fragments;
+            requests[requestCount++] = request;
+            request = NULL;
+
+        } WHILE (requestCount < NIC_MAX_COALESCE_REQUESTS);
+
+        if (requestCount == 0) {
             break;
         }
 
-        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
-                    "\t processing Request %p \n", request);
+        if (requestCount == 1) {
+
+            status = NICInitiateDmaTransfer(FdoData, requests[0], FALSE, TRUE);
+
+        } else {
+
+            status = NICInitiateCoalescedDmaTransfer(FdoData,
+                                                     requests,
+                                                     requestCount);
+        }
+
+        if(!NT_SUCCESS(status)) {
+            for (index = 0; index < requestCount; index++)
+            {
+                WdfRequestCompleteWithInformation(requests[index], status, 0);
+            }
+        }
+    }
+
+    //
+    // Out of TCBs with a request still in hand: put it back at the head.
+    //
+    if (request != NULL) {
+
+        WdfSpinLockAcquire(FdoData->SendLock);
+
+        status = WdfRequestRequeue(request);
+        if(NT_SUCCESS(status)) {
+            FdoData->nWaitSend++;
+        }
+
+        WdfSpinLockRelease(FdoData->SendLock);
 
-        status = NICInitiateDmaTransfer(FdoData, request);
         if(!NT_SUCCESS(status)) {
             WdfRequestCompleteWithInformation(request, status, 0);
         }
+    }
 
-        FdoData->nWaitSend--;
+    WdfSpinLockAcquire(FdoData->SendLock);
+
+    if (InterlockedDecrement(&FdoData->SendDoorbellHold) == 0) {
+        NICStartSend(FdoData);
     }
 
+    WdfSpinLockRelease(FdoData->SendLock);
+}
+
+VOID
+NICCheckForQueuedSends(
+    IN  PFDO_DATA  FdoData
+    )
+/*++
+Routine Description:
+
+    Send the write requests that were queued because we ran out of TCBs,
+    priority sends first.
+
+    Called by the send interrupt DPC, by writes that queued themselves and
+    by the program DMA callback when it runs out of TCBs. Only one of them
+    drains at a time, so the requests reach the TCB ring in the order they
+    left the queues. The others leave it to the drain owner, who checks
+    for more work after letting go.
+
+Arguments:
+
+    FdoData     Pointer to our FdoData
+
+Return Value:
+
+    None
+
+--*/
+{
+    ULONG   queuedWrites;
+    ULONG   queuedPrioritySends;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
+                "--> NICCheckForQueuedSends\n");
+
+    do {
+        if (InterlockedCompareExchange(&FdoData->SendDrainOwner, 1, 0) != 0) {
+            break;
+        }
+
+        NICPostQueuedSends(FdoData);
+
+        InterlockedExchange(&FdoData->SendDrainOwner, 0);
+
+        //
+        // A request may have been queued while we were draining and been
+        // left to us.
+        //
+        queuedWrites = 0;
+        queuedPrioritySends = 0;
+
+        WdfIoQueueGetState(FdoData->PendingWriteQueue, &queuedWrites, NULL);
+        WdfIoQueueGetState(FdoData->PendingPriorityQueue, &queuedPrioritySends, NULL);
+
+    } while ((queuedPrioritySends > 0 && MP_PRIORITY_TCB_AVAILABLE(FdoData)) ||
+             (queuedWrites > 0 && MP_TCB_RESOURCES_AVAIABLE(FdoData)));
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "<-- NICCheckForQueuedSends\n");
 }
@@ -638,7 +1534,8 @@ Routine Description:
 
     Free and complete the stopped active sends
 
-    Assumption: This function is called with the Send SPINLOCK held.
+    Assumption: The send interrupt is disabled, so this is the only
+    consumer of the TCB ring. SendLock is not held.
 
 Arguments:
 
@@ -650,20 +1547,25 @@ Return Value:
 
 --*/
 {
-    PMP_TCB  pMpTcb;
+    PMP_TCB         pMpTcb;
+    MP_SEND_BATCH   batch;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "--> NICFreeBusySendPackets\n");
 
+    MP_INIT_SEND_BATCH(&batch);
+
     //
     // Any packets being sent? Check the first TCB on the send list
     //
-    while (FdoData->nBusySend > 0)
+    while (MP_BUSY_SEND_COUNT(FdoData) > 0)
     {
-        pMpTcb = FdoData->CurrSendHead;
-        MP_FREE_SEND_PACKET(FdoData, pMpTcb, STATUS_SUCCESS);
+        pMpTcb = MP_GET_TCB(FdoData, FdoData->SendHead);
+        MP_FREE_SEND_PACKET(FdoData, pMpTcb, STATUS_SUCCESS, &batch);
     }
 
+    NICCompleteSendBatch(FdoData, &batch);
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "<-- NICFreeBusySendPackets\n");
 }
@@ -678,7 +1580,8 @@ NICFreeQueuedSendPackets(
 /*++
 Routine Description:
 
-    Free and complete the pended sends on SendQueueHead
+    Free and complete the pended sends on the PendingPriorityQueue and
+    the PendingWriteQueue
 
     Assumption: This function is called with the Send SPINLOCK held.
 
@@ -698,6 +1601,26 @@ Return Value:
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_WRITE,
                 "--> NICFreeQueuedSendPackets\n");
 
+    do {
+        status = WdfIoQueueRetrieveNextRequest(
+                     FdoData->PendingPriorityQueue,
+                     &request
+                     );
+
+        if(!NT_SUCCESS(status) ) {
+            break;
+        }
+
+        FdoData->nWaitPrioritySend--;
+
+        WdfSpinLockRelease(FdoData->SendLock);
+
+        WdfRequestCompleteWithInformation(request, status, 0);
+
+        WdfSpinLockAcquire(FdoData->SendLock);
+
+    } WHILE (TRUE);
+
     do {
         status = WdfIoQueueRetrieveNextRequest(
                      FdoData->PendingWriteQueue,
@@ -30,3 +30,201 @@ DEFINE_GUID (GUID_DEVINTERFACE_PCIDRV,
 // error during precompiled headers.
 //
 
+#ifndef _PCIDRV_PUBLIC_H_
+#define _PCIDRV_PUBLIC_H_
+
+//
+// IOCTL_PCIDRV_GET_STATISTICS returns a snapshot of the driver counters
+// in a PCIDRV_STATISTICS structure. The output buffer must be at least
+// sizeof(PCIDRV_STATISTICS).
+//
+#define IOCTL_PCIDRV_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// IOCTL_PCIDRV_SEND_PRIORITY sends an urgent command, such as an e-stop or
+// a feed-hold, ahead of every queued write. The command goes in the output
+// buffer of DeviceIoControl (METHOD_IN_DIRECT) and must not be longer than
+// a single packet. It is sent on TCBs that ordinary writes can't use.
+//
+#define IOCTL_PCIDRV_SEND_PRIORITY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+
+//
+// IOCTL_PCIDRV_SET_COPY_THRESHOLD sets the largest write, in bytes, that is
+// copied into a TCB instead of being sent by DMA, until the device is
+// restarted and the CopyThreshold registry value applies again. The input
+// buffer is a ULONG; 0 sends every write by DMA. Values above the TCB
+// buffer size are cut down to it, and PCIDRV_STATISTICS reports the
+// threshold in effect.
+//
+#define IOCTL_PCIDRV_SET_COPY_THRESHOLD \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+// A read served from the receive buffers returns framed records when the
+// read buffer has room for at least one: each record is a
+// PCIDRV_RECORD_HEADER followed by Length bytes of payload, padded to a
+// ULONG64 boundary, and the read returns as many records as fit. Sequence
+// counts every word the device received on the channel, so a gap means
+// words were dropped. TimeStamp is the performance counter (QueryPerformanceCounter
+// in user mode) when the receive handler picked the word up. A smaller
+// buffer gets the bare payload of a single word.
+//
+typedef struct _PCIDRV_RECORD_HEADER
+{
+    USHORT      Length;
+    USHORT      Reserved;
+    ULONG       Sequence;
+    ULONG64     TimeStamp;
+} PCIDRV_RECORD_HEADER, *PPCIDRV_RECORD_HEADER;
+
+#define PCIDRV_RECORD_SIZE(_Length) \
+    (sizeof(PCIDRV_RECORD_HEADER) + (((_Length) + sizeof(ULONG64) - 1) & ~(sizeof(ULONG64) - 1)))
+
+//
+// The device tags every received word with a channel, so that status
+// words, encoder positions and probe events can go to different readers.
+// Open the device interface path with a trailing "\<n>" to read only
+// the words of channel n; a plain open reads channel 0. Each channel has
+// its own backlog and its own record sequence numbers.
+//
+#define PCIDRV_MAX_CHANNELS         4
+
+//
+// Histograms in PCIDRV_STATISTICS are log2 scaled: bucket 0 counts values
+// below 1, bucket i values in [2^(i-1), 2^i), and the last bucket
+// everything from 2^(PCIDRV_HISTOGRAM_BUCKETS-2) up.
+//
+#define PCIDRV_HISTOGRAM_BUCKETS    20
+
+//
+// Per-CPU histograms have a row for each of the first PCIDRV_HISTOGRAM_CPUS
+// processors, as many as the interrupt affinity masks can name; the last
+// row also counts every processor above it.
+//
+#define PCIDRV_HISTOGRAM_CPUS       32
+
+typedef struct _PCIDRV_STATISTICS
+{
+    // Frequency of the performance counter the *Ticks fields are in
+    ULONG64     PerformanceFrequency;
+
+    ULONG64     BytesReceived;
+    ULONG64     BytesTransmitted;
+
+    // Write coalescing
+    ULONG64     CoalescedTransactions;
+    ULONG64     CoalescedRequests;
+
+    // Write DMA transaction pool
+    ULONG64     TransactionPoolHits;
+    ULONG64     TransactionPoolMisses;
+    ULONG       TransactionPoolSize;
+    ULONG       TransactionPoolHighWater;
+
+    // Zero-copy receive
+    ULONG64     ZeroCopyReads;
+    ULONG64     ZeroCopyFallbacks;
+
+    // Framed reads; FramedRecords / FramedReads is the words per read
+    ULONG64     FramedReads;
+    ULONG64     FramedRecords;
+
+    // Adaptive RFD pool
+    ULONG64     RfdGrowEvents;
+    ULONG64     RfdShrinkEvents;
+    ULONG       RfdPoolSize;
+    ULONG       RfdPoolMax;
+    ULONG       RfdSlabSize;        // bytes of shared memory for all RFDs
+
+    // Receive backlog of words waiting for a read, per channel
+    ULONG       RecvBacklogSize;
+    ULONG       RecvBacklogPolicy;  // 0 drops the oldest word, 1 the newest
+    ULONG       RecvBacklogDepth[PCIDRV_MAX_CHANNELS];
+    ULONG       RecvBacklogHighWater[PCIDRV_MAX_CHANNELS];
+    ULONG       RecvChannelWords[PCIDRV_MAX_CHANNELS];  // wraps with Sequence
+    ULONG64     RecvBacklogOverflows[PCIDRV_MAX_CHANNELS];
+
+    // RFDs returned to the receive ring; RfdsReturned / RfdReturnBatches
+    // is the RFDs per RcvLock acquisition
+    ULONG64     RfdReturnBatches;
+    ULONG64     RfdsReturned;
+    ULONG64     RfdReturnLockTicks;
+    ULONG64     RfdReturnLockTicksMax;
+
+    // Receive polling; RecvPollTicks / RecvPolls is the CPU cost of a
+    // pass and RecvPollRearms bounds the receive interrupts taken
+    ULONG64     RecvPolls;
+    ULONG64     RecvPollRearms;
+    ULONG64     RecvPollTicks;
+    ULONG       RecvPollBudget;
+
+    // Interrupts taken per cause. InterruptMessages is 2 when send and
+    // receive have MSI-X vectors of their own, 0 for a line interrupt.
+    ULONG64     RecvInterrupts;
+    ULONG64     SendInterrupts;
+    ULONG       InterruptMessages;
+
+    // Send interrupt moderation; SendInterrupts / SendCompletions is the
+    // interrupts per completed TCB, and a TCB carries one word unless
+    // CoalescedTransactions says otherwise
+    ULONG64     SendCompletions;
+    ULONG64     SendIntrAdjustments;
+    ULONG       SendIntrCount;      // current TCBs per interrupt
+    ULONG       SendIntrDelay;      // current hold-off in us
+
+    // Send hangs detected by the watchdog and recovered by restarting the
+    // device at the oldest unfinished TCB
+    ULONG64     SendResets;
+
+    // Interrupt placement, 0 for the system default, and microseconds
+    // from an ISR to the DPC that picked up its work, per CPU of the DPC
+    ULONG       RecvInterruptAffinity;
+    ULONG       SendInterruptAffinity;
+    ULONG       RecvPollProcessor;  // if RecvInterruptAffinity isn't 0
+    ULONG64     DpcLatencyHistogram[PCIDRV_HISTOGRAM_CPUS][PCIDRV_HISTOGRAM_BUCKETS];
+
+    // Microseconds from the receive handler to the completion of the read
+    // that carried the word, per word
+    ULONG64     RecvLatencyHistogram[PCIDRV_HISTOGRAM_BUCKETS];
+
+    // DMA: the map registers the enabler holds per transfer, and the
+    // fragments handed to the device. The descriptors carry 64-bit
+    // addresses, so a fragment above 4GB goes to the device directly
+    // where 32-bit descriptors needed a map register bounce buffer.
+    ULONG       MapRegisters;
+    ULONG64     DmaFragments;
+    ULONG64     DmaFragmentsAbove4GB;
+
+    // Request completion: PassiveCompletion is 0 if the DPCs complete the
+    // requests they finish themselves, 1 if they leave them to the
+    // completion thread. The DPC durations in microseconds, per run, are
+    // for that mode.
+    ULONG       PassiveCompletion;
+    ULONG64     PassiveCompletions;
+    ULONG64     CompletionBatches;
+    ULONG64     CompletionBatchMax;
+    ULONG64     SendDpcHistogram[PCIDRV_HISTOGRAM_BUCKETS];
+    ULONG64     RecvDpcHistogram[PCIDRV_HISTOGRAM_BUCKETS];
+
+    // Send doorbells; DoorbellTcbs / Doorbells is the batching factor
+    ULONG64     Doorbells;
+    ULONG64     DoorbellTcbs;
+
+    // Writes copied into a TCB's local buffer
+    ULONG64     CopiedWrites;
+
+    // Priority send channel
+    ULONG64     PrioritySends;
+    ULONG64     PriorityDeferred;
+
+    // TCBs in the send ring (NumTcb); at most NumTcb - 1 are busy at once
+    ULONG       NumTcb;
+
+    // Writes of at most CopyThreshold bytes are copied into a TCB
+    ULONG       CopyThreshold;
+
+} PCIDRV_STATISTICS, *PPCIDRV_STATISTICS;
+
+#endif  // _PCIDRV_PUBLIC_H_
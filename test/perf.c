@@ -0,0 +1,1007 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    PERF.C
+
+Abstract:
+
+    Benchmarks of the send and receive paths. Each one runs on a thread
+    of its own against the first device that isn't in use, keeps a number
+    of overlapped requests in flight for PERF_SECONDS, and reports what
+    it measured together with the change in the driver statistics
+    (IOCTL_PCIDRV_GET_STATISTICS) over the run.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "testapp.h"
+
+#define PERF_SECONDS            5
+#define PERF_SWEEP_SECONDS      2       // per depth of a sweep
+#define PERF_WORD_SIZE          4
+#define PERF_WRITES_IN_FLIGHT   256
+#define PERF_READS_IN_FLIGHT    64
+#define PERF_MAX_IN_FLIGHT      PERF_WRITES_IN_FLIGHT
+#define PERF_PRIORITY_SENDS     1000
+#define PERF_PRIORITY_INTERVAL  2       // ms between priority commands
+
+struct _PERF_RUN;
+
+//
+// One overlapped request. The completion routine gets the OVERLAPPED
+// back, so it comes first.
+//
+typedef struct _PERF_IO {
+    OVERLAPPED          Overlapped;
+    struct _PERF_RUN    *Run;
+    LARGE_INTEGER       Issued;
+    UCHAR               Buffer[PERF_WORD_SIZE];
+} PERF_IO, *PPERF_IO;
+
+//
+// Latency is from issuing a request to its completion routine, in
+// performance counter ticks, with a log2 histogram in microseconds.
+//
+typedef struct _PERF_RUN {
+    HANDLE              hDevice;
+    ULONG64             Completed;
+    ULONG64             Failed;
+    ULONG64             LatencyTicks;
+    ULONG64             LatencyMax;
+    ULONG64             LatencyHistogram[PCIDRV_HISTOGRAM_BUCKETS];
+    LARGE_INTEGER       Frequency;
+    ULONG               InFlight;
+    BOOLEAN             Stop;
+    BOOLEAN             Read;
+    PERF_IO             Io[PERF_MAX_IN_FLIGHT];
+} PERF_RUN, *PPERF_RUN;
+
+typedef VOID (*PPERF_ROUTINE)(HANDLE hDevice);
+
+typedef struct _PERF_CONTEXT {
+    PPERF_ROUTINE       Routine;
+    TCHAR               DevicePath[MAX_PATH];
+    TCHAR               DeviceName[MAX_PATH];
+} PERF_CONTEXT, *PPERF_CONTEXT;
+
+HANDLE  PerfThreadHandle;
+
+BOOL
+PerfGetStatistics(
+    __in HANDLE hDevice,
+    __out PPCIDRV_STATISTICS Stats
+    )
+{
+    OVERLAPPED  overlapped;
+    DWORD       bytes = 0;
+    BOOL        ok;
+
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return FALSE;
+    }
+
+    ok = DeviceIoControl(hDevice, IOCTL_PCIDRV_GET_STATISTICS, NULL, 0,
+                         Stats, sizeof(PCIDRV_STATISTICS), &bytes, &overlapped);
+    if (!ok && GetLastError() == ERROR_IO_PENDING) {
+        ok = GetOverlappedResult(hDevice, &overlapped, &bytes, TRUE);
+    }
+
+    CloseHandle(overlapped.hEvent);
+
+    if (!ok || bytes < sizeof(PCIDRV_STATISTICS)) {
+        Display(TEXT("IOCTL_PCIDRV_GET_STATISTICS failed %x"), GetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL
+PerfSetCopyThreshold(
+    __in HANDLE hDevice,
+    __in ULONG Threshold
+    )
+{
+    OVERLAPPED  overlapped;
+    DWORD       bytes = 0;
+    BOOL        ok;
+
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return FALSE;
+    }
+
+    ok = DeviceIoControl(hDevice, IOCTL_PCIDRV_SET_COPY_THRESHOLD,
+                         &Threshold, sizeof(ULONG), NULL, 0, &bytes, &overlapped);
+    if (!ok && GetLastError() == ERROR_IO_PENDING) {
+        ok = GetOverlappedResult(hDevice, &overlapped, &bytes, TRUE);
+    }
+
+    CloseHandle(overlapped.hEvent);
+
+    if (!ok) {
+        Display(TEXT("IOCTL_PCIDRV_SET_COPY_THRESHOLD failed %x"), GetLastError());
+    }
+    return ok;
+}
+
+ULONG64
+PerfElapsedMicroseconds(
+    __in PLARGE_INTEGER Start
+    )
+{
+    LARGE_INTEGER   now, frequency;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+
+    return (ULONG64)(now.QuadPart - Start->QuadPart) * 1000000 /
+           (ULONG64)frequency.QuadPart;
+}
+
+//
+// Rates, 0 if there is nothing to divide by
+//
+#define PERF_PER_SECOND(_Count, _Microseconds) \
+    ((_Microseconds) ? (_Count) * 1000000 / (_Microseconds) : 0)
+
+double
+PerfRatio(
+    __in ULONG64 Count,
+    __in ULONG64 Per
+    )
+{
+    return Per ? (double)Count / (double)Per : 0.0;
+}
+
+ULONG64
+PerfFileTime(
+    __in FILETIME *Time
+    )
+{
+    return ((ULONG64)Time->dwHighDateTime << 32) | Time->dwLowDateTime;
+}
+
+ULONG64
+PerfBusyTime(
+    VOID
+    )
+/*++
+
+    Time all processors spent not idle since boot, in 100ns units. The
+    kernel time GetSystemTimes returns includes the idle time.
+ --*/
+{
+    FILETIME    idle, kernel, user;
+
+    if (!GetSystemTimes(&idle, &kernel, &user)) {
+        return 0;
+    }
+
+    return PerfFileTime(&kernel) - PerfFileTime(&idle) + PerfFileTime(&user);
+}
+
+ULONG
+PerfBucket(
+    __in ULONG64 Value
+    )
+/*++
+
+    log2 bucket of a value, as the driver histograms count them.
+ --*/
+{
+    ULONG   bucket = 0;
+
+    while (Value && bucket < PCIDRV_HISTOGRAM_BUCKETS - 1) {
+        Value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+VOID
+PerfDrain(
+    __in PPERF_RUN Run
+    )
+/*++
+
+    Stop reissuing, cancel what is still in flight and wait for the
+    completion routines of all of it.
+ --*/
+{
+    Run->Stop = TRUE;
+
+    CancelIo(Run->hDevice);
+
+    while (Run->InFlight) {
+        SleepEx(1000, TRUE);
+    }
+}
+
+VOID CALLBACK
+PerfIoComplete(
+    DWORD dwError,
+    DWORD dwBytesTransferred,
+    LPOVERLAPPED pOvl
+    );
+
+BOOL
+PerfIssue(
+    __in PPERF_RUN Run,
+    __in PPERF_IO Io
+    )
+/*++
+
+    Send one word down, or ask for one, with PerfIoComplete to reissue it.
+ --*/
+{
+    BOOL    ok;
+
+    memset(&Io->Overlapped, 0, sizeof(OVERLAPPED));
+    Io->Run = Run;
+    QueryPerformanceCounter(&Io->Issued);
+
+    if (Run->Read) {
+        ok = ReadFileEx(Run->hDevice, Io->Buffer, PERF_WORD_SIZE,
+                        &Io->Overlapped, PerfIoComplete);
+    } else {
+        ok = WriteFileEx(Run->hDevice, Io->Buffer, PERF_WORD_SIZE,
+                         &Io->Overlapped, PerfIoComplete);
+    }
+
+    if (ok) {
+        Run->InFlight++;
+    }
+    return ok;
+}
+
+VOID CALLBACK
+PerfIoComplete(
+    DWORD dwError,
+    DWORD dwBytesTransferred,
+    LPOVERLAPPED pOvl
+    )
+{
+    PPERF_IO        io = (PPERF_IO)pOvl;
+    PPERF_RUN       run = io->Run;
+    LARGE_INTEGER   now;
+    ULONG64         ticks;
+
+    UNREFERENCED_PARAMETER(dwBytesTransferred);
+
+    QueryPerformanceCounter(&now);
+
+    run->InFlight--;
+
+    if (dwError == 0) {
+        run->Completed++;
+
+        ticks = (ULONG64)(now.QuadPart - io->Issued.QuadPart);
+        run->LatencyTicks += ticks;
+        if (ticks > run->LatencyMax) {
+            run->LatencyMax = ticks;
+        }
+        run->LatencyHistogram[PerfBucket(ticks * 1000000 /
+                                         (ULONG64)run->Frequency.QuadPart)]++;
+    } else if (dwError != ERROR_OPERATION_ABORTED) {
+        run->Failed++;
+    }
+
+    if (!run->Stop && !PerfIssue(run, io)) {
+        run->Failed++;
+    }
+}
+
+BOOL
+PerfStart(
+    __in PPERF_RUN Run,
+    __in ULONG InFlight
+    )
+/*++
+
+    Put InFlight requests in flight; their completion routines keep them
+    going until PerfDrain. The counts start over.
+ --*/
+{
+    ULONG           index;
+
+    Run->Completed = 0;
+    Run->Failed = 0;
+    Run->LatencyTicks = 0;
+    Run->LatencyMax = 0;
+    memset(Run->LatencyHistogram, 0, sizeof(Run->LatencyHistogram));
+    QueryPerformanceFrequency(&Run->Frequency);
+    Run->Stop = FALSE;
+
+    for (index = 0; index < InFlight; index++) {
+        Run->Io[index].Buffer[0] = (UCHAR)index;
+        if (!PerfIssue(Run, &Run->Io[index])) {
+            Display(TEXT("%ws failed %x"),
+                    Run->Read ? TEXT("ReadFileEx") : TEXT("WriteFileEx"),
+                    GetLastError());
+            PerfDrain(Run);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOL
+PerfRun(
+    __in PPERF_RUN Run,
+    __in ULONG InFlight,
+    __in ULONG Seconds,
+    __out PULONG64 Microseconds
+    )
+/*++
+
+    Keep InFlight requests going for Seconds, then stop them.
+ --*/
+{
+    LARGE_INTEGER   start;
+
+    QueryPerformanceCounter(&start);
+
+    if (!PerfStart(Run, InFlight)) {
+        return FALSE;
+    }
+
+    while (PerfElapsedMicroseconds(&start) < (ULONG64)Seconds * 1000000) {
+        SleepEx(100, TRUE);
+    }
+
+    *Microseconds = PerfElapsedMicroseconds(&start);
+    PerfDrain(Run);
+
+    return TRUE;
+}
+
+VOID
+PerfShowHistogram(
+    __in LPCTSTR Title,
+    __in ULONG64 *After,
+    __in_opt ULONG64 *Before
+    )
+/*++
+
+    Display the buckets of a log2 histogram that counted anything, less
+    the counts in Before if it is given.
+ --*/
+{
+    ULONG64 count;
+    ULONG   index;
+
+    Display(TEXT("  %ws (us):"), Title);
+
+    for (index = 0; index < PCIDRV_HISTOGRAM_BUCKETS; index++) {
+        count = After[index] - (Before ? Before[index] : 0);
+        if (count == 0) {
+            continue;
+        }
+        if (index == 0) {
+            Display(TEXT("    < 1: %I64u"), count);
+        } else if (index == PCIDRV_HISTOGRAM_BUCKETS - 1) {
+            Display(TEXT("    >= %u: %I64u"), 1 << (index - 1), count);
+        } else {
+            Display(TEXT("    %u-%u: %I64u"),
+                    1 << (index - 1), (1 << index) - 1, count);
+        }
+    }
+}
+
+VOID
+PerfWriteThroughput(
+    __in HANDLE hDevice
+    )
+/*++
+
+    Sweep the number of one-word writes kept queued from 1 up to
+    PERF_WRITES_IN_FLIGHT, PERF_SWEEP_SECONDS at each depth, and report
+    the words/sec at each against the TCBs the send ring has. Then keep
+    PERF_WRITES_IN_FLIGHT queued for PERF_SECONDS and report how far the
+    driver coalesced them into transactions and batched the doorbells.
+ --*/
+{
+    static const ULONG  depths[] = { 1, 4, 16, 64, PERF_WRITES_IN_FLIGHT };
+    PPERF_RUN           run;
+    PCIDRV_STATISTICS   before, after;
+    ULONG64             microseconds;
+    ULONG64             transactions, requests, doorbells, tcbs;
+    ULONG               index;
+
+    run = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_RUN));
+    if (!run) {
+        Display(TEXT("PerfWriteThroughput: HeapAlloc Failed"));
+        return;
+    }
+    run->hDevice = hDevice;
+
+    if (!PerfGetStatistics(hDevice, &before)) {
+        goto Exit;
+    }
+
+    Display(TEXT("Writing %d-byte words, %d seconds per depth, to a ring of %u TCBs"),
+            PERF_WORD_SIZE, PERF_SWEEP_SECONDS, before.NumTcb);
+
+    for (index = 0; index < sizeof(depths) / sizeof(depths[0]); index++) {
+
+        if (!PerfGetStatistics(hDevice, &before)) {
+            goto Exit;
+        }
+
+        if (!PerfRun(run, depths[index], PERF_SWEEP_SECONDS, &microseconds)) {
+            goto Exit;
+        }
+
+        if (!PerfGetStatistics(hDevice, &after)) {
+            goto Exit;
+        }
+
+        transactions = after.CoalescedTransactions - before.CoalescedTransactions;
+        requests = after.CoalescedRequests - before.CoalescedRequests;
+
+        Display(TEXT("  %3u in flight: %I64u words/sec, %.2f writes per transaction, %I64u failed"),
+                depths[index], PERF_PER_SECOND(run->Completed, microseconds),
+                PerfRatio(requests, transactions), run->Failed);
+    }
+
+    if (!PerfGetStatistics(hDevice, &before)) {
+        goto Exit;
+    }
+
+    Display(TEXT("Writing %d-byte words, %d in flight, for %d seconds"),
+            PERF_WORD_SIZE, PERF_WRITES_IN_FLIGHT, PERF_SECONDS);
+
+    if (!PerfRun(run, PERF_WRITES_IN_FLIGHT, PERF_SECONDS, &microseconds)) {
+        goto Exit;
+    }
+
+    if (!PerfGetStatistics(hDevice, &after)) {
+        goto Exit;
+    }
+
+    transactions = after.CoalescedTransactions - before.CoalescedTransactions;
+    requests = after.CoalescedRequests - before.CoalescedRequests;
+    doorbells = after.Doorbells - before.Doorbells;
+    tcbs = after.DoorbellTcbs - before.DoorbellTcbs;
+
+    Display(TEXT("Wrote %I64u words in %I64u us: %I64u words/sec, %I64u failed"),
+            run->Completed, microseconds,
+            PERF_PER_SECOND(run->Completed, microseconds), run->Failed);
+    Display(TEXT("  %I64u coalesced transactions carried %I64u writes, %.2f each"),
+            transactions, requests, PerfRatio(requests, transactions));
+    Display(TEXT("  %I64u copied writes, %I64u doorbells for %I64u TCBs, %.2f each"),
+            after.CopiedWrites - before.CopiedWrites,
+            doorbells, tcbs, PerfRatio(tcbs, doorbells));
+
+Exit:
+
+    HeapFree(GetProcessHeap(), 0, run);
+}
+
+VOID
+PerfCopyMode(
+    __in HANDLE hDevice
+    )
+/*++
+
+    Compare sending every one-word write by DMA (CopyThreshold 0) with the
+    CopyThreshold the device was started with. For each, report the
+    per-write latency with one write in flight, then the words/sec with
+    PERF_WRITES_IN_FLIGHT queued. The threshold is put back afterwards.
+ --*/
+{
+    PPERF_RUN           run;
+    PCIDRV_STATISTICS   before, after;
+    ULONG64             microseconds;
+    ULONG               thresholds[2];
+    ULONG               index;
+
+    run = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_RUN));
+    if (!run) {
+        Display(TEXT("PerfCopyMode: HeapAlloc Failed"));
+        return;
+    }
+    run->hDevice = hDevice;
+
+    if (!PerfGetStatistics(hDevice, &before)) {
+        goto Exit;
+    }
+
+    thresholds[0] = 0;
+    thresholds[1] = before.CopyThreshold;
+
+    if (before.CopyThreshold < PERF_WORD_SIZE) {
+        Display(TEXT("CopyThreshold is %u, so %d-byte words aren't copied in either run"),
+                before.CopyThreshold, PERF_WORD_SIZE);
+    }
+
+    for (index = 0; index < 2; index++) {
+
+        if (!PerfSetCopyThreshold(hDevice, thresholds[index])) {
+            break;
+        }
+
+        Display(TEXT("CopyThreshold %u:"), thresholds[index]);
+
+        if (!PerfGetStatistics(hDevice, &before) ||
+            !PerfRun(run, 1, PERF_SWEEP_SECONDS, &microseconds) ||
+            !PerfGetStatistics(hDevice, &after)) {
+            break;
+        }
+
+        Display(TEXT("  1 in flight: %I64u writes, %.2f us each, %.2f us at most, %I64u copied"),
+                run->Completed,
+                PerfRatio(run->LatencyTicks * 1000000,
+                          run->Completed * (ULONG64)run->Frequency.QuadPart),
+                PerfRatio(run->LatencyMax * 1000000,
+                          (ULONG64)run->Frequency.QuadPart),
+                after.CopiedWrites - before.CopiedWrites);
+        PerfShowHistogram(TEXT("Write latency"), run->LatencyHistogram, NULL);
+
+        if (!PerfGetStatistics(hDevice, &before) ||
+            !PerfRun(run, PERF_WRITES_IN_FLIGHT, PERF_SWEEP_SECONDS, &microseconds) ||
+            !PerfGetStatistics(hDevice, &after)) {
+            break;
+        }
+
+        Display(TEXT("  %d in flight: %I64u words/sec, %.2f us per write, %I64u copied, %I64u failed"),
+                PERF_WRITES_IN_FLIGHT,
+                PERF_PER_SECOND(run->Completed, microseconds),
+                PerfRatio(run->LatencyTicks * 1000000,
+                          run->Completed * (ULONG64)run->Frequency.QuadPart),
+                after.CopiedWrites - before.CopiedWrites, run->Failed);
+    }
+
+    PerfSetCopyThreshold(hDevice, thresholds[1]);
+
+Exit:
+
+    HeapFree(GetProcessHeap(), 0, run);
+}
+
+ULONG
+PerfRecvWords(
+    __in PPCIDRV_STATISTICS After,
+    __in PPCIDRV_STATISTICS Before
+    )
+/*++
+
+    Words the driver received on all channels between two snapshots. The
+    per-channel counts wrap, so take the difference of each on its own.
+ --*/
+{
+    ULONG   words = 0;
+    ULONG   index;
+
+    for (index = 0; index < PCIDRV_MAX_CHANNELS; index++) {
+        words += After->RecvChannelWords[index] - Before->RecvChannelWords[index];
+    }
+    return words;
+}
+
+VOID
+PerfRecvLoad(
+    __in HANDLE hDevice
+    )
+/*++
+
+    Sweep the number of one-word reads kept posted from 1 up to
+    PERF_READS_IN_FLIGHT, PERF_SWEEP_SECONDS at each, and report for each
+    the rate the driver received words at, the receive interrupts, poll
+    passes and re-arms per second, and the poll DPC time per word. The
+    load offered to the receive path is whatever the device sends, so
+    run it once for each sending rate of interest; the received rate on
+    each line is the load that was actually offered.
+ --*/
+{
+    static const ULONG  depths[] = { 1, 4, 16, PERF_READS_IN_FLIGHT };
+    PPERF_RUN           run;
+    PCIDRV_STATISTICS   before, after;
+    ULONG64             microseconds, words, polls, busy;
+    ULONG               index;
+
+    run = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_RUN));
+    if (!run) {
+        Display(TEXT("PerfRecvLoad: HeapAlloc Failed"));
+        return;
+    }
+    run->hDevice = hDevice;
+    run->Read = TRUE;
+
+    Display(TEXT("Reading %d-byte words, %d seconds per depth"),
+            PERF_WORD_SIZE, PERF_SWEEP_SECONDS);
+
+    for (index = 0; index < sizeof(depths) / sizeof(depths[0]); index++) {
+
+        if (!PerfGetStatistics(hDevice, &before)) {
+            goto Exit;
+        }
+
+        busy = PerfBusyTime();
+
+        if (!PerfRun(run, depths[index], PERF_SWEEP_SECONDS, &microseconds)) {
+            goto Exit;
+        }
+
+        busy = PerfBusyTime() - busy;
+
+        if (!PerfGetStatistics(hDevice, &after)) {
+            goto Exit;
+        }
+
+        words = PerfRecvWords(&after, &before);
+        polls = after.RecvPolls - before.RecvPolls;
+
+        Display(TEXT("  %2u in flight: %I64u words/sec received, %I64u read"),
+                depths[index], PERF_PER_SECOND(words, microseconds),
+                PERF_PER_SECOND(run->Completed, microseconds));
+        Display(TEXT("    %I64u interrupts/sec, %I64u polls/sec, %I64u re-arms/sec, %.2f words per poll"),
+                PERF_PER_SECOND(after.RecvInterrupts - before.RecvInterrupts,
+                                microseconds),
+                PERF_PER_SECOND(polls, microseconds),
+                PERF_PER_SECOND(after.RecvPollRearms - before.RecvPollRearms,
+                                microseconds),
+                PerfRatio(words, polls));
+        Display(TEXT("    CPU per word: %.3f us busy, %.3f us in the poll DPC"),
+                PerfRatio(busy, words * 10),
+                PerfRatio((after.RecvPollTicks - before.RecvPollTicks) * 1000000,
+                          words * after.PerformanceFrequency));
+    }
+
+Exit:
+
+    HeapFree(GetProcessHeap(), 0, run);
+}
+
+VOID
+PerfReadThroughput(
+    __in HANDLE hDevice
+    )
+/*++
+
+    Keep PERF_READS_IN_FLIGHT one-word reads posted for PERF_SECONDS and
+    report the words/sec, with the rate at which the driver recycled RFDs
+    to the receive ring and how long it held RcvLock for a batch. The
+    device has to be sending words while this runs.
+
+    The CPU cost of a word is reported twice: the busy time of the whole
+    machine over the run, and the time the driver spent in its receive
+    poll DPC. Which receive path served the reads depends on the
+    ZeroCopyRecv registry value, so run it once with that set and once
+    without to compare the two. PerfRecvLoad shows how the interrupt and
+    poll rates change with the load.
+ --*/
+{
+    PPERF_RUN           run;
+    PCIDRV_STATISTICS   before, after;
+    ULONG64             microseconds;
+    ULONG64             returned, batches, lockTicks;
+    ULONG64             busy, zeroCopy, framed;
+
+    run = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_RUN));
+    if (!run) {
+        Display(TEXT("PerfReadThroughput: HeapAlloc Failed"));
+        return;
+    }
+    run->hDevice = hDevice;
+    run->Read = TRUE;
+
+    if (!PerfGetStatistics(hDevice, &before)) {
+        goto Exit;
+    }
+
+    Display(TEXT("Reading %d-byte words, %d in flight, for %d seconds"),
+            PERF_WORD_SIZE, PERF_READS_IN_FLIGHT, PERF_SECONDS);
+
+    busy = PerfBusyTime();
+
+    if (!PerfRun(run, PERF_READS_IN_FLIGHT, PERF_SECONDS, &microseconds)) {
+        goto Exit;
+    }
+
+    busy = PerfBusyTime() - busy;
+
+    if (!PerfGetStatistics(hDevice, &after)) {
+        goto Exit;
+    }
+
+    returned = after.RfdsReturned - before.RfdsReturned;
+    batches = after.RfdReturnBatches - before.RfdReturnBatches;
+    lockTicks = after.RfdReturnLockTicks - before.RfdReturnLockTicks;
+    zeroCopy = after.ZeroCopyReads - before.ZeroCopyReads;
+    framed = after.FramedReads - before.FramedReads;
+
+    Display(TEXT("Read %I64u words in %I64u us: %I64u words/sec, %I64u failed"),
+            run->Completed, microseconds,
+            PERF_PER_SECOND(run->Completed, microseconds), run->Failed);
+    if (run->Completed == 0) {
+        Display(TEXT("  No words came in; is the device sending?"));
+    }
+    Display(TEXT("  %I64u RFDs recycled, %I64u/sec, in %I64u batches of %.2f"),
+            returned, PERF_PER_SECOND(returned, microseconds),
+            batches, PerfRatio(returned, batches));
+    Display(TEXT("  RcvLock held %.2f us per batch, %.2f us at most"),
+            PerfRatio(lockTicks * 1000000, batches * after.PerformanceFrequency),
+            PerfRatio(after.RfdReturnLockTicksMax * 1000000,
+                      after.PerformanceFrequency));
+    Display(TEXT("  %ws receive: %I64u zero-copy reads, %I64u framed, %I64u fell back"),
+            zeroCopy ? TEXT("Zero-copy") : TEXT("Copied"),
+            zeroCopy, framed,
+            after.ZeroCopyFallbacks - before.ZeroCopyFallbacks);
+    Display(TEXT("  %I64u receive interrupts/sec, %I64u polls/sec, %I64u re-arms/sec"),
+            PERF_PER_SECOND(after.RecvInterrupts - before.RecvInterrupts,
+                            microseconds),
+            PERF_PER_SECOND(after.RecvPolls - before.RecvPolls, microseconds),
+            PERF_PER_SECOND(after.RecvPollRearms - before.RecvPollRearms,
+                            microseconds));
+    Display(TEXT("  CPU per word: %.3f us busy, %.3f us in the poll DPC"),
+            PerfRatio(busy, run->Completed * 10),
+            PerfRatio((after.RecvPollTicks - before.RecvPollTicks) * 1000000,
+                      run->Completed * after.PerformanceFrequency));
+
+Exit:
+
+    HeapFree(GetProcessHeap(), 0, run);
+}
+
+VOID
+PerfPriorityLatency(
+    __in HANDLE hDevice
+    )
+/*++
+
+    Keep the normal write queue saturated with PERF_WRITES_IN_FLIGHT
+    one-word writes and send PERF_PRIORITY_SENDS priority commands, one at
+    a time, behind them. Reports how long each priority command took to
+    complete, with how many of them had to wait for a TCB and what the
+    send DPCs and the DPC latency looked like meanwhile.
+ --*/
+{
+    PPERF_RUN           run;
+    PCIDRV_STATISTICS   before, after;
+    OVERLAPPED          overlapped;
+    LARGE_INTEGER       start, end, frequency;
+    ULONG64             latency, total = 0, low = (ULONG64)-1, high = 0;
+    ULONG64             histogram[PCIDRV_HISTOGRAM_BUCKETS];
+    ULONG64             dpcBefore[PCIDRV_HISTOGRAM_BUCKETS];
+    ULONG64             dpcAfter[PCIDRV_HISTOGRAM_BUCKETS];
+    UCHAR               command[PERF_WORD_SIZE] = { 0xEE, 0, 0, 0 };
+    DWORD               bytes, wait;
+    ULONG               sent = 0, failed = 0, index, cpu;
+    BOOL                ok;
+
+    memset(histogram, 0, sizeof(histogram));
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+
+    run = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_RUN));
+    if (!run) {
+        Display(TEXT("PerfPriorityLatency: HeapAlloc Failed"));
+        return;
+    }
+    run->hDevice = hDevice;
+
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        goto Exit;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    if (!PerfGetStatistics(hDevice, &before)) {
+        goto Exit;
+    }
+
+    Display(TEXT("Sending %d priority commands behind %d queued writes"),
+            PERF_PRIORITY_SENDS, PERF_WRITES_IN_FLIGHT);
+
+    if (!PerfStart(run, PERF_WRITES_IN_FLIGHT)) {
+        goto Exit;
+    }
+
+    //
+    // Let the writes fill the TCBs before the first command goes down.
+    //
+    SleepEx(100, TRUE);
+
+    for (index = 0; index < PERF_PRIORITY_SENDS; index++) {
+
+        ResetEvent(overlapped.hEvent);
+        QueryPerformanceCounter(&start);
+
+        ok = DeviceIoControl(hDevice, IOCTL_PCIDRV_SEND_PRIORITY, NULL, 0,
+                             command, sizeof(command), &bytes, &overlapped);
+        if (!ok && GetLastError() == ERROR_IO_PENDING) {
+            //
+            // Wait alertably so the writes keep being reissued meanwhile.
+            //
+            do {
+                wait = WaitForSingleObjectEx(overlapped.hEvent, INFINITE, TRUE);
+            } while (wait == WAIT_IO_COMPLETION);
+
+            ok = GetOverlappedResult(hDevice, &overlapped, &bytes, FALSE);
+        }
+
+        QueryPerformanceCounter(&end);
+
+        if (!ok) {
+            failed++;
+            continue;
+        }
+
+        latency = (ULONG64)(end.QuadPart - start.QuadPart) * 1000000 /
+                  (ULONG64)frequency.QuadPart;
+
+        sent++;
+        total += latency;
+        low = min(low, latency);
+        high = max(high, latency);
+        histogram[PerfBucket(latency)]++;
+
+        SleepEx(PERF_PRIORITY_INTERVAL, TRUE);
+    }
+
+    PerfDrain(run);
+
+    if (!PerfGetStatistics(hDevice, &after)) {
+        goto Exit;
+    }
+
+    Display(TEXT("%u priority commands completed, %u failed, %I64u writes meanwhile"),
+            sent, failed, run->Completed);
+    if (sent) {
+        Display(TEXT("  Latency: %I64u us min, %I64u us avg, %I64u us max"),
+                low, total / sent, high);
+        PerfShowHistogram(TEXT("Priority latency"), histogram, NULL);
+    }
+    Display(TEXT("  %I64u priority sends, %I64u deferred for a TCB"),
+            after.PrioritySends - before.PrioritySends,
+            after.PriorityDeferred - before.PriorityDeferred);
+
+    PerfShowHistogram(TEXT("Send DPC duration"),
+                      after.SendDpcHistogram, before.SendDpcHistogram);
+
+    //
+    // Fold the per-CPU DPC latency rows together.
+    //
+    memset(dpcBefore, 0, sizeof(dpcBefore));
+    memset(dpcAfter, 0, sizeof(dpcAfter));
+    for (cpu = 0; cpu < PCIDRV_HISTOGRAM_CPUS; cpu++) {
+        for (index = 0; index < PCIDRV_HISTOGRAM_BUCKETS; index++) {
+            dpcBefore[index] += before.DpcLatencyHistogram[cpu][index];
+            dpcAfter[index] += after.DpcLatencyHistogram[cpu][index];
+        }
+    }
+    PerfShowHistogram(TEXT("ISR to DPC latency"), dpcAfter, dpcBefore);
+
+Exit:
+
+    if (overlapped.hEvent) {
+        CloseHandle(overlapped.hEvent);
+    }
+    HeapFree(GetProcessHeap(), 0, run);
+}
+
+DWORD WINAPI
+PerfThread (
+    LPVOID Parameter
+    )
+{
+    PPERF_CONTEXT   context = (PPERF_CONTEXT)Parameter;
+    HANDLE          hDevice;
+
+    hDevice = CreateFile(context->DevicePath,
+                         GENERIC_READ | GENERIC_WRITE,
+                         0,
+                         NULL, // no SECURITY_ATTRIBUTES structure
+                         OPEN_EXISTING, // No special create flags
+                         FILE_FLAG_OVERLAPPED,
+                         NULL);
+
+    if (INVALID_HANDLE_VALUE == hDevice) {
+        Display(TEXT("Failed to open the device: %ws"), context->DeviceName);
+    } else {
+        Display(TEXT("Benchmarking %ws"), context->DeviceName);
+        context->Routine(hDevice);
+        CloseHandle(hDevice);
+    }
+
+    Display(TEXT("Benchmark done"));
+
+    HeapFree(GetProcessHeap(), 0, context);
+    return 0;
+}
+
+BOOL
+StartBenchmark(
+    __in ULONG Command
+    )
+/*++
+
+    Run the benchmark of a menu command on the first device that isn't
+    a network device and isn't open for ping.
+ --*/
+{
+    PPERF_CONTEXT   context;
+    PDEVICE_INFO    deviceInfo = NULL;
+    PLIST_ENTRY     thisEntry;
+    ULONG           id;
+
+    if (PerfThreadHandle) {
+        if (WaitForSingleObject(PerfThreadHandle, 0) != WAIT_OBJECT_0) {
+            Display(TEXT("A benchmark is already running"));
+            return FALSE;
+        }
+        CloseHandle(PerfThreadHandle);
+        PerfThreadHandle = NULL;
+    }
+
+    for(thisEntry = ListHead.Flink; thisEntry != &ListHead;
+                        thisEntry = thisEntry->Flink)
+    {
+        deviceInfo = CONTAINING_RECORD(thisEntry, DEVICE_INFO, ListEntry);
+        if (!deviceInfo->IsANetworkMiniport &&
+            (deviceInfo->hDevice == NULL ||
+             deviceInfo->hDevice == INVALID_HANDLE_VALUE)) {
+            break;
+        }
+        deviceInfo = NULL;
+    }
+
+    if (!deviceInfo) {
+        Display(TEXT("No device to benchmark"));
+        return FALSE;
+    }
+
+    context = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PERF_CONTEXT));
+    if (!context) {
+        return FALSE;
+    }
+
+    switch (Command) {
+        case IDM_WRITE_BENCH:
+            context->Routine = PerfWriteThroughput;
+            break;
+        case IDM_READ_BENCH:
+            context->Routine = PerfReadThroughput;
+            break;
+        case IDM_PRIORITY_BENCH:
+            context->Routine = PerfPriorityLatency;
+            break;
+        case IDM_COPY_BENCH:
+            context->Routine = PerfCopyMode;
+            break;
+        case IDM_RECV_LOAD_BENCH:
+            context->Routine = PerfRecvLoad;
+            break;
+        default:
+            HeapFree(GetProcessHeap(), 0, context);
+            return FALSE;
+    }
+
+    StringCchCopy(context->DevicePath, MAX_PATH, deviceInfo->DevicePath);
+    StringCchCopy(context->DeviceName, MAX_PATH, deviceInfo->DeviceName);
+
+    PerfThreadHandle = CreateThread(NULL, 0, PerfThread, context, 0, (LPDWORD)&id);
+    if (NULL == PerfThreadHandle) {
+        Display(TEXT("CreateThread failed %x"), GetLastError());
+        HeapFree(GetProcessHeap(), 0, context);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -6,6 +6,11 @@
 #define  IDM_CLEAR              103
 #define  IDM_ENUMERATE          104
 #define  IDM_VERBOSE            105
+#define  IDM_WRITE_BENCH        106
+#define  IDM_READ_BENCH         107
+#define  IDM_PRIORITY_BENCH     108
+#define  IDM_COPY_BENCH         109
+#define  IDM_RECV_LOAD_BENCH    110
 
 #define IDD_DIALOG                     115
 #define ID_OK                           118
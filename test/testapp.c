@@ -288,6 +288,14 @@ HandleCommands(
             }
             break;
 
+        case IDM_WRITE_BENCH:
+        case IDM_READ_BENCH:
+        case IDM_PRIORITY_BENCH:
+        case IDM_COPY_BENCH:
+        case IDM_RECV_LOAD_BENCH:
+            StartBenchmark((ULONG)wParam);
+            break;
+
         case IDM_CLEAR:
             SendMessage(HWndList, LB_RESETCONTENT, 0, 0);
             ListBoxIndex = 0;
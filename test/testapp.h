@@ -48,6 +48,7 @@ Abstract:
 #define MAX_PING_RETRY          10
 
 extern BOOLEAN     Verbose;
+extern LIST_ENTRY  ListHead;
 
 typedef struct _DEVICE_INFO
 {
@@ -236,6 +237,11 @@ TerminatePingThread(
     PDEVICE_INFO DeviceInfo
     );
 
+BOOL
+StartBenchmark(
+    __in ULONG Command
+    );
+
 BOOL
 GetRegistryInfo(
     __out_bcount(* SourceIPLen) PWSTR SourceIP,
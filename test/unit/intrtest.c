@@ -0,0 +1,459 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name: intrtest.c
+
+
+Abstract:
+
+    Tests of the interrupt cause decisions of nic_intr.h against a
+    simulated device. The device has the INTR_STATUS and mask registers of
+    the real one and raises its interrupt (a line, or a message per cause)
+    while an unmasked cause is pending. SimIsr, SimDpc, SimEnable and
+    SimDisable do what NICEvtInterruptIsr, the DPCs and the enable/disable
+    callbacks of isrdpc.c do, with register writes in place of the CSR
+    accesses.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "pcitest.h"
+#include <stdlib.h>
+
+#define INTR_SIMULATION_STEPS   1000000
+
+//
+// A cause of another device sharing the line
+//
+#define INTR_FOREIGN            0x00000100
+
+typedef struct _SIM_DEVICE
+{
+    ULONG               Status;         // raised, not acknowledged
+    ULONG               Mask;
+    ULONG               StatusReads;
+} SIM_DEVICE, *PSIM_DEVICE;
+
+//
+// An interrupt object: the driver state and the causes its DPC has yet to
+// service
+//
+typedef struct _SIM_INTERRUPT
+{
+    NIC_INTR_STATE      State;
+    ULONG               DpcCauses;
+} SIM_INTERRUPT, *PSIM_INTERRUPT;
+
+typedef struct _SIM_SYSTEM
+{
+    SIM_DEVICE          Device;
+    SIM_INTERRUPT       Recv;
+    SIM_INTERRUPT       Send;
+    ULONG               Messages;
+    ULONG               Errors;
+    ULONG64             Raised[2];
+    ULONG64             Serviced[2];
+} SIM_SYSTEM, *PSIM_SYSTEM;
+
+ULONG
+SimIsr(
+    __inout PSIM_DEVICE Device,
+    __inout PSIM_INTERRUPT Interrupt
+    )
+/*++
+
+    NICEvtInterruptIsr: returns the causes claimed, 0 if the interrupt
+    wasn't ours.
+ --*/
+{
+    ULONG   status = 0;
+    ULONG   causes;
+
+    if (NICIsrReadsStatus(&Interrupt->State)) {
+        status = Device->Status & ~Device->Mask;
+        Device->StatusReads++;
+    }
+
+    causes = NICIsrClaim(&Interrupt->State, status);
+    if (causes == 0) {
+        return 0;
+    }
+
+    Device->Mask |= causes;
+    Device->Status &= ~causes;
+
+    Interrupt->DpcCauses |= causes;
+
+    return causes;
+}
+
+VOID
+SimDpc(
+    __inout PSIM_DEVICE Device,
+    __inout PSIM_INTERRUPT Interrupt,
+    __in ULONG Cause
+    )
+/*++
+
+    The interrupt DPC or the receive poll DPC once it has serviced Cause:
+    NICUnmaskInterrupt.
+ --*/
+{
+    Interrupt->DpcCauses &= ~Cause;
+
+    Device->Mask &= ~NICUnmaskCauses(&Interrupt->State, Cause);
+}
+
+VOID
+SimEnable(
+    __inout PSIM_DEVICE Device,
+    __inout PSIM_INTERRUPT Interrupt
+    )
+{
+    ULONG   causes;
+
+    causes = NICEnableCauses(&Interrupt->State);
+
+    Device->Status &= ~causes;
+    Device->Mask &= ~causes;
+}
+
+VOID
+SimDisable(
+    __inout PSIM_DEVICE Device,
+    __inout PSIM_INTERRUPT Interrupt
+    )
+{
+    Device->Mask |= NICDisableCauses(&Interrupt->State);
+}
+
+VOID
+SimInit(
+    __out PSIM_SYSTEM System,
+    __in ULONG Messages
+    )
+{
+    memset(System, 0, sizeof(SIM_SYSTEM));
+
+    System->Messages = Messages;
+    System->Device.Mask = NIC_INTR_ALL;
+
+    NICAssignInterruptCauses(Messages, &System->Recv.State, &System->Send.State);
+
+    SimEnable(&System->Device, &System->Recv);
+    SimEnable(&System->Device, &System->Send);
+}
+
+BOOLEAN
+SimDeliver(
+    __inout PSIM_SYSTEM System
+    )
+/*++
+
+    Raise the interrupts the device signals right now and run their ISRs.
+    Returns FALSE if nothing was signalled.
+ --*/
+{
+    PSIM_DEVICE     device = &System->Device;
+    ULONG           pending = device->Status & ~device->Mask & NIC_INTR_ALL;
+    ULONG           causes;
+
+    if (pending == 0) {
+        return FALSE;
+    }
+
+    if (System->Messages >= NIC_MSIX_MESSAGES) {
+        if (pending & NIC_INTR_RX) {
+            causes = SimIsr(device, &System->Recv);
+            if (causes != NIC_INTR_RX) {
+                System->Errors++;
+            }
+        }
+        if (pending & NIC_INTR_TX) {
+            causes = SimIsr(device, &System->Send);
+            if (causes != NIC_INTR_TX) {
+                System->Errors++;
+            }
+        }
+    } else {
+        causes = SimIsr(device, &System->Recv);
+        if (causes != pending) {
+            System->Errors++;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN
+SimRunDpc(
+    __inout PSIM_SYSTEM System,
+    __in ULONG Cause
+    )
+/*++
+
+    Run the DPC that has Cause to service, if one has.
+ --*/
+{
+    PSIM_INTERRUPT  interrupt;
+
+    if (System->Recv.DpcCauses & Cause) {
+        interrupt = &System->Recv;
+    } else if (System->Send.DpcCauses & Cause) {
+        interrupt = &System->Send;
+    } else {
+        return FALSE;
+    }
+
+    System->Serviced[Cause == NIC_INTR_TX]++;
+    SimDpc(&System->Device, interrupt, Cause);
+
+    return TRUE;
+}
+
+BOOLEAN
+IntrLayoutTest(
+    VOID
+    )
+{
+    NIC_INTR_STATE  recv, send;
+    ULONG           messages;
+    BOOLEAN         passed = TRUE;
+
+    for (messages = 0; messages <= NIC_MSIX_MESSAGES + 1; messages++) {
+
+        memset(&recv, 0xA5, sizeof(recv));
+        memset(&send, 0xA5, sizeof(send));
+
+        NICAssignInterruptCauses(messages, &recv, &send);
+
+        //
+        // Every cause is serviced by exactly one interrupt object.
+        //
+        CHECK((recv.Causes | send.Causes) == NIC_INTR_ALL);
+        CHECK((recv.Causes & send.Causes) == 0);
+
+        if (messages >= NIC_MSIX_MESSAGES) {
+            CHECK(recv.Causes == NIC_INTR_RX && recv.Dedicated);
+            CHECK(send.Causes == NIC_INTR_TX && send.Dedicated);
+            CHECK(!NICIsrReadsStatus(&recv));
+            CHECK(!NICIsrReadsStatus(&send));
+        } else {
+            CHECK(recv.Causes == NIC_INTR_ALL && !recv.Dedicated);
+            CHECK(send.Causes == 0 && !send.Dedicated);
+            CHECK(NICIsrReadsStatus(&recv));
+            CHECK(!NICIsrReadsStatus(&send));
+        }
+    }
+
+    return passed;
+}
+
+BOOLEAN
+IntrClaimTest(
+    VOID
+    )
+{
+    SIM_SYSTEM  system;
+    BOOLEAN     passed = TRUE;
+
+    //
+    // Shared line: nothing of ours pending, or only another device's
+    // cause. The ISR reads the status and leaves the registers alone.
+    //
+    SimInit(&system, 0);
+
+    CHECK(SimIsr(&system.Device, &system.Recv) == 0);
+    CHECK(system.Device.StatusReads == 1);
+    CHECK(system.Device.Mask == 0);
+
+    system.Device.Status = INTR_FOREIGN;
+    CHECK(SimIsr(&system.Device, &system.Recv) == 0);
+    CHECK(system.Device.Status == INTR_FOREIGN);
+    CHECK(system.Device.Mask == 0);
+
+    //
+    // Line: both causes are claimed, masked and acknowledged at once, and
+    // the line drops.
+    //
+    system.Device.Status = NIC_INTR_ALL | INTR_FOREIGN;
+    CHECK(SimIsr(&system.Device, &system.Recv) == NIC_INTR_ALL);
+    CHECK(system.Device.Mask == NIC_INTR_ALL);
+    CHECK(system.Device.Status == INTR_FOREIGN);
+    CHECK(system.Recv.DpcCauses == NIC_INTR_ALL);
+
+    //
+    // A masked cause raised again isn't claimed until the DPC unmasks it.
+    //
+    system.Device.Status |= NIC_INTR_RX;
+    CHECK(SimIsr(&system.Device, &system.Recv) == 0);
+    SimDpc(&system.Device, &system.Recv, NIC_INTR_RX);
+    CHECK(system.Device.Mask == NIC_INTR_TX);
+    CHECK(SimIsr(&system.Device, &system.Recv) == NIC_INTR_RX);
+
+    //
+    // MSI-X: each message claims its own cause without a status read and
+    // leaves the other one pending and unmasked.
+    //
+    SimInit(&system, NIC_MSIX_MESSAGES);
+
+    system.Device.Status = NIC_INTR_ALL;
+    CHECK(SimIsr(&system.Device, &system.Send) == NIC_INTR_TX);
+    CHECK(system.Device.StatusReads == 0);
+    CHECK(system.Device.Status == NIC_INTR_RX);
+    CHECK(system.Device.Mask == NIC_INTR_TX);
+    CHECK(system.Send.DpcCauses == NIC_INTR_TX);
+    CHECK(system.Recv.DpcCauses == 0);
+
+    //
+    // The send DPC can't unmask the receive cause of the other message.
+    //
+    SimDpc(&system.Device, &system.Send, NIC_INTR_ALL);
+    CHECK(system.Device.Mask == 0);
+    system.Device.Mask = NIC_INTR_RX;
+    SimDpc(&system.Device, &system.Send, NIC_INTR_RX);
+    CHECK(system.Device.Mask == NIC_INTR_RX);
+
+    return passed;
+}
+
+BOOLEAN
+IntrEnableTest(
+    VOID
+    )
+{
+    SIM_SYSTEM  system;
+    BOOLEAN     passed = TRUE;
+
+    //
+    // Enable drops stale causes and unmasks only what the object services;
+    // an object without causes stays disabled.
+    //
+    memset(&system, 0, sizeof(system));
+    system.Device.Status = NIC_INTR_ALL;
+    system.Device.Mask = NIC_INTR_ALL;
+
+    NICAssignInterruptCauses(1, &system.Recv.State, &system.Send.State);
+
+    SimEnable(&system.Device, &system.Send);
+    CHECK(!system.Send.State.Enabled);
+    CHECK(system.Device.Status == NIC_INTR_ALL);
+    CHECK(system.Device.Mask == NIC_INTR_ALL);
+
+    SimEnable(&system.Device, &system.Recv);
+    CHECK(system.Recv.State.Enabled);
+    CHECK(system.Device.Status == 0);
+    CHECK(system.Device.Mask == 0);
+
+    //
+    // A DPC still running when the interrupt is disabled must not unmask
+    // it again.
+    //
+    system.Device.Status = NIC_INTR_TX;
+    CHECK(SimIsr(&system.Device, &system.Recv) == NIC_INTR_TX);
+
+    SimDisable(&system.Device, &system.Recv);
+    CHECK(!system.Recv.State.Enabled);
+    CHECK(system.Device.Mask == NIC_INTR_ALL);
+
+    SimDpc(&system.Device, &system.Recv, NIC_INTR_TX);
+    CHECK(system.Device.Mask == NIC_INTR_ALL);
+
+    //
+    // Disabling twice masks nothing more.
+    //
+    CHECK(NICDisableCauses(&system.Recv.State) == 0);
+
+    SimEnable(&system.Device, &system.Recv);
+    CHECK(system.Device.Mask == 0);
+
+    return passed;
+}
+
+BOOLEAN
+IntrSimulationTest(
+    VOID
+    )
+/*++
+
+    Raise causes at random and deliver interrupts and run DPCs in random
+    order, with a line and with MSI-X. Every 1000 steps the system is
+    left to go quiet; by then everything raised must have been claimed
+    and serviced and the device must be fully unmasked: no interrupt may
+    be lost or left masked.
+ --*/
+{
+    SIM_SYSTEM  system;
+    ULONG       messages;
+    ULONG       step;
+    ULONG       quiet;
+    ULONG       cause;
+    BOOLEAN     passed = TRUE;
+
+    srand(1);
+
+    for (messages = 1; messages <= NIC_MSIX_MESSAGES; messages++) {
+
+        SimInit(&system, messages);
+        quiet = 0;
+
+        for (step = 0; step < INTR_SIMULATION_STEPS; step++) {
+
+            cause = (rand() & 1) ? NIC_INTR_TX : NIC_INTR_RX;
+
+            switch (rand() % 4) {
+            case 0:
+                system.Device.Status |= cause;
+                system.Raised[cause == NIC_INTR_TX]++;
+                break;
+            case 1:
+                SimDeliver(&system);
+                break;
+            default:
+                SimRunDpc(&system, cause);
+                break;
+            }
+
+            if (step % 1000 != 999) {
+                continue;
+            }
+
+            //
+            // Let the system go quiet.
+            //
+            while (SimDeliver(&system) ||
+                   SimRunDpc(&system, NIC_INTR_RX) ||
+                   SimRunDpc(&system, NIC_INTR_TX)) {
+                NOTHING;
+            }
+
+            CHECK(system.Device.Status == 0);
+            CHECK(system.Device.Mask == 0);
+            CHECK((system.Recv.DpcCauses | system.Send.DpcCauses) == 0);
+            quiet++;
+        }
+
+        CHECK(system.Errors == 0);
+
+        printf("  %s: %u quiet points, raised %I64u/%I64u, serviced %I64u/%I64u (rx/tx)\n",
+               messages >= NIC_MSIX_MESSAGES ? "MSI-X" : "line",
+               quiet,
+               system.Raised[0], system.Raised[1],
+               system.Serviced[0], system.Serviced[1]);
+
+        if (!passed) {
+            break;
+        }
+    }
+
+    return passed;
+}
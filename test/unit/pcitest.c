@@ -0,0 +1,106 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name: pcitest.c
+
+
+Abstract:
+
+    Runs the user-mode unit tests of PCIDRV and reports which failed.
+    Run it with the name of a test to run only that one.
+
+    The interrupt tests run the cause decisions of nic_intr.h, which the
+    ISR, the DPCs and the enable/disable callbacks of isrdpc.c are built
+    on, against a simulated device; the CSR accesses and framework calls
+    around them are exercised on the device.
+
+    sendsim drives the send path of nic_hw.h and nic_ring.h against a
+    simulated device and reports the words/sec it reaches at each
+    coalescing factor.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "pcitest.h"
+
+struct {
+    PCSTR           Name;
+    PTEST_ROUTINE   Routine;
+} Tests[] = {
+    { "ringstress",     RingStressTest },
+    { "ringthroughput", RingThroughputTest },
+    { "ringfull",       RingFullTest },
+    { "tbdlayout",      TbdLayoutTest },
+    { "tbdencode",      TbdEncodeTest },
+    { "tbdthroughput",  TbdThroughputTest },
+    { "intrlayout",     IntrLayoutTest },
+    { "intrclaim",      IntrClaimTest },
+    { "intrenable",     IntrEnableTest },
+    { "intrsim",        IntrSimulationTest },
+    { "sendsim",        SendSimulationTest },
+};
+
+//
+// Many checks are constant expressions; going through a function keeps
+// the compiler from warning about that.
+//
+BOOLEAN
+Check(
+    __in BOOLEAN Condition,
+    __in PCSTR File,
+    __in int Line,
+    __in PCSTR Text
+    )
+{
+    if (!Condition) {
+        printf("  %s(%d): %s\n", File, Line, Text);
+    }
+    return Condition;
+}
+
+int
+__cdecl
+main(
+    __in int argc,
+    __in_ecount(argc) char *argv[]
+    )
+{
+    ULONG   index;
+    ULONG   run = 0;
+    ULONG   failed = 0;
+
+    for (index = 0; index < sizeof(Tests) / sizeof(Tests[0]); index++) {
+
+        if (argc > 1 && _stricmp(argv[1], Tests[index].Name) != 0) {
+            continue;
+        }
+
+        printf("%s:\n", Tests[index].Name);
+        run++;
+
+        if (!Tests[index].Routine()) {
+            printf("%s FAILED\n", Tests[index].Name);
+            failed++;
+        } else {
+            printf("%s passed\n", Tests[index].Name);
+        }
+    }
+
+    if (run == 0) {
+        printf("No test named %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("%d of %d tests failed\n", failed, run);
+
+    return failed ? 1 : 0;
+}
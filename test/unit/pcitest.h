@@ -0,0 +1,138 @@
+/*++
+Copyright (c) Microsoft Corporation All Rights Reserved
+
+Module Name:
+
+    pcitest.h
+
+Abstract:
+
+    User-mode unit tests of the parts of the driver that don't depend on
+    the framework. The driver headers they include use the kernel barrier
+    primitives and the scatter/gather list, which are defined here.
+
+--*/
+
+#ifndef __PCITEST_H
+#define __PCITEST_H
+
+#include <windows.h>
+#include <stdio.h>
+#include <intrin.h>
+
+#define KeMemoryBarrier()               MemoryBarrier()
+#define KeMemoryBarrierWithoutFence()   _ReadWriteBarrier()
+
+//
+// The scatter/gather list as wdm.h defines it
+//
+typedef struct _SCATTER_GATHER_ELEMENT {
+    PHYSICAL_ADDRESS    Address;
+    ULONG               Length;
+    ULONG_PTR           Reserved;
+} SCATTER_GATHER_ELEMENT, *PSCATTER_GATHER_ELEMENT;
+
+typedef struct _SCATTER_GATHER_LIST {
+    ULONG                   NumberOfElements;
+    ULONG_PTR               Reserved;
+    SCATTER_GATHER_ELEMENT  Elements[1];
+} SCATTER_GATHER_LIST, *PSCATTER_GATHER_LIST;
+
+#include "nic_ring.h"
+#include "nic_hw.h"
+#include "nic_intr.h"
+
+typedef BOOLEAN (*PTEST_ROUTINE)(VOID);
+
+//
+// Room for a full scatter/gather list
+//
+typedef struct _TEST_SG_LIST
+{
+    SCATTER_GATHER_LIST     List;
+    SCATTER_GATHER_ELEMENT  More[NIC_MAX_PHYS_BUF_COUNT - 1];
+} TEST_SG_LIST, *PTEST_SG_LIST;
+
+VOID
+AddElement(
+    __inout PTEST_SG_LIST SgList,
+    __in ULONG64 Address,
+    __in ULONG Length
+    );
+
+//
+// Report a failed condition and clear the test's passed flag
+//
+#define CHECK(_Condition) \
+    if (!Check((BOOLEAN)(_Condition), __FILE__, __LINE__, #_Condition)) passed = FALSE
+
+BOOLEAN
+Check(
+    __in BOOLEAN Condition,
+    __in PCSTR File,
+    __in int Line,
+    __in PCSTR Text
+    );
+
+//
+// Elapsed microseconds between two QueryPerformanceCounter readings
+//
+#define ELAPSED_US(_Start, _End, _Freq) \
+    ((ULONG64)((_End).QuadPart - (_Start).QuadPart) * 1000000 / (ULONG64)(_Freq).QuadPart)
+
+BOOLEAN
+RingStressTest(
+    VOID
+    );
+
+BOOLEAN
+RingThroughputTest(
+    VOID
+    );
+
+BOOLEAN
+RingFullTest(
+    VOID
+    );
+
+BOOLEAN
+TbdLayoutTest(
+    VOID
+    );
+
+BOOLEAN
+TbdEncodeTest(
+    VOID
+    );
+
+BOOLEAN
+TbdThroughputTest(
+    VOID
+    );
+
+BOOLEAN
+IntrLayoutTest(
+    VOID
+    );
+
+BOOLEAN
+IntrClaimTest(
+    VOID
+    );
+
+BOOLEAN
+IntrEnableTest(
+    VOID
+    );
+
+BOOLEAN
+IntrSimulationTest(
+    VOID
+    );
+
+BOOLEAN
+SendSimulationTest(
+    VOID
+    );
+
+#endif
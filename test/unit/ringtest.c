@@ -0,0 +1,345 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name: ringtest.c
+
+
+Abstract:
+
+    Stress test and throughput benchmark of the TCB ring discipline of
+    nic_ring.h. A producer thread plays NICWritePacket: it waits for
+    MP_RING_COUNT to drop below MP_RING_CAPACITY, fills the slot at the
+    tail and publishes it with MP_STORE_RELEASE. A consumer thread plays
+    NICHandleSendInterrupt: it reads the tail with MP_LOAD_ACQUIRE, checks
+    every slot up to it and hands it back with MP_STORE_RELEASE of the
+    head. It also checks what the device would make of the tail: a
+    producer index that masks to the head's means an empty ring to it.
+    The two run on different processors when there are two.
+
+    ringfull fills the ring to capacity at indices around the wrap and
+    checks the device index the doorbell would carry.
+
+    The indices start just below 2^32, so they wrap while the test runs.
+    The throughput only means something with two processors; with one,
+    the threads hand the processor back and forth.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "pcitest.h"
+
+//
+// A power of two, like NumTcb
+//
+#define RING_SIZE               64
+
+#define RING_STRESS_WORDS       20000000
+#define RING_THROUGHPUT_WORDS   50000000
+
+#define RING_FIRST_INDEX        0xFFFFFF00
+
+//
+// A slot carries a sequence number and its complement, so a slot read
+// before the producer finished writing it doesn't go unnoticed.
+//
+typedef struct _RING_SLOT
+{
+    ULONG64         Sequence;
+    ULONG64         Check;
+} RING_SLOT, *PRING_SLOT;
+
+//
+// The indices sit on cache lines of their own, as SendHead and SendTail
+// do in FDO_DATA.
+//
+typedef struct _TEST_RING
+{
+    DECLSPEC_ALIGN(64) volatile ULONG Head;
+    DECLSPEC_ALIGN(64) volatile ULONG Tail;
+    DECLSPEC_ALIGN(64) RING_SLOT Slots[RING_SIZE];
+
+    ULONG64         Words;
+    ULONG64         Errors;
+    ULONG64         LooksEmpty;     // busy ring the device would take as empty
+    ULONG           MaxCount;
+    BOOLEAN         Verify;
+    BOOLEAN         SingleProcessor;
+} TEST_RING, *PTEST_RING;
+
+//
+// Spin while the other side makes progress. With one processor it can
+// only do that once this thread gives up the processor.
+//
+__inline VOID
+RingWait(
+    __in PTEST_RING Ring
+    )
+{
+    if (Ring->SingleProcessor) {
+        SwitchToThread();
+    } else {
+        YieldProcessor();
+    }
+}
+
+DWORD WINAPI
+RingProducer(
+    __in LPVOID Context
+    )
+{
+    PTEST_RING  ring = (PTEST_RING)Context;
+    PRING_SLOT  slot;
+    ULONG64     sequence;
+    ULONG       tail = ring->Tail;
+
+    for (sequence = 0; sequence < ring->Words; sequence++) {
+
+        while (MP_RING_COUNT(&ring->Head, &ring->Tail) >= MP_RING_CAPACITY(RING_SIZE)) {
+            RingWait(ring);
+        }
+
+        slot = &ring->Slots[tail & (RING_SIZE - 1)];
+        slot->Sequence = sequence;
+        slot->Check = ~sequence;
+
+        tail++;
+        MP_STORE_RELEASE(&ring->Tail, tail);
+    }
+
+    return 0;
+}
+
+DWORD WINAPI
+RingConsumer(
+    __in LPVOID Context
+    )
+{
+    PTEST_RING  ring = (PTEST_RING)Context;
+    PRING_SLOT  slot;
+    ULONG64     expected = 0;
+    ULONG       head = ring->Head;
+    ULONG       tail;
+
+    while (expected < ring->Words) {
+
+        tail = MP_LOAD_ACQUIRE(&ring->Tail);
+        if (tail == head) {
+            RingWait(ring);
+            continue;
+        }
+
+        if (tail - head > ring->MaxCount) {
+            ring->MaxCount = tail - head;
+        }
+
+        if (MP_RING_DEVICE_INDEX(tail, RING_SIZE) ==
+            MP_RING_DEVICE_INDEX(head, RING_SIZE)) {
+            ring->LooksEmpty++;
+        }
+
+        while (head != tail) {
+
+            slot = &ring->Slots[head & (RING_SIZE - 1)];
+
+            if (ring->Verify &&
+                (slot->Sequence != expected || slot->Check != ~expected)) {
+                if (ring->Errors++ < 10) {
+                    printf("  slot %d: sequence %I64d check %I64x, expected %I64d\n",
+                           head & (RING_SIZE - 1), slot->Sequence, slot->Check,
+                           expected);
+                }
+            }
+
+            expected++;
+            head++;
+            MP_STORE_RELEASE(&ring->Head, head);
+        }
+    }
+
+    return 0;
+}
+
+BOOLEAN
+RunRing(
+    __in PTEST_RING Ring,
+    __out PULONG64 Microseconds
+    )
+{
+    HANDLE          threads[2];
+    SYSTEM_INFO     systemInfo;
+    LARGE_INTEGER   start, end, frequency;
+
+    Ring->Head = RING_FIRST_INDEX;
+    Ring->Tail = RING_FIRST_INDEX;
+    Ring->Errors = 0;
+    Ring->LooksEmpty = 0;
+    Ring->MaxCount = 0;
+
+    threads[0] = CreateThread(NULL, 0, RingConsumer, Ring, CREATE_SUSPENDED, NULL);
+    threads[1] = CreateThread(NULL, 0, RingProducer, Ring, CREATE_SUSPENDED, NULL);
+
+    if (threads[0] == NULL || threads[1] == NULL) {
+        printf("  CreateThread failed %x\n", GetLastError());
+        return FALSE;
+    }
+
+    GetSystemInfo(&systemInfo);
+    if (systemInfo.dwNumberOfProcessors > 1) {
+        SetThreadAffinityMask(threads[0], 1);
+        SetThreadAffinityMask(threads[1], 2);
+    } else {
+        printf("  one processor, producer and consumer share it\n");
+        Ring->SingleProcessor = TRUE;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    ResumeThread(threads[0]);
+    ResumeThread(threads[1]);
+
+    WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    CloseHandle(threads[0]);
+    CloseHandle(threads[1]);
+
+    *Microseconds = ELAPSED_US(start, end, frequency);
+
+    return TRUE;
+}
+
+BOOLEAN
+RingStressTest(
+    VOID
+    )
+{
+    PTEST_RING  ring;
+    ULONG64     microseconds;
+    BOOLEAN     passed = FALSE;
+
+    ring = _aligned_malloc(sizeof(TEST_RING), 64);
+    if (ring == NULL) {
+        return FALSE;
+    }
+    ZeroMemory(ring, sizeof(TEST_RING));
+
+    ring->Words = RING_STRESS_WORDS;
+    ring->Verify = TRUE;
+
+    if (RunRing(ring, &microseconds)) {
+
+        printf("  %I64d words, %I64d errors, ring held at most %d of %d, "
+               "looked empty to the device %I64d times\n",
+               ring->Words, ring->Errors, ring->MaxCount, RING_SIZE,
+               ring->LooksEmpty);
+
+        passed = (ring->Errors == 0 &&
+                  ring->LooksEmpty == 0 &&
+                  ring->MaxCount <= MP_RING_CAPACITY(RING_SIZE) &&
+                  ring->Head == ring->Tail &&
+                  ring->Tail == (ULONG)(RING_FIRST_INDEX + ring->Words));
+    }
+
+    _aligned_free(ring);
+    return passed;
+}
+
+BOOLEAN
+RingThroughputTest(
+    VOID
+    )
+{
+    PTEST_RING  ring;
+    ULONG64     microseconds;
+    BOOLEAN     passed = FALSE;
+
+    ring = _aligned_malloc(sizeof(TEST_RING), 64);
+    if (ring == NULL) {
+        return FALSE;
+    }
+    ZeroMemory(ring, sizeof(TEST_RING));
+
+    ring->Words = RING_THROUGHPUT_WORDS;
+    ring->Verify = FALSE;
+
+    if (RunRing(ring, &microseconds)) {
+
+        printf("  %I64d words in %I64d us, %I64d words/sec, %I64d ns/word\n",
+               ring->Words, microseconds,
+               microseconds ? ring->Words * 1000000 / microseconds : 0,
+               microseconds * 1000 / ring->Words);
+
+        passed = (ring->Head == ring->Tail);
+    }
+
+    _aligned_free(ring);
+    return passed;
+}
+
+BOOLEAN
+RingFullTest(
+    VOID
+    )
+/*++
+
+    Fill the ring the way NICWritePacket does, at indices around the wrap
+    of the slot index and of the ULONG, and check that the doorbell index
+    of a full ring isn't the head's, which the device would take for an
+    empty ring. One entry more, the NumTcb in flight the driver used to
+    allow, would be.
+ --*/
+{
+    static const ULONG  firstIndex[] = {
+        0,
+        RING_SIZE - 1,
+        RING_SIZE,
+        RING_FIRST_INDEX,
+        0xFFFFFFFF - RING_SIZE / 2,
+        0xFFFFFFFF,
+    };
+    volatile ULONG  head, tail;
+    ULONG           index;
+    ULONG           posted;
+    BOOLEAN         passed = TRUE;
+
+    for (index = 0; index < sizeof(firstIndex) / sizeof(firstIndex[0]); index++) {
+
+        head = firstIndex[index];
+        tail = head;
+        posted = 0;
+
+        while (MP_RING_COUNT(&head, &tail) < MP_RING_CAPACITY(RING_SIZE)) {
+            MP_STORE_RELEASE(&tail, tail + 1);
+            posted++;
+        }
+
+        CHECK(posted == RING_SIZE - 1);
+        CHECK(MP_RING_DEVICE_INDEX(tail, RING_SIZE) !=
+              MP_RING_DEVICE_INDEX(head, RING_SIZE));
+        CHECK(MP_RING_DEVICE_INDEX(tail + 1, RING_SIZE) ==
+              MP_RING_DEVICE_INDEX(head, RING_SIZE));
+
+        //
+        // And as the consumer hands entries back, down to empty.
+        //
+        while (head != tail) {
+            MP_STORE_RELEASE(&head, head + 1);
+            CHECK((head == tail) ==
+                  (MP_RING_DEVICE_INDEX(tail, RING_SIZE) ==
+                   MP_RING_DEVICE_INDEX(head, RING_SIZE)));
+        }
+    }
+
+    return passed;
+}
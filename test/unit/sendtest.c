@@ -0,0 +1,380 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name: sendtest.c
+
+
+Abstract:
+
+    Runs the send path against a simulated device and reports the
+    words/sec it reaches when each TCB carries 1, 4 or
+    NIC_MAX_COALESCE_REQUESTS (NIC_MAX_PHYS_BUF_COUNT) one-word writes.
+
+    A driver thread plays NICCheckForQueuedSends and NICSendPacket. It
+    turns the queued words into a scatter/gather list of one element per
+    write and encodes it with NICEncodeTbds. It fills at most
+    MP_RING_CAPACITY TCBs, writes the command last and rings the doorbell
+    once per batch with MP_RING_DEVICE_INDEX of the tail. It also plays
+    NICHandleSendInterrupt, reclaiming TCBs from the head up to the first
+    one without HW_TCB_STATUS_COMPLETE.
+
+    A device thread plays the device. It fetches the TCBs up to the
+    doorbell index and reads every word through the addresses of the TBDs.
+    It checks that each word is the next in sequence, then sets COMPLETE.
+
+    The figures are for the descriptor protocol and the CPU work around
+    it; a real device adds its DMA and doorbell latencies. They only mean
+    something with two processors.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "pcitest.h"
+
+//
+// A power of two, like NumTcb
+//
+#define SEND_NUM_TCB            64
+
+#define SEND_WORDS              8000000
+#define SEND_WORD_SIZE          4
+
+#define SEND_FIRST_INDEX        0xFFFFFF00
+
+//
+// Logical address of the first word. Above 4GB, as the 64-bit TBDs
+// allow.
+//
+#define SEND_DMA_BASE           0x100000000
+
+//
+// Give up if the device completes nothing for this long: a full ring
+// that looked empty to it would leave both sides waiting.
+//
+#define SEND_STALL_US           5000000
+
+typedef struct _SEND_SIM
+{
+    //
+    // The TCB and TBD arrays of the send common buffer
+    //
+    DECLSPEC_ALIGN(64) HW_TCB Tcb[SEND_NUM_TCB];
+    DECLSPEC_ALIGN(64) HW_TBD Tbd[SEND_NUM_TCB][NIC_MAX_PHYS_BUF_COUNT];
+
+    //
+    // The producer index CSR, and the driver's free running indices
+    //
+    DECLSPEC_ALIGN(64) volatile ULONG Doorbell;
+    DECLSPEC_ALIGN(64) volatile ULONG Stop;
+    DECLSPEC_ALIGN(64) ULONG SendHead;
+    ULONG           SendTail;
+
+    PULONG          Words;          // what the TBDs point into
+    ULONG           Count;
+    ULONG           Coalesce;       // writes per TCB
+
+    ULONG64         Received;
+    ULONG64         Errors;
+    ULONG64         Doorbells;
+    ULONG64         DoorbellTcbs;
+    ULONG           MaxBusy;
+    BOOLEAN         Stalled;
+    BOOLEAN         SingleProcessor;
+} SEND_SIM, *PSEND_SIM;
+
+__inline VOID
+SendWait(
+    __in PSEND_SIM Sim
+    )
+{
+    if (Sim->SingleProcessor) {
+        SwitchToThread();
+    } else {
+        YieldProcessor();
+    }
+}
+
+DWORD WINAPI
+SendDevice(
+    __in LPVOID Context
+    )
+{
+    PSEND_SIM   sim = (PSEND_SIM)Context;
+    PHW_TCB     tcb;
+    PHW_TBD     tbd;
+    ULONG       index = MP_RING_DEVICE_INDEX(SEND_FIRST_INDEX, SEND_NUM_TCB);
+    ULONG       producer;
+    ULONG       word;
+    ULONG       offset;
+    UCHAR       tbdIndex;
+
+    while (!MP_LOAD_ACQUIRE(&sim->Stop)) {
+
+        producer = MP_LOAD_ACQUIRE(&sim->Doorbell);
+        if (producer == index) {
+            SendWait(sim);
+            continue;
+        }
+
+        while (index != producer) {
+
+            tcb = &sim->Tcb[index];
+            tbd = sim->Tbd[index];
+
+            if (tcb->TxCbCommand != (HW_TCB_CMD_TRANSMIT | HW_TCB_CMD_FLEXIBLE) ||
+                tcb->TxCbByteCount != (ULONG)tcb->TxCbTbdNumber * SEND_WORD_SIZE) {
+                if (sim->Errors++ < 10) {
+                    printf("  TCB %d: command %x, %d bytes in %d TBDs\n",
+                           index, tcb->TxCbCommand, tcb->TxCbByteCount,
+                           tcb->TxCbTbdNumber);
+                }
+            }
+
+            for (tbdIndex = 0; tbdIndex < tcb->TxCbTbdNumber; tbdIndex++) {
+
+                offset = (ULONG)(tbd[tbdIndex].TbdBufferAddress - SEND_DMA_BASE);
+                word = sim->Words[offset / SEND_WORD_SIZE];
+
+                if (tbd[tbdIndex].TbdCount != SEND_WORD_SIZE ||
+                    word != (ULONG)sim->Received) {
+                    if (sim->Errors++ < 10) {
+                        printf("  TCB %d TBD %d: word %d of %d bytes, expected %I64d\n",
+                               index, tbdIndex, word, tbd[tbdIndex].TbdCount,
+                               sim->Received);
+                    }
+                }
+                sim->Received++;
+            }
+
+            MP_STORE_RELEASE((volatile ULONG *)&tcb->TxCbStatus,
+                             HW_TCB_STATUS_COMPLETE | HW_TCB_STATUS_OK);
+
+            index = MP_RING_DEVICE_INDEX(index + 1, SEND_NUM_TCB);
+        }
+    }
+
+    return 0;
+}
+
+DWORD WINAPI
+SendDriver(
+    __in LPVOID Context
+    )
+{
+    PSEND_SIM       sim = (PSEND_SIM)Context;
+    PHW_TCB         tcb;
+    TEST_SG_LIST    sgList;
+    LARGE_INTEGER   lastProgress, now, frequency;
+    ULONG           next = 0;
+    ULONG           completed = 0;
+    ULONG           slot;
+    ULONG           posted;
+    ULONG           byteCount;
+    ULONG           highFragments;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&lastProgress);
+
+    while (completed < sim->Count) {
+
+        //
+        // NICHandleSendInterrupt
+        //
+        while (sim->SendHead != sim->SendTail) {
+
+            tcb = &sim->Tcb[MP_RING_DEVICE_INDEX(sim->SendHead, SEND_NUM_TCB)];
+
+            if (!(MP_LOAD_ACQUIRE((volatile ULONG *)&tcb->TxCbStatus) &
+                  HW_TCB_STATUS_COMPLETE)) {
+                break;
+            }
+
+            completed += tcb->TxCbTbdNumber;
+            sim->SendHead++;
+            QueryPerformanceCounter(&lastProgress);
+        }
+
+        //
+        // NICCheckForQueuedSends: a TCB per Coalesce queued words while
+        // the ring has room, then one doorbell for all of them.
+        //
+        posted = 0;
+
+        while (next < sim->Count &&
+               sim->SendTail - sim->SendHead < MP_RING_CAPACITY(SEND_NUM_TCB)) {
+
+            slot = MP_RING_DEVICE_INDEX(sim->SendTail, SEND_NUM_TCB);
+            tcb = &sim->Tcb[slot];
+
+            sgList.List.NumberOfElements = 0;
+            while (sgList.List.NumberOfElements < sim->Coalesce && next < sim->Count) {
+                AddElement(&sgList, SEND_DMA_BASE + (ULONG64)next * SEND_WORD_SIZE,
+                           SEND_WORD_SIZE);
+                next++;
+            }
+
+            tcb->TxCbStatus = 0;
+            tcb->TxCbTbdNumber = NICEncodeTbds(sim->Tbd[slot], &sgList.List,
+                                               &byteCount, &highFragments);
+            tcb->TxCbByteCount = byteCount;
+            tcb->TxCbThreshold = 0;
+
+            KeMemoryBarrier();
+
+            tcb->TxCbCommand = HW_TCB_CMD_TRANSMIT | HW_TCB_CMD_FLEXIBLE;
+
+            sim->SendTail++;
+            posted++;
+        }
+
+        if (sim->SendTail - sim->SendHead > sim->MaxBusy) {
+            sim->MaxBusy = sim->SendTail - sim->SendHead;
+        }
+
+        if (posted) {
+            MP_STORE_RELEASE(&sim->Doorbell,
+                             MP_RING_DEVICE_INDEX(sim->SendTail, SEND_NUM_TCB));
+            sim->Doorbells++;
+            sim->DoorbellTcbs += posted;
+            continue;
+        }
+
+        QueryPerformanceCounter(&now);
+        if (ELAPSED_US(lastProgress, now, frequency) > SEND_STALL_US) {
+            sim->Stalled = TRUE;
+            break;
+        }
+
+        SendWait(sim);
+    }
+
+    MP_STORE_RELEASE(&sim->Stop, TRUE);
+
+    return 0;
+}
+
+BOOLEAN
+RunSend(
+    __in PSEND_SIM Sim,
+    __out PULONG64 Microseconds
+    )
+{
+    HANDLE          threads[2];
+    SYSTEM_INFO     systemInfo;
+    LARGE_INTEGER   start, end, frequency;
+
+    ZeroMemory(Sim->Tcb, sizeof(Sim->Tcb));
+    Sim->SendHead = SEND_FIRST_INDEX;
+    Sim->SendTail = SEND_FIRST_INDEX;
+    Sim->Doorbell = MP_RING_DEVICE_INDEX(SEND_FIRST_INDEX, SEND_NUM_TCB);
+    Sim->Stop = FALSE;
+    Sim->Received = 0;
+    Sim->Errors = 0;
+    Sim->Doorbells = 0;
+    Sim->DoorbellTcbs = 0;
+    Sim->MaxBusy = 0;
+    Sim->Stalled = FALSE;
+
+    threads[0] = CreateThread(NULL, 0, SendDevice, Sim, CREATE_SUSPENDED, NULL);
+    threads[1] = CreateThread(NULL, 0, SendDriver, Sim, CREATE_SUSPENDED, NULL);
+
+    if (threads[0] == NULL || threads[1] == NULL) {
+        printf("  CreateThread failed %x\n", GetLastError());
+        return FALSE;
+    }
+
+    GetSystemInfo(&systemInfo);
+    if (systemInfo.dwNumberOfProcessors > 1) {
+        SetThreadAffinityMask(threads[0], 1);
+        SetThreadAffinityMask(threads[1], 2);
+        Sim->SingleProcessor = FALSE;
+    } else {
+        Sim->SingleProcessor = TRUE;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    ResumeThread(threads[0]);
+    ResumeThread(threads[1]);
+
+    WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    CloseHandle(threads[0]);
+    CloseHandle(threads[1]);
+
+    *Microseconds = ELAPSED_US(start, end, frequency);
+
+    return TRUE;
+}
+
+BOOLEAN
+SendSimulationTest(
+    VOID
+    )
+{
+    static const ULONG  coalesce[] = { 1, 4, NIC_MAX_PHYS_BUF_COUNT };
+    PSEND_SIM           sim;
+    ULONG64             microseconds;
+    ULONG               index;
+    BOOLEAN             passed = TRUE;
+
+    sim = _aligned_malloc(sizeof(SEND_SIM), 64);
+    if (sim == NULL) {
+        return FALSE;
+    }
+    ZeroMemory(sim, sizeof(SEND_SIM));
+
+    sim->Count = SEND_WORDS;
+    sim->Words = malloc(SEND_WORDS * sizeof(ULONG));
+    if (sim->Words == NULL) {
+        _aligned_free(sim);
+        return FALSE;
+    }
+
+    for (index = 0; index < SEND_WORDS; index++) {
+        sim->Words[index] = index;
+    }
+
+    for (index = 0; index < sizeof(coalesce) / sizeof(coalesce[0]); index++) {
+
+        sim->Coalesce = coalesce[index];
+
+        if (!RunSend(sim, &microseconds)) {
+            passed = FALSE;
+            break;
+        }
+
+        if (index == 0 && sim->SingleProcessor) {
+            printf("  one processor, driver and device share it\n");
+        }
+
+        printf("  %d words per TCB: %I64d words in %I64d us, %I64d words/sec, "
+               "%.2f TCBs per doorbell, at most %d of %d TCBs busy\n",
+               sim->Coalesce, sim->Received, microseconds,
+               microseconds ? sim->Received * 1000000 / microseconds : 0,
+               sim->Doorbells ? (double)sim->DoorbellTcbs / sim->Doorbells : 0.0,
+               sim->MaxBusy, SEND_NUM_TCB);
+
+        CHECK(!sim->Stalled);
+        CHECK(sim->Errors == 0);
+        CHECK(sim->Received == SEND_WORDS);
+        CHECK(sim->SendHead == sim->SendTail);
+        CHECK(sim->MaxBusy <= MP_RING_CAPACITY(SEND_NUM_TCB));
+    }
+
+    free(sim->Words);
+    _aligned_free(sim);
+    return passed;
+}
@@ -0,0 +1,198 @@
+/*++
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name: tbdtest.c
+
+
+Abstract:
+
+    Tests of the send descriptors of nic_hw.h: the HW_TCB and HW_TBD
+    layout the device expects, and NICEncodeTbds, which NICSendPacket and
+    the zero-copy receive path use to turn a scatter/gather list into
+    TBDs. Also times the encoder on a full list.
+
+Environment:
+
+    User mode only.
+
+--*/
+
+#include "pcitest.h"
+
+#define TBD_THROUGHPUT_LISTS    10000000
+
+//
+// A TBD the encoder must not have touched
+//
+#define TBD_UNTOUCHED           0xA5A5A5A5A5A5A5A5
+
+VOID
+AddElement(
+    __inout PTEST_SG_LIST SgList,
+    __in ULONG64 Address,
+    __in ULONG Length
+    )
+{
+    PSCATTER_GATHER_ELEMENT element;
+
+    element = &SgList->List.Elements[SgList->List.NumberOfElements++];
+    element->Address.QuadPart = Address;
+    element->Length = Length;
+}
+
+BOOLEAN
+TbdLayoutTest(
+    VOID
+    )
+{
+    BOOLEAN passed = TRUE;
+
+    CHECK(sizeof(HW_TBD) == 16);
+    CHECK(FIELD_OFFSET(HW_TBD, TbdBufferAddress) == 0);
+    CHECK(FIELD_OFFSET(HW_TBD, TbdCount) == 8);
+
+    CHECK(sizeof(HW_TCB) == MP_CACHE_LINE_SIZE);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbStatus) == 0);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbCommand) == 4);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbLink) == 8);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbTbdPointer) == 16);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbByteCount) == 24);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbTbdNumber) == 28);
+    CHECK(FIELD_OFFSET(HW_TCB, TxCbThreshold) == 29);
+
+    return passed;
+}
+
+BOOLEAN
+TbdEncodeTest(
+    VOID
+    )
+{
+    TEST_SG_LIST    sgList;
+    HW_TBD          tbds[NIC_MAX_PHYS_BUF_COUNT];
+    ULONG           byteCount;
+    ULONG           highFragments;
+    UCHAR           count;
+    ULONG           index;
+    BOOLEAN         passed = TRUE;
+
+    //
+    // One fragment
+    //
+    FillMemory(tbds, sizeof(tbds), 0xA5);
+    sgList.List.NumberOfElements = 0;
+    AddElement(&sgList, 0x12345000, 4);
+
+    count = NICEncodeTbds(tbds, &sgList.List, &byteCount, &highFragments);
+
+    CHECK(count == 1);
+    CHECK(byteCount == 4);
+    CHECK(highFragments == 0);
+    CHECK(tbds[0].TbdBufferAddress == 0x12345000);
+    CHECK(tbds[0].TbdCount == 4);
+    CHECK(tbds[1].TbdBufferAddress == TBD_UNTOUCHED);
+
+    //
+    // Empty elements are skipped and the TBDs stay packed; a fragment
+    // above 4GB keeps its high bits and is counted.
+    //
+    FillMemory(tbds, sizeof(tbds), 0xA5);
+    sgList.List.NumberOfElements = 0;
+    AddElement(&sgList, 0x1000, 0);
+    AddElement(&sgList, 0x2000, 0x800);
+    AddElement(&sgList, 0x3000, 0);
+    AddElement(&sgList, 0x123456789000, 0x1000);
+    AddElement(&sgList, 0x4000, 4);
+
+    count = NICEncodeTbds(tbds, &sgList.List, &byteCount, &highFragments);
+
+    CHECK(count == 3);
+    CHECK(byteCount == 0x1804);
+    CHECK(highFragments == 1);
+    CHECK(tbds[0].TbdBufferAddress == 0x2000);
+    CHECK(tbds[0].TbdCount == 0x800);
+    CHECK(tbds[1].TbdBufferAddress == 0x123456789000);
+    CHECK(tbds[1].TbdCount == 0x1000);
+    CHECK(tbds[2].TbdBufferAddress == 0x4000);
+    CHECK(tbds[2].TbdCount == 4);
+    CHECK(tbds[3].TbdBufferAddress == TBD_UNTOUCHED);
+
+    //
+    // A full list, as a coalesced transaction of NIC_MAX_COALESCE_REQUESTS
+    // words produces it
+    //
+    FillMemory(tbds, sizeof(tbds), 0xA5);
+    sgList.List.NumberOfElements = 0;
+    for (index = 0; index < NIC_MAX_PHYS_BUF_COUNT; index++) {
+        AddElement(&sgList, ((ULONG64)index << 32) + 0x10 * index, 4);
+    }
+
+    count = NICEncodeTbds(tbds, &sgList.List, &byteCount, &highFragments);
+
+    CHECK(count == NIC_MAX_PHYS_BUF_COUNT);
+    CHECK(byteCount == 4 * NIC_MAX_PHYS_BUF_COUNT);
+    CHECK(highFragments == NIC_MAX_PHYS_BUF_COUNT - 1);
+    for (index = 0; index < NIC_MAX_PHYS_BUF_COUNT; index++) {
+        CHECK(tbds[index].TbdBufferAddress == ((ULONG64)index << 32) + 0x10 * index);
+        CHECK(tbds[index].TbdCount == 4);
+    }
+
+    //
+    // Nothing but empty elements
+    //
+    FillMemory(tbds, sizeof(tbds), 0xA5);
+    sgList.List.NumberOfElements = 0;
+    AddElement(&sgList, 0x1000, 0);
+
+    count = NICEncodeTbds(tbds, &sgList.List, &byteCount, &highFragments);
+
+    CHECK(count == 0);
+    CHECK(byteCount == 0);
+    CHECK(highFragments == 0);
+    CHECK(tbds[0].TbdBufferAddress == TBD_UNTOUCHED);
+
+    return passed;
+}
+
+BOOLEAN
+TbdThroughputTest(
+    VOID
+    )
+{
+    TEST_SG_LIST        sgList;
+    HW_TBD              tbds[NIC_MAX_PHYS_BUF_COUNT];
+    ULONG               byteCount;
+    ULONG               highFragments;
+    volatile ULONG64    total = 0;
+    ULONG               index;
+    ULONG64             microseconds;
+    LARGE_INTEGER       start, end, frequency;
+
+    sgList.List.NumberOfElements = 0;
+    for (index = 0; index < NIC_MAX_PHYS_BUF_COUNT; index++) {
+        AddElement(&sgList, 0x10000 * index, 4);
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (index = 0; index < TBD_THROUGHPUT_LISTS; index++) {
+        total += NICEncodeTbds(tbds, &sgList.List, &byteCount, &highFragments);
+    }
+
+    QueryPerformanceCounter(&end);
+
+    microseconds = ELAPSED_US(start, end, frequency);
+
+    printf("  %d lists of %d fragments in %I64d us, %I64d ns/list\n",
+           TBD_THROUGHPUT_LISTS, NIC_MAX_PHYS_BUF_COUNT, microseconds,
+           microseconds * 1000 / TBD_THROUGHPUT_LISTS);
+
+    return (total == (ULONG64)TBD_THROUGHPUT_LISTS * NIC_MAX_PHYS_BUF_COUNT);
+}